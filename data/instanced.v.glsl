@@ -0,0 +1,34 @@
+#version 330 core
+
+layout(std140) uniform Frame {
+	mat4 uProj;
+	mat4 uView;
+	vec3 light_pos, light_ambient, light_diffuse, light_specular;
+};
+
+in vec3 aPosition;
+in vec3 aNormal;
+in vec4 aInstancePosition; /* Position in eye space, radius in w */
+in vec4 aInstanceOrientation; /* Unit quaternion, w first */
+
+out vec3 vNormal;
+out vec3 L, E;
+
+vec3 rotate(vec4 q, vec3 v)
+{
+	vec3 t = 2 * cross(q.yzw, v);
+	return v + q.x * t + cross(q.yzw, t);
+}
+
+void main(void)
+{
+	mat3 view_rotation = mat3(uView);
+	vec3 eye_pos = aInstancePosition.xyz + view_rotation *
+			rotate(aInstanceOrientation, aPosition) * aInstancePosition.w;
+	gl_Position = uProj * vec4(eye_pos, 1.0);
+
+	L = normalize(light_pos - eye_pos);
+	E = -normalize(eye_pos);
+	vNormal = view_rotation * rotate(aInstanceOrientation, aNormal);
+}
+
@@ -1,9 +1,10 @@
 #version 330 core
 
-uniform mat4 uProj;
-uniform mat4 uView;
-uniform mat4 uModel;
-uniform vec3 light_pos, light_ambient, light_diffuse, light_specular;
+layout(std140) uniform Frame {
+	mat4 uProj;
+	mat4 uView;
+	vec3 light_pos, light_ambient, light_diffuse, light_specular;
+};
 
 in vec3 vNormal;
 in vec3 L, E;
@@ -1,9 +1,13 @@
 #version 330 core
 
-uniform mat4 uProj;
+/* Set once per frame for every shader, see frame_upload_to_gpu() */
+layout(std140) uniform Frame {
+	mat4 uProj;
+	mat4 uView;
+	vec3 light_pos, light_ambient, light_diffuse, light_specular;
+};
+
 uniform mat4 uModel;
-uniform mat4 uView;
-uniform vec3 light_pos, light_ambient, light_diffuse, light_specular;
 
 in vec3 aPosition;
 in vec3 aNormal;
@@ -1,7 +1,11 @@
 #version 330 core
 
-uniform mat4 uProj;
-uniform mat4 uView;
+layout(std140) uniform Frame {
+	mat4 uProj;
+	mat4 uView;
+	vec3 light_pos, light_ambient, light_diffuse, light_specular;
+};
+
 uniform mat4 uModel;
 
 in vec3 aPosition;
@@ -0,0 +1,458 @@
+#include <limits.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ralloc.h>
+
+#include "approach.h"
+#include "log.h"
+
+#define MAX_CELLS 64 /* Bodies spanning more are tested against everyone */
+
+typedef struct Search {
+	SolarSystem *solsys;
+	double start, end, slab, threshold;
+	const double *max_speed; /* Bound on the speed around the root */
+	const double *time_scale; /* Sample spacing to catch every minimum */
+
+	/* Per slab, allocated by the workers without a parent. A count of
+	 * -1 marks a slab that ran out of memory. */
+	Approach **found;
+	int *num_found;
+} Search;
+
+typedef struct CellEntry {
+	long x, y, z;
+	int body;
+} CellEntry;
+
+/* The events of one slab as they are found */
+typedef struct Events {
+	Approach *event;
+	int num, capacity;
+} Events;
+
+/* Half the derivative of the squared distance between a and b, which goes
+ * from negative to positive at a minimum. Also the distance itself. */
+static double approach_rate(SolarSystem *solsys, int a, int b, double t,
+		double *distance)
+{
+	Vec3 pa, va, pb, vb, d;
+
+	solsys_state_at_time(solsys, a, t, &pa, &va);
+	solsys_state_at_time(solsys, b, t, &pb, &vb);
+	d = vec3_sub(pa, pb);
+	if (distance != NULL)
+		*distance = vec3_length(d);
+
+	return vec3_dot(d, vec3_sub(va, vb));
+}
+
+static bool add_event(Events *events, int a, int b, double t,
+		double distance)
+{
+	Approach *e;
+
+	if (events->num == events->capacity)
+	{
+		int capacity = MAX(16, 2 * events->capacity);
+
+		e = reralloc(NULL, events->event, Approach, capacity);
+		if (e == NULL)
+			return false;
+		events->event = e;
+		events->capacity = capacity;
+	}
+
+	e = &events->event[events->num++];
+	e->body[0] = MIN(a, b);
+	e->body[1] = MAX(a, b);
+	e->t = t;
+	e->distance = distance;
+
+	return true;
+}
+
+/* The rate goes from fu < 0 at u to fw >= 0 at w. Regula falsi with the
+ * Illinois modification, so a lopsided interval still shrinks. */
+static double find_minimum(SolarSystem *solsys, int a, int b, double u,
+		double fu, double w, double fw)
+{
+	const int MAX_ITERATIONS = 100;
+	double t = w, prev;
+	int iter, side = 0;
+
+	for (iter = 0; iter < MAX_ITERATIONS && w - u > SOLSYS_TIME_TOLERANCE;
+			iter++)
+	{
+		double ft;
+
+		prev = t;
+		t = (u * fw - w * fu) / (fw - fu);
+		if (!(t > u && t < w)) /* Rounding */
+			t = 0.5 * (u + w);
+		ft = approach_rate(solsys, a, b, t, NULL);
+		if (ft < 0)
+		{
+			u = t;
+			fu = ft;
+			if (side == -1)
+				fw *= 0.5;
+			side = -1;
+		} else
+		{
+			w = t;
+			fw = ft;
+			if (side == 1)
+				fu *= 0.5;
+			side = 1;
+		}
+		if (ft == 0 || fabs(t - prev) < SOLSYS_TIME_TOLERANCE)
+			break;
+	}
+
+	return t;
+}
+
+/* Follow the distance between a and b from t0 to t1 and note every minimum
+ * closer than the threshold. A minimum is only counted in the interval
+ * where it is the right end, or at the very start of the window, so
+ * neighbouring slabs don't both find it. */
+static bool refine_pair(const Search *search, Events *events, int a, int b,
+		double t0, double t1)
+{
+	SolarSystem *solsys = search->solsys;
+	double h = MIN(search->time_scale[a], search->time_scale[b]);
+	int k, steps = MAX(1, (int) ceil((t1 - t0) / h));
+	double u = t0, fu, du, w, fw, dw;
+
+	fu = approach_rate(solsys, a, b, u, &du);
+	if (t0 == search->start && fu >= 0 && du < search->threshold)
+		if (!add_event(events, a, b, t0, du))
+			return false;
+
+	for (k = 1; k <= steps; k++, u = w, fu = fw, du = dw)
+	{
+		w = (k == steps ? t1 : t0 + (t1 - t0) * k / steps);
+		fw = approach_rate(solsys, a, b, w, &dw);
+
+		if (fu < 0 && fw >= 0)
+		{
+			double t = find_minimum(solsys, a, b, u, fu, w, fw), d;
+
+			approach_rate(solsys, a, b, t, &d);
+			if (d < search->threshold && !add_event(events, a, b, t, d))
+				return false;
+		}
+	}
+
+	/* Still closing in when the window ends */
+	if (t1 == search->end && fu < 0 && du < search->threshold)
+		if (!add_event(events, a, b, t1, du))
+			return false;
+
+	return true;
+}
+
+static bool same_cell(const CellEntry *a, const CellEntry *b)
+{
+	return a->x == b->x && a->y == b->y && a->z == b->z;
+}
+
+static int compare_cells(const void *p, const void *q)
+{
+	const CellEntry *a = p, *b = q;
+
+	if (a->x != b->x)
+		return a->x < b->x ? -1 : 1;
+	if (a->y != b->y)
+		return a->y < b->y ? -1 : 1;
+	if (a->z != b->z)
+		return a->z < b->z ? -1 : 1;
+	return a->body - b->body;
+}
+
+static int compare_doubles(const void *p, const void *q)
+{
+	double a = *(const double *) p, b = *(const double *) q;
+
+	return (a > b) - (a < b);
+}
+
+static int compare_events(const void *p, const void *q)
+{
+	const Approach *a = p, *b = q;
+
+	if (a->t != b->t)
+		return a->t < b->t ? -1 : 1;
+	if (a->body[0] != b->body[0])
+		return a->body[0] - b->body[0];
+	return a->body[1] - b->body[1];
+}
+
+/* Whether the spheres of a and b, grown by the threshold, touch */
+static bool spheres_meet(const Vec3 *centre, const double *radius,
+		double threshold, int a, int b)
+{
+	Vec3 d = vec3_sub(centre[a], centre[b]);
+	double reach = radius[a] + radius[b] + threshold;
+
+	return vec3_dot(d, d) <= reach * reach;
+}
+
+/* The number of cells a box reaching that far from centre overlaps, and
+ * optionally their range */
+static double cell_range(Vec3 centre, double reach, double cell, long *lo,
+		long *hi)
+{
+	double l[3], h[3];
+
+	l[0] = floor((centre.x - reach) / cell);
+	l[1] = floor((centre.y - reach) / cell);
+	l[2] = floor((centre.z - reach) / cell);
+	h[0] = floor((centre.x + reach) / cell);
+	h[1] = floor((centre.y + reach) / cell);
+	h[2] = floor((centre.z + reach) / cell);
+	if (lo != NULL)
+	{
+		lo[0] = l[0]; lo[1] = l[1]; lo[2] = l[2];
+		hi[0] = h[0]; hi[1] = h[1]; hi[2] = h[2];
+	}
+
+	return (h[0] - l[0] + 1) * (h[1] - l[1] + 1) * (h[2] - l[2] + 1);
+}
+
+/* Find the candidate pairs of one slab and refine them */
+static bool search_slab(const Search *search, void *ctx, Events *events,
+		double t0, double t1)
+{
+	SolarSystem *solsys = search->solsys;
+	int i, j, k, n = solsys->num_bodies, num_entries = 0, num_big = 0;
+	double margin = 0.5 * search->threshold, cell;
+	Vec3 *centre;
+	double *radius, *sorted;
+	CellEntry *entry;
+	int *big;
+	bool *is_big;
+
+	centre = ralloc_array(ctx, Vec3, n);
+	radius = ralloc_array(ctx, double, n);
+	sorted = ralloc_array(ctx, double, n);
+	big = ralloc_array(ctx, int, n);
+	is_big = rzalloc_array(ctx, bool, n);
+	if (centre == NULL || radius == NULL || sorted == NULL ||
+			big == NULL || is_big == NULL)
+		return false;
+
+	for (k = 0; k < n; k++)
+	{
+		int primary = solsys->order_primary[k];
+
+		i = solsys->order[k];
+		centre[i] = (Vec3) {0, 0, 0};
+		if (primary >= 0)
+			centre[i] = vec3_add(centre[primary], kepler_position_at_time(
+					&solsys->body[i].orbit, 0.5 * (t0 + t1)));
+		radius[i] = search->max_speed[i] * 0.5 * (t1 - t0);
+		sorted[i] = radius[i];
+	}
+
+	/* Cells that fit a typical body with room to spare, so most of them
+	 * land in at most eight */
+	qsort(sorted, n, sizeof(double), compare_doubles);
+	cell = search->threshold + 2 * sorted[n / 2];
+
+	for (i = 0; i < n; i++)
+	{
+		double cells = cell_range(centre[i], radius[i] + margin, cell,
+				NULL, NULL);
+
+		if (cells > MAX_CELLS)
+		{
+			big[num_big++] = i;
+			is_big[i] = true;
+		} else
+			num_entries += cells;
+	}
+	entry = ralloc_array(ctx, CellEntry, MAX(1, num_entries));
+	if (entry == NULL)
+		return false;
+
+	for (i = 0, num_entries = 0; i < n; i++)
+	{
+		long lo[3], hi[3], x, y, z;
+
+		if (is_big[i])
+			continue;
+		cell_range(centre[i], radius[i] + margin, cell, lo, hi);
+		for (x = lo[0]; x <= hi[0]; x++)
+		for (y = lo[1]; y <= hi[1]; y++)
+		for (z = lo[2]; z <= hi[2]; z++)
+		{
+			entry[num_entries].x = x;
+			entry[num_entries].y = y;
+			entry[num_entries].z = z;
+			entry[num_entries].body = i;
+			num_entries++;
+		}
+	}
+	qsort(entry, num_entries, sizeof(CellEntry), compare_cells);
+
+	/* Pairs sharing a cell. The boxes of a pair overlap in a box of
+	 * their own, and only the cell holding its low corner counts the
+	 * pair, since they may share more cells than one. */
+	for (i = 0; i < num_entries; i = j)
+	{
+		int p, q;
+
+		for (j = i + 1; j < num_entries; j++)
+			if (!same_cell(&entry[i], &entry[j]))
+				break;
+
+		for (p = i; p < j; p++)
+			for (q = p + 1; q < j; q++)
+			{
+				int a = entry[p].body, b = entry[q].body;
+				double ra = radius[a] + margin, rb = radius[b] + margin;
+
+				if (floor(MAX(centre[a].x - ra, centre[b].x - rb) / cell) !=
+						entry[i].x ||
+						floor(MAX(centre[a].y - ra, centre[b].y - rb) /
+						cell) != entry[i].y ||
+						floor(MAX(centre[a].z - ra, centre[b].z - rb) /
+						cell) != entry[i].z)
+					continue;
+				if (spheres_meet(centre, radius, search->threshold, a, b) &&
+						!refine_pair(search, events, a, b, t0, t1))
+					return false;
+			}
+	}
+
+	/* Big bodies against everyone, and each pair of them once */
+	for (k = 0; k < num_big; k++)
+		for (j = 0; j < n; j++)
+		{
+			int a = big[k];
+
+			if (j == a || (is_big[j] && j < a))
+				continue;
+			if (spheres_meet(centre, radius, search->threshold, a, j) &&
+					!refine_pair(search, events, a, j, t0, t1))
+				return false;
+		}
+
+	return true;
+}
+
+static void search_slabs(void *data, int begin, int end)
+{
+	Search *search = data;
+	int s;
+
+	for (s = begin; s < end; s++)
+	{
+		double t0 = search->start + s * search->slab;
+		double t1 = MIN(search->end, t0 + search->slab);
+		void *ctx = ralloc_context(NULL);
+		Events events = {NULL, 0, 0};
+		bool ok;
+
+		ok = (ctx != NULL && search_slab(search, ctx, &events, t0, t1));
+		ralloc_free(ctx);
+
+		if (events.num > 0)
+			qsort(events.event, events.num, sizeof(Approach),
+					compare_events);
+		search->found[s] = events.event;
+		search->num_found[s] = (ok ? events.num : -1);
+	}
+}
+
+/* Every time two bodies come closer than threshold metres between start
+ * and end, at the minima of their distance, sorted by time. Slabs of the
+ * given length should be short enough that most bodies don't sweep out
+ * much more than the threshold. Returns NULL on failure. */
+Approach *solsys_find_approaches(void *ctx, SolarSystem *solsys,
+		double start, double end, double slab, double threshold,
+		int *num_approaches)
+{
+	void *tmp;
+	Search search;
+	double *max_speed, *time_scale;
+	Approach *result = NULL;
+	bool failed = false;
+	int i, k, num_slabs, total = 0;
+
+	if (!(slab > 0) || !(threshold > 0) || !(end >= start) ||
+			(end - start) / slab >= INT_MAX)
+	{
+		log_err("Invalid close approach search\n");
+		return NULL;
+	}
+	num_slabs = MAX(1, (int) ceil((end - start) / slab));
+
+	tmp = ralloc_context(NULL);
+	max_speed = solsys_max_speeds(tmp, solsys);
+	time_scale = ralloc_array(tmp, double, solsys->num_bodies);
+	search.found = rzalloc_array(tmp, Approach *, num_slabs);
+	search.num_found = rzalloc_array(tmp, int, num_slabs);
+	if (tmp == NULL || max_speed == NULL || time_scale == NULL ||
+			search.found == NULL || search.num_found == NULL)
+		goto errorout;
+
+	/* No coarser than the fastest orbit up the chain */
+	for (k = 0; k < solsys->num_bodies; k++)
+	{
+		Body *body = &solsys->body[solsys->order[k]];
+		int primary = solsys->order_primary[k];
+
+		i = solsys->order[k];
+		time_scale[i] = slab;
+		if (primary >= 0)
+			time_scale[i] = MIN(time_scale[primary], M_TWO_PI /
+					fabs(body->orbit.mean_motion) /
+					SOLSYS_SAMPLES_PER_ORBIT);
+	}
+
+	search.solsys = solsys;
+	search.start = start;
+	search.end = end;
+	search.slab = slab;
+	search.threshold = threshold;
+	search.max_speed = max_speed;
+	search.time_scale = time_scale;
+	workpool_run(solsys->pool, search_slabs, &search, num_slabs, 1);
+
+	for (i = 0; i < num_slabs; i++)
+	{
+		failed = failed || search.num_found[i] < 0;
+		total += MAX(search.num_found[i], 0);
+	}
+	if (!failed)
+		result = ralloc_array(ctx, Approach, MAX(1, total));
+	if (result == NULL)
+	{
+		for (i = 0; i < num_slabs; i++)
+			ralloc_free(search.found[i]);
+		goto errorout;
+	}
+
+	for (i = 0, total = 0; i < num_slabs; i++)
+	{
+		if (search.num_found[i] > 0)
+			memcpy(&result[total], search.found[i],
+					search.num_found[i] * sizeof(Approach));
+		total += search.num_found[i];
+		ralloc_free(search.found[i]);
+	}
+	ralloc_free(tmp);
+
+	*num_approaches = total;
+	return result;
+
+errorout:
+	log_err("Out of memory\n");
+	ralloc_free(tmp);
+	return NULL;
+}
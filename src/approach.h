@@ -0,0 +1,24 @@
+#ifndef KOSMOS_APPROACH_H
+#define KOSMOS_APPROACH_H
+
+#include "solarsystem.h"
+
+/* Close approaches between bodies, found from their orbits. Time is cut
+ * into slabs; in each one a body stays within a sphere around where it is
+ * halfway through, as it can't go faster than its orbits allow. Bodies
+ * are hashed into a grid by those spheres, and only pairs sharing a cell
+ * have their distance followed through the slab to its minima. Slabs go
+ * to solsys->pool if there is one. Kepler orbits only; in N-body mode
+ * this still goes by the orbits. */
+
+typedef struct Approach {
+	int body[2]; /* Indices into solsys->body, the lower one first */
+	double t;
+	double distance; /* Between the centres at t */
+} Approach;
+
+Approach *solsys_find_approaches(void *ctx, SolarSystem *solsys,
+		double start, double end, double slab, double threshold,
+		int *num_approaches);
+
+#endif
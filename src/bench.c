@@ -0,0 +1,1708 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <ralloc.h>
+
+#include "mathlib.h"
+#include "approach.h"
+#include "keplerorbit.h"
+#include "ephemeris.h"
+#include "keplerbatch.h"
+#include "lambert.h"
+#include "nbody.h"
+#include "octree.h"
+#include "orbitevent.h"
+#include "solarsystem.h"
+#include "timeline.h"
+#include "trajectory.h"
+#include "simd.h"
+#include "util.h"
+#include "workpool.h"
+
+/* The gravitational parameter of the Sun */
+#define MU_SUN 1.32712440018e20
+
+typedef struct Benchmark {
+	const char *name;
+	const char *description;
+	int (*run)(int argc, char **argv);
+} Benchmark;
+
+static double uniform(double lo, double hi)
+{
+	return lo + (hi - lo) * (rand() / (RAND_MAX + 1.0));
+}
+
+/* Random orbital elements, with the semi-major axis between min_sma and
+ * max_sma and an eccentricity below max_ecc */
+static void random_elements(KeplerOrbit *orbit, double min_sma, double max_sma,
+		double max_ecc)
+{
+	orbit->Ecc = uniform(0, max_ecc);
+	orbit->SMa = uniform(min_sma, max_sma);
+	orbit->Inc = uniform(0, 180);
+	orbit->LAN = uniform(0, 360);
+	orbit->APe = uniform(0, 360);
+	orbit->MnA = uniform(0, 360);
+	orbit->epoch = 0;
+}
+
+/* A random heliocentric orbit with an eccentricity below max_ecc */
+static void random_orbit(KeplerOrbit *orbit, double max_ecc)
+{
+	random_elements(orbit, 5e10, 5e12, max_ecc);
+	kepler_orbit_init(orbit, MU_SUN);
+}
+
+/* A star with num_planets planets, and moons around random planets making
+ * up the rest */
+static SolarSystem *synthetic_system(int num_bodies, int num_planets)
+{
+	SolarSystem *sol;
+	int i;
+
+	sol = solsys_create(num_bodies);
+	if (sol == NULL)
+		return NULL;
+
+	for (i = 0; i < num_bodies; i++)
+	{
+		Body *body = &sol->body[i];
+
+		if (i == 0)
+		{
+			body->name = ralloc_strdup(sol, "Sol");
+			body->type = BODY_STAR;
+			body->mass = MU_SUN / GRAV_CONST;
+			body->radius = 7e8;
+		} else if (i <= num_planets)
+		{
+			body->name = ralloc_asprintf(sol, "Planet%d", i);
+			body->type = BODY_PLANET;
+			body->mass = uniform(1e23, 1e27);
+			body->radius = uniform(2e6, 7e7);
+			body->primary = &sol->body[0];
+			random_elements(&body->orbit, 5e10, 5e12, 0.3);
+		} else
+		{
+			body->name = ralloc_asprintf(sol, "Moon%d", i);
+			body->type = BODY_PLANET;
+			body->mass = uniform(1e15, 1e22);
+			body->radius = uniform(1e4, 2e6);
+			body->primary = &sol->body[1 + rand() % num_planets];
+			random_elements(&body->orbit, 1e8, 2e9, 0.3);
+		}
+		if (body->name == NULL)
+		{
+			ralloc_free(sol);
+			return NULL;
+		}
+		body->grav_param = GRAV_CONST * body->mass;
+	}
+
+	if (!solsys_connect(sol))
+	{
+		ralloc_free(sol);
+		return NULL;
+	}
+
+	return sol;
+}
+
+static void write_path(FILE *fd, const Body *body)
+{
+	if (body->primary != NULL)
+	{
+		write_path(fd, body->primary);
+		fputc('/', fd);
+	}
+	fputs(body->name, fd);
+}
+
+/* Write a system out as an .ini file that solsys_load() reads back,
+ * satellites first if reverse is set */
+static bool write_ini(const SolarSystem *sol, const char *filename,
+		bool reverse)
+{
+	static const char *type[] = {"Star", "Planet", "Comet", NULL};
+	FILE *fd;
+	int i;
+
+	if ((fd = fopen(filename, "w")) == NULL)
+	{
+		fprintf(stderr, "Couldn't open %s\n", filename);
+		return false;
+	}
+
+	for (i = 0; i < sol->num_bodies; i++)
+	{
+		const Body *body = &sol->body[reverse ? sol->num_bodies - 1 - i : i];
+		const KeplerOrbit *o = &body->orbit;
+
+		fputc('[', fd);
+		write_path(fd, body);
+		fprintf(fd, "]\nMass = %.17g\nRadius = %.17g\n",
+				body->mass, body->radius);
+		if (type[body->type] != NULL)
+			fprintf(fd, "Type = %s\n", type[body->type]);
+		if (body->primary != NULL)
+			fprintf(fd, "Ecc = %.17g\nSMa = %.17g\nInc = %.17g\n"
+					"LAN = %.17g\nAPe = %.17g\nMnA = %.17g\n",
+					o->Ecc, o->SMa, o->Inc, o->LAN, o->APe, o->MnA);
+		fputc('\n', fd);
+	}
+
+	if (fclose(fd) != 0)
+	{
+		fprintf(stderr, "Error writing %s\n", filename);
+		return false;
+	}
+
+	return true;
+}
+
+/* Per-body kepler_position_at_time() against kepler_batch_positions() */
+static int bench_kepler(int argc, char **argv)
+{
+	const int sizes[] = {1000, 100000, 1000000};
+	unsigned k;
+
+	(void) argc; (void) argv;
+
+	printf("SIMD width: %d doubles\n", SIMD_WIDTH);
+	for (k = 0; k < sizeof(sizes)/sizeof(sizes[0]); k++)
+	{
+		int i, step, n = sizes[k], steps = MAX(1, 4000000 / n);
+		void *ctx = ralloc_context(NULL);
+		KeplerOrbit *orbit = ralloc_array(ctx, KeplerOrbit, n);
+		KeplerBatch *batch = kepler_batch_create(ctx, n);
+		Vec3 *pos = ralloc_array(ctx, Vec3, n);
+		double *x = ralloc_array(ctx, double, n);
+		double *y = ralloc_array(ctx, double, n);
+		double *z = ralloc_array(ctx, double, n);
+		double start, loop_time, batch_time, max_err = 0;
+
+		if (orbit == NULL || batch == NULL || pos == NULL ||
+				x == NULL || y == NULL || z == NULL)
+		{
+			fprintf(stderr, "Out of memory\n");
+			ralloc_free(ctx);
+			return 1;
+		}
+
+		for (i = 0; i < n; i++)
+		{
+			random_orbit(&orbit[i], 0.95);
+			kepler_batch_set_orbit(batch, i, &orbit[i]);
+		}
+
+		start = wall_time();
+		for (step = 0; step < steps; step++)
+			for (i = 0; i < n; i++)
+				pos[i] = kepler_position_at_time(&orbit[i], step*86400.0);
+		loop_time = wall_time() - start;
+
+		start = wall_time();
+		for (step = 0; step < steps; step++)
+			kepler_batch_positions(batch, step*86400.0, x, y, z);
+		batch_time = wall_time() - start;
+
+		for (i = 0; i < n; i++)
+		{
+			Vec3 d = vec3_sub(pos[i], (Vec3) {x[i], y[i], z[i]});
+			max_err = MAX(max_err, vec3_length(d) / orbit[i].SMa);
+		}
+
+		printf("%8d orbits: loop %7.1f ns/orbit, batch %7.1f ns/orbit, "
+				"speedup %5.2fx, max relative difference %.2g\n", n,
+				1e9 * loop_time / ((double) n * steps),
+				1e9 * batch_time / ((double) n * steps),
+				loop_time / batch_time, max_err);
+
+		ralloc_free(ctx);
+	}
+
+	return 0;
+}
+
+/* Positions and velocities: by central differences of positions, by
+ * solving separately for each, from one solve, and batched */
+static int bench_state(int argc, char **argv)
+{
+	const double H = 60; /* Step for the differences in seconds */
+	int i, step, n = 100000, steps = 20;
+	void *ctx;
+	KeplerOrbit *orbit;
+	KeplerBatch *batch;
+	Vec3 *pos, *vel;
+	double *x, *y, *z, *vx, *vy, *vz;
+	double start, diff_time, split_time, state_time, batch_time;
+	double diff_err = 0, batch_err = 0;
+
+	if (argc > 1)
+		n = atoi(argv[1]);
+
+	ctx = ralloc_context(NULL);
+	orbit = ralloc_array(ctx, KeplerOrbit, n);
+	batch = kepler_batch_create(ctx, n);
+	pos = ralloc_array(ctx, Vec3, n);
+	vel = ralloc_array(ctx, Vec3, n);
+	x = ralloc_array(ctx, double, n);
+	y = ralloc_array(ctx, double, n);
+	z = ralloc_array(ctx, double, n);
+	vx = ralloc_array(ctx, double, n);
+	vy = ralloc_array(ctx, double, n);
+	vz = ralloc_array(ctx, double, n);
+	if (orbit == NULL || batch == NULL || pos == NULL || vel == NULL ||
+			x == NULL || y == NULL || z == NULL ||
+			vx == NULL || vy == NULL || vz == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		ralloc_free(ctx);
+		return 1;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		random_orbit(&orbit[i], 0.95);
+		kepler_batch_set_orbit(batch, i, &orbit[i]);
+	}
+
+	start = wall_time();
+	for (step = 0; step < steps; step++)
+		for (i = 0; i < n; i++)
+		{
+			double t = step * 86400.0;
+			Vec3 a = kepler_position_at_time(&orbit[i], t - H);
+			Vec3 b = kepler_position_at_time(&orbit[i], t + H);
+
+			pos[i] = kepler_position_at_time(&orbit[i], t);
+			vel[i] = vec3_scale(vec3_sub(b, a), 1 / (2 * H));
+		}
+	diff_time = wall_time() - start;
+
+	start = wall_time();
+	for (step = 0; step < steps; step++)
+		for (i = 0; i < n; i++)
+		{
+			double E = kepler_solve(orbit[i].Ecc, orbit[i].mean_anomaly +
+					orbit[i].mean_motion * (step*86400.0 - orbit[i].epoch),
+					NULL);
+
+			pos[i] = kepler_position_at_E(&orbit[i], E);
+			vel[i] = kepler_velocity_at_E(&orbit[i], E);
+		}
+	split_time = wall_time() - start;
+
+	for (i = 0; i < n; i++)
+	{
+		double t = (steps - 1) * 86400.0;
+		Vec3 a = kepler_position_at_time(&orbit[i], t - H);
+		Vec3 b = kepler_position_at_time(&orbit[i], t + H);
+		Vec3 d = vec3_sub(vec3_scale(vec3_sub(b, a), 1 / (2 * H)), vel[i]);
+
+		diff_err = MAX(diff_err, vec3_length(d) / vec3_length(vel[i]));
+	}
+
+	start = wall_time();
+	for (step = 0; step < steps; step++)
+		for (i = 0; i < n; i++)
+			kepler_state_at_time(&orbit[i], step*86400.0, &pos[i], &vel[i]);
+	state_time = wall_time() - start;
+
+	start = wall_time();
+	for (step = 0; step < steps; step++)
+		kepler_batch_states(batch, step*86400.0, x, y, z, vx, vy, vz);
+	batch_time = wall_time() - start;
+
+	for (i = 0; i < n; i++)
+	{
+		Vec3 d = vec3_sub(vel[i], (Vec3) {vx[i], vy[i], vz[i]});
+		batch_err = MAX(batch_err, vec3_length(d) / vec3_length(vel[i]));
+	}
+
+	printf("%d orbits, ns per position and velocity:\n", n);
+	printf("    differences %7.1f (max relative error %.2g)\n",
+			1e9 * diff_time / ((double) n * steps), diff_err);
+	printf("    two calls   %7.1f\n",
+			1e9 * split_time / ((double) n * steps));
+	printf("    one solve   %7.1f\n",
+			1e9 * state_time / ((double) n * steps));
+	printf("    batched     %7.1f (max relative difference %.2g)\n",
+			1e9 * batch_time / ((double) n * steps), batch_err);
+
+	ralloc_free(ctx);
+	return 0;
+}
+
+/* Close approaches among num_bodies planets (default 1000) within a
+ * threshold (default 5e10 m) over a year, by the slab search on some
+ * threads (default 1) and by comparing all pairs at every sample of a
+ * grid */
+static int bench_approach(int argc, char **argv)
+{
+	const double days = 365, step = 21600, slab = 86400;
+	int n = (argc > 1 ? atoi(argv[1]) : 1000);
+	double threshold = (argc > 2 ? atof(argv[2]) : 5e10);
+	int threads = (argc > 3 ? atoi(argv[3]) : 1);
+	int i, j, k, num_approaches, samples, grid_minima = 0, missed = 0;
+	double start, search_time, grid_time, max_offset = 0;
+	float *dist; /* The last three samples of each pair */
+	SolarSystem *sol;
+	Approach *found;
+
+	if (n <= 2)
+	{
+		fprintf(stderr, "Usage: approach [bodies] [threshold] [threads]\n");
+		return 1;
+	}
+
+	srand(1);
+	sol = synthetic_system(n, n - 1);
+	if (sol == NULL || !solsys_set_threads(sol, threads))
+		return 1;
+
+	start = wall_time();
+	found = solsys_find_approaches(sol, sol, 0, days * 86400, slab,
+			threshold, &num_approaches);
+	search_time = wall_time() - start;
+	dist = ralloc_array(sol, float, 3 * (size_t) n * n);
+	if (found == NULL || dist == NULL)
+	{
+		ralloc_free(sol);
+		return 1;
+	}
+
+	/* Minima between grid samples, checked against what the search
+	 * found for the same pair around then */
+	samples = days * 86400 / step + 1;
+	start = wall_time();
+	for (k = 0; k < samples; k++)
+	{
+		solsys_update(sol, k * step);
+		for (i = 0; i < n; i++)
+			for (j = i + 1; j < n; j++)
+			{
+				float *d = &dist[3 * ((size_t) i * n + j)];
+				int e;
+
+				d[0] = d[1];
+				d[1] = d[2];
+				d[2] = vec3_length(vec3_sub(sol->body[i].position,
+						sol->body[j].position));
+				if (k < 2 || !(d[1] < threshold && d[1] <= d[0] &&
+						d[1] < d[2]))
+					continue;
+
+				grid_minima++;
+				for (e = 0; e < num_approaches; e++)
+					if (found[e].body[0] == i && found[e].body[1] == j &&
+							fabs(found[e].t - (k - 1) * step) < step)
+						break;
+				if (e == num_approaches)
+					missed++;
+				else
+					max_offset = MAX(max_offset,
+							fabs(found[e].t - (k - 1) * step));
+			}
+	}
+	grid_time = wall_time() - start;
+
+	printf("%d bodies, %g days, threshold %g m, %d threads\n", n, days,
+			threshold, MAX(1, threads));
+	printf("    slab search: %d approaches in %.3f s\n", num_approaches,
+			search_time);
+	printf("    %g hour grid: %d minima in %.3f s, %d not found by the "
+			"search\n", step / 3600, grid_minima, grid_time, missed);
+	printf("    speedup %.1fx, largest time offset %.0f s\n",
+			grid_time / search_time, max_offset);
+
+	ralloc_free(sol);
+	return 0;
+}
+
+/* Orbital events of a synthetic system (default 1000 bodies, a tenth of
+ * them planets) over a year, from the event finder and by looking for
+ * them in hourly samples. The threshold (default 1e11 m) is crossed by a
+ * few of the planets, and so by their moons. */
+static int bench_events(int argc, char **argv)
+{
+	const double days = 365, step = 3600;
+	int n = (argc > 1 ? atoi(argv[1]) : 1000);
+	double threshold = (argc > 2 ? atof(argv[2]) : 1e11);
+	long found[NUM_EVENT_TYPES] = {0}, sampled[NUM_EVENT_TYPES] = {0};
+	long moon_crossings = 0;
+	double (*last)[5]; /* r, the r before, z, distance to the root, SOI */
+	double start, finder_time, sample_time;
+	SolarSystem *sol;
+	EventFinder *finder;
+	OrbitEvent event;
+	int i, k, samples;
+
+	if (n <= 10)
+	{
+		fprintf(stderr, "Usage: events [bodies] [threshold]\n");
+		return 1;
+	}
+
+	srand(1);
+	sol = synthetic_system(n, n / 10);
+	if (sol == NULL)
+		return 1;
+
+	start = wall_time();
+	finder = event_finder_create(sol, sol, 0, days * 86400, EVENT_ALL,
+			threshold);
+	if (finder == NULL)
+		return 1;
+	while (event_finder_next(finder, &event))
+	{
+		found[event.type]++;
+		/* Only these go through sampling and Brent's method */
+		if ((event.type == EVENT_INBOUND || event.type == EVENT_OUTBOUND) &&
+				sol->body[event.body].primary->primary != NULL)
+			moon_crossings++;
+	}
+	finder_time = wall_time() - start;
+
+	last = ralloc_size(sol, n * sizeof(*last));
+	if (last == NULL)
+		return 1;
+	for (i = 0; i < n; i++)
+	{
+		Body *body = &sol->body[i], *primary = body->primary;
+
+		last[i][4] = INFINITY;
+		if (primary != NULL && primary->primary != NULL)
+			last[i][4] = fabs(primary->orbit.SMa) * pow(primary->grav_param /
+					primary->primary->grav_param, 0.4);
+	}
+
+	samples = days * 86400 / step + 1;
+	start = wall_time();
+	for (k = 0; k < samples; k++)
+	{
+		solsys_update(sol, k * step);
+		for (i = 0; i < n; i++)
+		{
+			Body *body = &sol->body[i];
+			double *l = last[i], r, z, root;
+			Vec3 p;
+
+			if (body->primary == NULL)
+				continue;
+			p = vec3_sub(body->position, body->primary->position);
+			r = vec3_length(p);
+			z = p.z;
+			root = vec3_length(body->position);
+
+			if (k >= 2 && l[0] < l[1] && l[0] <= r)
+				sampled[EVENT_PERIAPSIS]++;
+			if (k >= 2 && l[0] > l[1] && l[0] >= r)
+				sampled[EVENT_APOAPSIS]++;
+			if (k >= 1)
+			{
+				sampled[EVENT_ASCENDING_NODE] += (l[2] < 0 && z >= 0);
+				sampled[EVENT_DESCENDING_NODE] += (l[2] >= 0 && z < 0);
+				sampled[EVENT_INBOUND] += (l[3] > threshold &&
+						root <= threshold);
+				sampled[EVENT_OUTBOUND] += (l[3] <= threshold &&
+						root > threshold);
+				sampled[EVENT_SOI_EXIT] += (l[0] <= l[4] && r > l[4]);
+				sampled[EVENT_SOI_ENTRY] += (l[0] > l[4] && r <= l[4]);
+			}
+			l[1] = l[0];
+			l[0] = r;
+			l[2] = z;
+			l[3] = root;
+		}
+	}
+	sample_time = wall_time() - start;
+
+	printf("%d bodies, %g days, threshold %g m\n", n, days, threshold);
+	printf("    %-16s %8s %8s\n", "", "finder", "sampled");
+	for (i = 0; i < NUM_EVENT_TYPES; i++)
+		printf("    %-16s %8ld %8ld\n", event_type_name(i), found[i],
+				sampled[i]);
+	printf("    %ld of the crossings are by moons\n", moon_crossings);
+	printf("    finder %.3f s, hourly samples %.3f s, speedup %.0fx\n",
+			finder_time, sample_time, sample_time / finder_time);
+
+	ralloc_free(sol);
+	return 0;
+}
+
+/* A porkchop plot from Earth to Mars in sol.ini on an [n] by [n] grid
+ * (default 1000) of departures over two years and arrivals 100 days to
+ * three years later, with the states solved for every cell against once
+ * per row and column, and then on [threads] threads (default 4) */
+static int bench_porkchop(int argc, char **argv)
+{
+	const double day = 86400;
+	int n = (argc > 1 ? atoi(argv[1]) : 1000);
+	int threads = (argc > 2 ? atoi(argv[2]) : 4);
+	double start, naive_time, cached_time, parallel_time, best = INFINITY;
+	int i, j, best_i = 0, best_j = 0, same = 0, cells;
+	SolarSystem *sol;
+	Body *earth, *mars;
+	Porkchop *plot;
+
+	if (n <= 1 || threads <= 0)
+	{
+		fprintf(stderr, "Usage: porkchop [grid size] [threads]\n");
+		return 1;
+	}
+
+	sol = solsys_load(STRINGIFY(ROOT_PATH) "/data/sol.ini");
+	if (sol == NULL)
+		return 1;
+	earth = solsys_find_body(sol, "Sol/Earth");
+	mars = solsys_find_body(sol, "Sol/Mars");
+	if (earth == NULL || mars == NULL)
+	{
+		fprintf(stderr, "sol.ini needs an Earth and a Mars\n");
+		ralloc_free(sol);
+		return 1;
+	}
+
+	plot = porkchop_create(sol, sol, earth, mars, 0, 730 * day, n,
+			100 * day, 1095 * day, n);
+	if (plot == NULL)
+		return 1;
+
+	/* The same grid, solving for the states of both bodies in every cell */
+	start = wall_time();
+	for (i = 0; i < n; i++)
+		for (j = 0; j < n; j++)
+		{
+			double t1 = plot->departure[i], t2 = plot->arrival[j];
+			double dv = NAN;
+			Vec3 r1, u1, r2, u2, v1, v2;
+
+			kepler_state_at_time(&earth->orbit, t1, &r1, &u1);
+			kepler_state_at_time(&mars->orbit, t2, &r2, &u2);
+			if (lambert_solve(r1, r2, t2 - t1, sol->body[0].grav_param,
+					&v1, &v2))
+				dv = vec3_length(vec3_sub(v1, u1)) +
+						vec3_length(vec3_sub(v2, u2));
+			same += (dv == plot->delta_v[i*n + j] ||
+					(isnan(dv) && isnan(plot->delta_v[i*n + j])));
+		}
+	naive_time = wall_time() - start;
+
+	ralloc_free(plot);
+	start = wall_time();
+	plot = porkchop_create(sol, sol, earth, mars, 0, 730 * day, n,
+			100 * day, 1095 * day, n);
+	cached_time = wall_time() - start;
+	if (plot == NULL || !solsys_set_threads(sol, threads))
+		return 1;
+
+	ralloc_free(plot);
+	start = wall_time();
+	plot = porkchop_create(sol, sol, earth, mars, 0, 730 * day, n,
+			100 * day, 1095 * day, n);
+	parallel_time = wall_time() - start;
+	if (plot == NULL)
+		return 1;
+
+	cells = 0;
+	for (i = 0; i < n; i++)
+		for (j = 0; j < n; j++)
+		{
+			double dv = plot->delta_v[i*n + j];
+
+			if (isnan(dv))
+				continue;
+			cells++;
+			if (dv < best)
+			{
+				best = dv;
+				best_i = i;
+				best_j = j;
+			}
+		}
+
+	printf("%d x %d grid, %d transfers, %d cells match\n", n, n, cells,
+			same);
+	printf("    states per cell      %7.3f s, %6.2f Mcell/s\n", naive_time,
+			n * (double) n / naive_time / 1e6);
+	printf("    per row and column   %7.3f s, %6.2f Mcell/s\n", cached_time,
+			n * (double) n / cached_time / 1e6);
+	printf("    %2d threads           %7.3f s, %6.2f Mcell/s\n", threads,
+			parallel_time, n * (double) n / parallel_time / 1e6);
+	printf("    least delta-v %.3f km/s, leaving on day %.0f, arriving on "
+			"day %.0f\n", best / 1e3, plot->departure[best_i] / day,
+			plot->arrival[best_j] / day);
+
+	ralloc_free(sol);
+	return 0;
+}
+
+/* A position the way it was done before KeplerOrbit cached anything: the
+ * mean motion, the semi-minor axis and the rotation out of the orbital
+ * plane are all worked out again from the elements. Elliptic orbits only,
+ * which is all sol.ini has. */
+static Vec3 uncached_position(KeplerOrbit *orbit, double jd)
+{
+	double e = orbit->Ecc, a = orbit->SMa, b = a * sqrt(1 - e*e);
+	double M = RAD(orbit->MnA) + M_TWO_PI * (jd - orbit->epoch) /
+			orbit->period;
+	double E = kepler_solve(e, M, NULL);
+	Vec3 plane_pos = {a * (cos(E) - e), b * sin(E), 0};
+
+	return quat_transform(orbit->plane_orientation, plane_pos);
+}
+
+/* kepler_position_at_time() on the orbits of sol.ini, copied with random
+ * epochs until there are num_bodies of them (default 100k), against
+ * uncached_position() */
+static int bench_orbits(int argc, char **argv)
+{
+	SolarSystem *sol;
+	KeplerOrbit *orbit;
+	Vec3 *pos;
+	int i, j, step, n, num_orbits = 0, steps = 20;
+	double start, elapsed, uncached, max_diff = 0;
+
+	n = (argc > 1 ? atoi(argv[1]) : 100000);
+	if (n <= 0)
+	{
+		fprintf(stderr, "Invalid number of bodies: %s\n", argv[1]);
+		return 1;
+	}
+
+	sol = solsys_load(STRINGIFY(ROOT_PATH) "/data/sol.ini");
+	if (sol == NULL)
+		return 1;
+
+	orbit = ralloc_array(sol, KeplerOrbit, n);
+	pos = ralloc_array(sol, Vec3, n);
+	if (orbit == NULL || pos == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		ralloc_free(sol);
+		return 1;
+	}
+
+	for (j = 0; j < sol->num_bodies; j++)
+		if (sol->body[j].primary != NULL)
+			num_orbits++;
+	for (i = 0, j = 0; i < n; j = (j + 1) % sol->num_bodies)
+	{
+		if (sol->body[j].primary == NULL)
+			continue;
+		orbit[i] = sol->body[j].orbit;
+		orbit[i].epoch = uniform(0, orbit[i].period);
+		i++;
+	}
+
+	start = wall_time();
+	for (step = 0; step < steps; step++)
+		for (i = 0; i < n; i++)
+			pos[i] = uncached_position(&orbit[i], step*86400.0);
+	uncached = wall_time() - start;
+
+	start = wall_time();
+	for (step = 0; step < steps; step++)
+		for (i = 0; i < n; i++)
+			pos[i] = kepler_position_at_time(&orbit[i], step*86400.0);
+	elapsed = wall_time() - start;
+
+	/* Both should land in the same place, except on orbits so short that
+	 * the mean anomaly has grown beyond what a double resolves */
+	for (i = 0; i < n; i++)
+	{
+		Vec3 p = uncached_position(&orbit[i], (steps - 1)*86400.0);
+
+		if (orbit[i].period < 86400)
+			continue;
+
+		max_diff = MAX(max_diff, vec3_length(vec3_sub(p, pos[i])) /
+				vec3_length(p));
+	}
+
+	printf("%d bodies (%d distinct orbits), ns per body update:\n", n,
+			num_orbits);
+	printf("    uncached %.1f, cached %.1f, speedup %.2fx, "
+			"relative difference %.1e\n",
+			1e9 * uncached / ((double) n * steps),
+			1e9 * elapsed / ((double) n * steps), uncached / elapsed,
+			max_diff);
+
+	ralloc_free(sol);
+	return 0;
+}
+
+/* Cold against warm-started solves on the orbits of sol.ini, copied out to
+ * 100k bodies, advancing time by a fixed step (in days) each frame */
+static int bench_warm(int argc, char **argv)
+{
+	SolarSystem *sol;
+	KeplerOrbit *orbit;
+	Vec3 *pos;
+	int i, j, frame, n = 100000, frames = 20, iterations;
+	double dt, start, cold_time, warm_time, max_err = 0;
+	long cold_iterations = 0, warm_iterations = 0;
+
+	dt = 86400 * (argc > 1 ? atof(argv[1]) : 1.0);
+
+	sol = solsys_load(STRINGIFY(ROOT_PATH) "/data/sol.ini");
+	if (sol == NULL)
+		return 1;
+
+	orbit = ralloc_array(sol, KeplerOrbit, n);
+	pos = ralloc_array(sol, Vec3, n);
+	if (orbit == NULL || pos == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		ralloc_free(sol);
+		return 1;
+	}
+
+	for (i = 0, j = 0; i < n; j = (j + 1) % sol->num_bodies)
+	{
+		if (sol->body[j].primary == NULL)
+			continue;
+		orbit[i] = sol->body[j].orbit;
+		orbit[i].epoch = uniform(0, orbit[i].period);
+		i++;
+	}
+
+	for (frame = 0; frame < frames; frame++)
+		for (i = 0; i < n; i++)
+		{
+			double M = orbit[i].mean_anomaly +
+					orbit[i].mean_motion * (frame*dt - orbit[i].epoch);
+			kepler_solve(orbit[i].Ecc, M, &iterations);
+			cold_iterations += iterations;
+		}
+
+	start = wall_time();
+	for (frame = 0; frame < frames; frame++)
+		for (i = 0; i < n; i++)
+			pos[i] = kepler_position_at_time(&orbit[i], frame*dt);
+	cold_time = wall_time() - start;
+
+	start = wall_time();
+	for (frame = 0; frame < frames; frame++)
+		for (i = 0; i < n; i++)
+		{
+			Vec3 p = kepler_position_at_time_warm(&orbit[i], frame*dt,
+					&iterations);
+			if (frame == frames - 1)
+				max_err = MAX(max_err, vec3_length(vec3_sub(p, pos[i])));
+			warm_iterations += iterations;
+		}
+	warm_time = wall_time() - start;
+
+	printf("%d bodies, %g days per frame:\n", n, dt / 86400);
+	printf("    cold: %4.2f iterations, %6.1f ns per body\n",
+			(double) cold_iterations / ((double) n * frames),
+			1e9 * cold_time / ((double) n * frames));
+	printf("    warm: %4.2f iterations, %6.1f ns per body\n",
+			(double) warm_iterations / ((double) n * frames),
+			1e9 * warm_time / ((double) n * frames));
+	printf("    max difference %.2g m\n", max_err);
+
+	ralloc_free(sol);
+	return 0;
+}
+
+/* solsys_update() on a synthetic system (default one million bodies) with
+ * 1 up to max_threads threads (default 8) */
+static int bench_parallel(int argc, char **argv)
+{
+	SolarSystem *sol;
+	Vec3 *serial;
+	int i, threads, step, steps = 5;
+	int n = (argc > 1 ? atoi(argv[1]) : 1000000);
+	int max_threads = (argc > 2 ? atoi(argv[2]) : 8);
+	double start, elapsed, serial_time = 0;
+
+	if (n <= 0 || max_threads <= 0)
+	{
+		fprintf(stderr, "Usage: parallel [bodies] [max threads]\n");
+		return 1;
+	}
+
+	sol = synthetic_system(n, MAX(1, n / 1000));
+	if (sol == NULL)
+	{
+		fprintf(stderr, "Couldn't create a system of %d bodies\n", n);
+		return 1;
+	}
+	serial = ralloc_array(sol, Vec3, n);
+	if (serial == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		ralloc_free(sol);
+		return 1;
+	}
+
+	printf("%d bodies in %d levels\n", n, sol->num_levels);
+	for (threads = 1; threads <= max_threads; threads *= 2)
+	{
+		bool same = true;
+
+		if (!solsys_set_threads(sol, threads))
+			break;
+
+		start = wall_time();
+		for (step = 0; step < steps; step++)
+			solsys_update(sol, step*86400.0);
+		elapsed = (wall_time() - start) / steps;
+
+		for (i = 0; i < n; i++)
+		{
+			if (threads == 1)
+				serial[i] = sol->body[i].position;
+			else if (memcmp(&serial[i], &sol->body[i].position,
+						sizeof(Vec3)) != 0)
+				same = false;
+		}
+		if (threads == 1)
+			serial_time = elapsed;
+
+		printf("%2d threads: %7.2f ms per update, %6.2f Mbody/s, "
+				"speedup %5.2fx%s\n", threads, 1e3 * elapsed,
+				n / elapsed / 1e6, serial_time / elapsed,
+				same ? "" : " (positions differ!)");
+	}
+
+	ralloc_free(sol);
+	return 0;
+}
+
+/* The time level of detail on [bodies] bodies (default 100k), seen from
+ * 20 AU above the ecliptic through a 45 degree lens 1080 pixels high, at
+ * several time steps per frame. Errors are against solving every body. */
+static int bench_lod(int argc, char **argv)
+{
+	const double steps[] = {600, 3600, 6 * 3600, 86400, 7 * 86400};
+	const double pixel = M_PI / 4 / 1080;
+	const Vec3 eye = {0, 0, 3e12};
+	const int frames = 200;
+	int n = (argc > 1 ? atoi(argv[1]) : 100000);
+	unsigned k;
+
+	if (n <= 1)
+	{
+		fprintf(stderr, "Usage: lod [bodies]\n");
+		return 1;
+	}
+
+	printf("%d bodies, one pixel is %.2g rad\n", n, pixel);
+	printf("    step | skipped | full ms | lod ms | speedup | "
+			"max error px\n");
+	for (k = 0; k < sizeof(steps)/sizeof(steps[0]); k++)
+	{
+		SolarSystem *full, *lod;
+		double full_time = 0, lod_time = 0, max_err = 0, start;
+		int frame, i;
+
+		srand(1);
+		full = synthetic_system(n, MAX(1, n / 1000));
+		srand(1);
+		lod = synthetic_system(n, MAX(1, n / 1000));
+		if (full == NULL || lod == NULL || !solsys_set_lod(lod, eye, pixel))
+			return 1;
+
+		for (frame = 0; frame < frames; frame++)
+		{
+			double t = frame * steps[k];
+
+			start = wall_time();
+			solsys_update(full, t);
+			full_time += wall_time() - start;
+
+			start = wall_time();
+			solsys_update(lod, t);
+			lod_time += wall_time() - start;
+
+			for (i = 0; i < n; i++)
+			{
+				Vec3 exact = full->body[i].position;
+				double err = vec3_length(vec3_sub(lod->body[i].position,
+						exact)) / vec3_length(vec3_sub(exact, eye));
+
+				max_err = MAX(max_err, err / pixel);
+			}
+		}
+
+		printf("%7.0fs | %6.1f%% | %7.2f | %6.2f | %6.2fx | %12.2f\n",
+				steps[k], 100.0 * lod->lod->skipped /
+				(lod->lod->skipped + lod->lod->performed),
+				1e3 * full_time / frames, 1e3 * lod_time / frames,
+				full_time / lod_time, max_err);
+		ralloc_free(full);
+		ralloc_free(lod);
+	}
+
+	return 0;
+}
+
+/* Scrubbing back and forth through windows of an hour to a year around
+ * t = 0 on [bodies] bodies (default 10k), with a timeline good to
+ * [tolerance] metres (default 1000) in 64 MB, against solving every time */
+static int bench_timeline(int argc, char **argv)
+{
+	const double windows[] = {3600, 86400, 30 * 86400, 365.25 * 86400};
+	const int queries = 2000, checks = 50;
+	int n = (argc > 1 ? atoi(argv[1]) : 10000);
+	double tolerance = (argc > 2 ? atof(argv[2]) : 1000);
+	SolarSystem *sol;
+	Vec3 *interpolated;
+	unsigned k;
+
+	if (n <= 1 || tolerance <= 0)
+	{
+		fprintf(stderr, "Usage: timeline [bodies] [tolerance]\n");
+		return 1;
+	}
+	sol = synthetic_system(n, MAX(1, n / 1000));
+	interpolated = (sol != NULL ? ralloc_array(sol, Vec3, n) : NULL);
+	if (interpolated == NULL)
+		return 1;
+
+	printf("%d bodies, tolerance %g m\n", n, tolerance);
+	printf("  window | keyframes/query | timeline us | solve us | speedup | "
+			"max error m\n");
+	for (k = 0; k < sizeof(windows)/sizeof(windows[0]); k++)
+	{
+		Timeline *tl = timeline_create(sol, sol, tolerance, 64 << 20);
+		double start, timeline_time, solve_time, max_err = 0;
+		int q, i;
+
+		if (tl == NULL)
+			return 1;
+
+		srand(k);
+		start = wall_time();
+		for (q = 0; q < queries; q++)
+			timeline_update(tl, uniform(-windows[k], windows[k]));
+		timeline_time = (wall_time() - start) / queries;
+
+		srand(k);
+		start = wall_time();
+		for (q = 0; q < queries; q++)
+			solsys_update(sol, uniform(-windows[k], windows[k]));
+		solve_time = (wall_time() - start) / queries;
+
+		for (q = 0; q < checks; q++)
+		{
+			double t = uniform(-windows[k], windows[k]);
+
+			timeline_update(tl, t);
+			for (i = 0; i < n; i++)
+				interpolated[i] = sol->body[i].position;
+			solsys_update(sol, t);
+			for (i = 0; i < n; i++)
+				max_err = MAX(max_err, vec3_length(vec3_sub(
+						interpolated[i], sol->body[i].position)));
+		}
+
+		printf("%7.0fh | %15.2f | %11.1f | %8.1f | %6.1fx | %11.3g\n",
+				windows[k] / 3600,
+				(double) tl->keyframes / tl->lookups,
+				1e6 * timeline_time, 1e6 * solve_time,
+				solve_time / timeline_time, max_err);
+		if (k == 0)
+			printf("(%d classes covering %.1f hours in %.1f MB)\n",
+					tl->num_classes, tl->span / 3600,
+					timeline_memory(tl) / 1e6);
+		ralloc_free(tl);
+	}
+
+	ralloc_free(sol);
+	return 0;
+}
+
+/* Chebyshev ephemeris of sol.ini over [days] days (default ten years) at
+ * [tolerance] metres (default 1), against solving Kepler's equation */
+static int bench_ephemeris(int argc, char **argv)
+{
+	const char *filename = "sol.eph";
+	const int num_queries = 100000;
+	SolarSystem *sol;
+	Ephemeris *built, *ephem;
+	double days = (argc > 1 ? atof(argv[1]) : 3650);
+	double tolerance = (argc > 2 ? atof(argv[2]) : 1.0);
+	double span = days * 86400, start, elapsed;
+	double max_error = 0, max_absolute = 0;
+	double *when;
+	Vec3 p, v, sum = {0, 0, 0};
+	long segments = 0;
+	int i, b;
+
+	sol = solsys_load(STRINGIFY(ROOT_PATH) "/data/sol.ini");
+	if (sol == NULL)
+		return 1;
+
+	start = wall_time();
+	built = ephem_build(sol, 0, span, tolerance);
+	elapsed = wall_time() - start;
+	if (built == NULL)
+		return 1;
+	for (b = 0; b < built->num_bodies; b++)
+		segments += built->body[b].num_segments;
+	printf("Built %ld segments over %g days in %.1f ms, %zu bytes\n",
+			segments, days, 1e3 * elapsed, built->size);
+
+	if (!ephem_save(built, filename) || (ephem = ephem_load(filename)) == NULL)
+		return 1;
+	ralloc_free(built);
+
+	when = ralloc_array(sol, double, num_queries);
+	for (i = 0; i < num_queries; i++)
+		when[i] = uniform(0, span);
+
+	/* The tolerance holds relative to the primary, the absolute error of
+	 * a moon adds that of its planet */
+	for (i = 0; i < 1000; i++)
+	{
+		solsys_update(sol, when[i]);
+		for (b = 0; b < sol->num_bodies; b++)
+		{
+			ephem_state(ephem, b, when[i], &p, NULL);
+			max_absolute = MAX(max_absolute,
+					vec3_length(vec3_sub(p, sol->body[b].position)));
+			if (sol->body[b].primary == NULL)
+				continue;
+			ephem_relative_state(ephem, b, when[i], &p, NULL);
+			p = vec3_sub(p, kepler_position_at_time(&sol->body[b].orbit,
+					when[i]));
+			max_error = MAX(max_error, vec3_length(p));
+		}
+	}
+	printf("Largest error in the mapped file: %.3g m (tolerance %g m), "
+			"%.3g m in absolute positions\n", max_error, tolerance,
+			max_absolute);
+
+	start = wall_time();
+	for (i = 0; i < num_queries; i++)
+		for (b = 0; b < sol->num_bodies; b++)
+			sum = vec3_add(sum, kepler_position_at_time(&sol->body[b].orbit,
+					when[i]));
+	elapsed = wall_time() - start;
+	printf("Kepler:    %6.1f ns per body\n",
+			1e9 * elapsed / num_queries / sol->num_bodies);
+
+	start = wall_time();
+	for (i = 0; i < num_queries; i++)
+		for (b = 0; b < sol->num_bodies; b++)
+		{
+			ephem_relative_state(ephem, b, when[i], &p, &v);
+			sum = vec3_add(sum, p);
+		}
+	elapsed = wall_time() - start;
+	printf("Ephemeris: %6.1f ns per body, with velocity (%g)\n",
+			1e9 * elapsed / num_queries / sol->num_bodies, sum.x);
+
+	ralloc_free(ephem);
+	ralloc_free(sol);
+	remove(filename);
+	return 0;
+}
+
+/* Write the positions of sol.ini over [days] days (default 3650) in daily
+ * steps in every trajectory format, then map each file and read every
+ * position back */
+static int bench_trajectory(int argc, char **argv)
+{
+	static const struct {
+		TrajFormat format;
+		const char *name;
+	} formats[] = {
+		{TRAJ_DOUBLE, "double"},
+		{TRAJ_FLOAT, "float"},
+		{TRAJ_DELTA, "delta"}
+	};
+	const char *filename = "bench.traj";
+	long s, num_steps = (argc > 1 ? atol(argv[1]) : 3650);
+	SolarSystem *sol;
+	TrajWriter *writer;
+	Trajectory *traj;
+	const char **path;
+	double *rows, start, write_time, read_time;
+	Vec3 sum = {0, 0, 0};
+	unsigned f;
+	int b, n;
+
+	if (num_steps <= 0 || num_steps > 1000000)
+	{
+		fprintf(stderr, "Usage: trajectory [days]\n");
+		return 1;
+	}
+
+	sol = solsys_load(STRINGIFY(ROOT_PATH) "/data/sol.ini");
+	if (sol == NULL)
+		return 1;
+	n = sol->num_bodies;
+	path = ralloc_array(sol, const char *, n);
+	rows = ralloc_array(sol, double, 3 * (size_t) n * num_steps);
+	if (path == NULL || rows == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		ralloc_free(sol);
+		return 1;
+	}
+	for (b = 0; b < n; b++)
+		path[b] = sol->body[b].name;
+	for (s = 0; s < num_steps; s++)
+	{
+		solsys_update(sol, s * 86400.0);
+		for (b = 0; b < n; b++)
+		{
+			double *row = &rows[3 * (s * n + b)];
+
+			row[0] = sol->body[b].position.x;
+			row[1] = sol->body[b].position.y;
+			row[2] = sol->body[b].position.z;
+		}
+	}
+
+	printf("%d bodies, %ld steps\n", n, num_steps);
+	for (f = 0; f < sizeof(formats) / sizeof(formats[0]); f++)
+	{
+		double max_error = 0, max_relative = 0;
+
+		start = wall_time();
+		writer = traj_create(sol, filename, formats[f].format, path, n, 0,
+				86400, num_steps);
+		if (writer == NULL || !traj_write(writer, rows, num_steps) ||
+				!traj_close(writer))
+			return 1;
+		write_time = wall_time() - start;
+
+		if ((traj = traj_load(filename)) == NULL)
+			return 1;
+		if (traj->num_bodies != n || traj->num_steps != num_steps ||
+				traj->format != formats[f].format ||
+				strcmp(traj->path[n - 1], path[n - 1]) != 0)
+		{
+			fprintf(stderr, "%s: header doesn't match\n", formats[f].name);
+			return 1;
+		}
+
+		start = wall_time();
+		for (s = 0; s < num_steps; s++)
+			for (b = 0; b < n; b++)
+				sum = vec3_add(sum, traj_position(traj, b, s));
+		read_time = wall_time() - start;
+
+		for (s = 0; s < num_steps; s++)
+			for (b = 0; b < n; b++)
+			{
+				const double *row = &rows[3 * (s * n + b)];
+				Vec3 p = {row[0], row[1], row[2]};
+				double error = vec3_length(vec3_sub(traj_position(traj, b,
+						s), p));
+
+				max_error = MAX(max_error, error);
+				if (vec3_length(p) > 0)
+					max_relative = MAX(max_relative,
+							error / vec3_length(p));
+			}
+
+		printf("    %-6s %9zu bytes, written in %6.2f ms, %5.1f ns per "
+				"lookup, largest error %.3g m (%.2g relative)\n",
+				formats[f].name, traj->size, 1e3 * write_time,
+				1e9 * read_time / (num_steps * n), max_error,
+				max_relative);
+		ralloc_free(traj);
+		remove(filename);
+
+		/* Doubles go in and out untouched */
+		if (formats[f].format == TRAJ_DOUBLE && max_error != 0)
+			return 1;
+	}
+	if (sum.x == 42) /* Keep the lookups from being optimized out */
+		printf("\n");
+
+	ralloc_free(sol);
+	return 0;
+}
+
+/* Load a synthetic system of [bodies] bodies (default 10000) from an .ini
+ * file, and then again from the cache written by the first load */
+static int bench_cache(int argc, char **argv)
+{
+	const char *filename = "bench.ini", *cachename = "bench.ini.cache";
+	SolarSystem *sol, *ini, *cached;
+	int i, n = (argc > 1 ? atoi(argv[1]) : 10000);
+	double start, t_ini, t_cache;
+	bool same = true;
+
+	if (n <= 0)
+	{
+		fprintf(stderr, "Usage: cache [bodies]\n");
+		return 1;
+	}
+
+	sol = synthetic_system(n, MAX(1, n / 1000));
+	if (sol == NULL || !write_ini(sol, filename, false))
+		return 1;
+	ralloc_free(sol);
+	remove(cachename);
+
+	start = wall_time();
+	ini = solsys_load(filename);
+	t_ini = wall_time() - start;
+
+	start = wall_time();
+	cached = solsys_load(filename);
+	t_cache = wall_time() - start;
+
+	if (ini == NULL || cached == NULL)
+		return 1;
+
+	solsys_update(ini, 1e8);
+	solsys_update(cached, 1e8);
+	for (i = 0; i < n; i++)
+		if (memcmp(&ini->body[i].position, &cached->body[i].position,
+					sizeof(Vec3)) != 0 ||
+				strcmp(ini->body[i].name, cached->body[i].name) != 0)
+			same = false;
+
+	printf("%d bodies: .ini %.1f ms, cache %.2f ms (%.0fx)%s\n", n,
+			1e3 * t_ini, 1e3 * t_cache, t_ini / t_cache,
+			same ? "" : ", but the systems differ!");
+
+	ralloc_free(ini);
+	ralloc_free(cached);
+	remove(filename);
+	remove(cachename);
+	return 0;
+}
+
+/* Load synthetic systems of 10k, 100k and 1M bodies from .ini files listing
+ * the satellites before their primaries, then look bodies up by path */
+static int bench_load(int argc, char **argv)
+{
+	const int sizes[] = {10000, 100000, 1000000};
+	const char *filename = "bench.ini", *cachename = "bench.ini.cache";
+	const int num_lookups = 1000000;
+	unsigned k;
+
+	(void) argc;
+	(void) argv;
+
+	for (k = 0; k < sizeof(sizes)/sizeof(sizes[0]); k++)
+	{
+		SolarSystem *sol;
+		FILE *fd;
+		char path[64];
+		double start, t_ini, t_cache, t_find, megabytes = 0;
+		int i, n = sizes[k], found = 0;
+
+		sol = synthetic_system(n, MAX(1, n / 1000));
+		if (sol == NULL || !write_ini(sol, filename, true))
+			return 1;
+		ralloc_free(sol);
+		remove(cachename);
+		if ((fd = fopen(filename, "rb")) != NULL)
+		{
+			megabytes = fsize(fd) / 1e6;
+			fclose(fd);
+		}
+
+		start = wall_time();
+		sol = solsys_load(filename);
+		t_ini = wall_time() - start;
+		ralloc_free(sol);
+
+		start = wall_time();
+		sol = solsys_load(filename);
+		t_cache = wall_time() - start;
+		if (sol == NULL)
+			return 1;
+
+		/* Builds the index on the first call */
+		start = wall_time();
+		for (i = 0; i < num_lookups; i++)
+		{
+			Body *body = &sol->body[rand() % n];
+
+			if (body->primary != NULL && body->primary->primary != NULL)
+				snprintf(path, sizeof(path), "%s/%s",
+						body->primary->name, body->name);
+			else
+				snprintf(path, sizeof(path), "%s", body->name);
+			found += (solsys_find_body(sol, path) == body);
+		}
+		t_find = wall_time() - start;
+
+		printf("%7d bodies: .ini %8.1f ms (%4.0f MB/s), cache %6.1f ms, "
+				"find %5.0f ns (%d/%d found)\n", n, 1e3 * t_ini,
+				megabytes / t_ini, 1e3 * t_cache,
+				1e9 * t_find / num_lookups, found, num_lookups);
+		ralloc_free(sol);
+	}
+
+	remove(filename);
+	remove(cachename);
+	return 0;
+}
+
+/* Body-steps per second of both integrators for 64 to 4096 bodies (or just
+ * [bodies]), and their energy error over a century of a star with eight
+ * planets */
+static int bench_nbody(int argc, char **argv)
+{
+	const NBodyMethod methods[] = {NBODY_LEAPFROG, NBODY_YOSHIDA};
+	const char *method_name[] = {"", "Leapfrog", "Yoshida"};
+	const double day = 86400;
+	int first = 64, last = 4096, n;
+	unsigned k;
+
+	if (argc > 1)
+		first = last = atoi(argv[1]);
+	if (first <= 1)
+	{
+		fprintf(stderr, "Usage: nbody [bodies]\n");
+		return 1;
+	}
+
+	for (k = 0; k < sizeof(methods)/sizeof(methods[0]); k++)
+	{
+		SolarSystem *sol = synthetic_system(9, 8);
+		double e0, e1;
+
+		if (sol == NULL || !solsys_set_nbody(sol, methods[k], 0, day))
+			return 1;
+		e0 = nbody_energy(sol->nbody);
+		solsys_update(sol, 36525 * day);
+		e1 = nbody_energy(sol->nbody);
+		printf("%-8s: relative energy error %.2e after 100 years in "
+				"steps of a day\n", method_name[methods[k]],
+				fabs((e1 - e0) / e0));
+		ralloc_free(sol);
+	}
+
+	for (n = first; n <= last; n *= 4)
+	{
+		for (k = 0; k < sizeof(methods)/sizeof(methods[0]); k++)
+		{
+			SolarSystem *sol = synthetic_system(n, n - 1);
+			int steps = MAX(2, 100000000 / n / n);
+			double start, elapsed;
+
+			if (sol == NULL || !solsys_set_nbody(sol, methods[k], 0, day))
+				return 1;
+
+			start = wall_time();
+			solsys_update(sol, steps * day);
+			elapsed = wall_time() - start;
+
+			printf("%5d bodies, %-8s: %8.3g body-steps/s, "
+					"%6.2f ns per interaction\n", n, method_name[methods[k]],
+					n * (double) steps / elapsed, 1e9 * elapsed / steps /
+					((double) n * n * (methods[k] == NBODY_YOSHIDA ? 3 : 1)));
+			ralloc_free(sol);
+		}
+	}
+
+	return 0;
+}
+
+/* A ring of n bodies with a fifth of them scattered in a cloud around it */
+static NBody *debris_ring(void *ctx, int n)
+{
+	NBody *nbody = nbody_create(ctx, n, NBODY_LEAPFROG);
+	int i;
+
+	if (nbody == NULL)
+		return NULL;
+
+	for (i = 0; i < n; i++)
+	{
+		double phi = uniform(0, 2*M_PI), r, z;
+
+		if (i % 5 == 0)
+		{
+			r = uniform(0, 3e8);
+			z = uniform(-1e8, 1e8);
+		} else
+		{
+			r = uniform(7e7, 1.4e8);
+			z = uniform(-1e5, 1e5);
+		}
+		nbody->x[i] = r * cos(phi);
+		nbody->y[i] = r * sin(phi);
+		nbody->z[i] = z;
+		nbody->mu[i] = uniform(1, 100);
+	}
+
+	return nbody;
+}
+
+/* Barnes-Hut against direct summation for 10k, 100k and 1M bodies (or
+ * [bodies]) on [threads] threads. The error is measured on a sample of
+ * bodies; direct summation is timed up to 16k bodies and extrapolated as
+ * n^2 beyond that. */
+static int bench_barneshut(int argc, char **argv)
+{
+	const double angles[] = {0.3, 0.5, 0.7, 1.0};
+	const int samples = 1000, max_direct = 16384;
+	int first = 10000, last = 1000000, n;
+	int threads = (argc > 2 ? atoi(argv[2]) : 4);
+	double per_interaction = 0;
+	WorkPool *pool;
+
+	if (argc > 1)
+		first = last = atoi(argv[1]);
+	if (first <= 1 || threads <= 0)
+	{
+		fprintf(stderr, "Usage: barneshut [bodies] [threads]\n");
+		return 1;
+	}
+	pool = (threads > 1 ? workpool_create(NULL, threads) : NULL);
+
+	for (n = first; n <= last; n *= 10)
+	{
+		NBody *nbody = debris_ring(NULL, MAX(n, max_direct));
+		double *ref, start, direct;
+		int *sample, i, j;
+		unsigned k;
+
+		if (nbody == NULL)
+			return 1;
+		nbody->num_bodies = n;
+		nbody->pool = pool;
+		ref = ralloc_array(nbody, double, 3 * samples);
+		sample = ralloc_array(nbody, int, samples);
+		if (ref == NULL || sample == NULL)
+			return 1;
+
+		/* Cost per interaction of the SIMD direct sum, from up to 16k */
+		nbody->num_bodies = MIN(n, max_direct);
+		nbody->padded = (nbody->num_bodies + SIMD_WIDTH - 1) / SIMD_WIDTH *
+				SIMD_WIDTH;
+		start = wall_time();
+		nbody_accelerations(nbody);
+		direct = wall_time() - start;
+		if (n <= max_direct || per_interaction == 0)
+			per_interaction = direct / ((double) nbody->num_bodies *
+					nbody->padded);
+		direct = per_interaction * (double) n * n;
+		nbody->num_bodies = n;
+		nbody->padded = n; /* No longer used for the direct sum */
+
+		for (i = 0; i < samples; i++)
+		{
+			double ax = 0, ay = 0, az = 0;
+
+			sample[i] = rand() % n;
+			for (j = 0; j < n; j++)
+			{
+				double dx = nbody->x[j] - nbody->x[sample[i]];
+				double dy = nbody->y[j] - nbody->y[sample[i]];
+				double dz = nbody->z[j] - nbody->z[sample[i]];
+				double r2 = dx*dx + dy*dy + dz*dz, s;
+
+				if (j == sample[i])
+					continue;
+				s = nbody->mu[j] / (r2 * sqrt(r2));
+				ax += s * dx, ay += s * dy, az += s * dz;
+			}
+			ref[3*i + 0] = ax;
+			ref[3*i + 1] = ay;
+			ref[3*i + 2] = az;
+		}
+
+		printf("%d bodies, direct summation %.3g s per step%s\n", n, direct,
+				n > max_direct ? " (extrapolated)" : "");
+		printf("  angle |   nodes | build ms | force ms | speedup | "
+				"rms error | max error\n");
+		for (k = 0; k < sizeof(angles)/sizeof(angles[0]); k++)
+		{
+			Octree *tree = octree_create(nbody);
+			double build, force, sum2 = 0, max_err = 0;
+
+			start = wall_time();
+			octree_build(tree, nbody->x, nbody->y, nbody->z, nbody->mu, n,
+					angles[k], pool);
+			build = wall_time() - start;
+			start = wall_time();
+			octree_accelerations(tree, nbody->ax, nbody->ay, nbody->az, 0,
+					pool);
+			force = wall_time() - start;
+
+			for (i = 0; i < samples; i++)
+			{
+				const double *a = &ref[3*i];
+				double err = sqrt(SQUARE(nbody->ax[sample[i]] - a[0]) +
+						SQUARE(nbody->ay[sample[i]] - a[1]) +
+						SQUARE(nbody->az[sample[i]] - a[2])) /
+						sqrt(SQUARE(a[0]) + SQUARE(a[1]) + SQUARE(a[2]));
+
+				sum2 += err * err;
+				max_err = MAX(max_err, err);
+			}
+
+			printf("  %5.2f | %7d | %8.2f | %8.2f | %6.1fx | %9.2e | %9.2e\n",
+					angles[k], octree_num_nodes(tree), 1e3 * build,
+					1e3 * force, direct / (build + force),
+					sqrt(sum2 / samples), max_err);
+			ralloc_free(tree);
+		}
+
+		ralloc_free(nbody);
+	}
+
+	ralloc_free(pool);
+	return 0;
+}
+
+/* Kepler's equation in long double by bisection, as a reference */
+static long double kepler_reference(double ecc, double M)
+{
+	long double e = ecc, m = fabsl(M), lo = 0, hi, mid;
+	int i;
+
+	if (ecc < 1)
+		hi = M_PI + 1;
+	else
+		hi = asinhl(m/e + 1) + 1;
+	for (i = 0; i < 128; i++)
+	{
+		long double f;
+
+		mid = (lo + hi) / 2;
+		f = (ecc < 1 ? mid - e*sinl(mid) : e*sinhl(mid) - mid) - m;
+		if (f > 0)
+			hi = mid;
+		else
+			lo = mid;
+	}
+
+	return M < 0 ? -mid : mid;
+}
+
+/* Accuracy, iteration count and time per solve of kepler_solve() over a grid
+ * of eccentricities and mean anomalies */
+static int bench_solver(int argc, char **argv)
+{
+	const struct {
+		double min_ecc, max_ecc, max_M;
+	} band[] = {
+		{0.0, 0.5, M_PI}, {0.5, 0.9, M_PI}, {0.9, 0.99, M_PI},
+		{0.99, 0.999999, M_PI}, {1.0, 1.0, 50},
+		{1.000001, 1.5, 50}, {1.5, 5, 50}, {5, 50, 500},
+	};
+	const int grid = 400;
+	unsigned k;
+
+	(void) argc; (void) argv;
+
+	printf("       e range      |     max error | iterations | ns/solve\n");
+	for (k = 0; k < sizeof(band)/sizeof(band[0]); k++)
+	{
+		int i, j, iterations, total_iterations = 0, max_iterations = 0;
+		int rep, reps = 10;
+		double start, elapsed, max_err = 0, sum = 0;
+
+		for (i = 0; i < grid; i++)
+		{
+			double e = band[k].min_ecc + (band[k].max_ecc - band[k].min_ecc) *
+					i / (grid - 1);
+			for (j = 0; j < grid; j++)
+			{
+				double M = band[k].max_M * (2.0 * j / (grid - 1) - 1);
+				double E = kepler_solve(e, M, &iterations);
+				double err;
+
+				if (e == 1) /* Barker's equation: D + D^3/3 = M */
+					err = fabs(E + E*E*E/3 - M) / (1 + E*E);
+				else
+					err = fabs((double) (E - kepler_reference(e, M)));
+				max_err = MAX(max_err, err / MAX(1.0, fabs(E)));
+				total_iterations += iterations;
+				max_iterations = MAX(max_iterations, iterations);
+			}
+		}
+
+		start = wall_time();
+		for (rep = 0; rep < reps; rep++)
+			for (i = 0; i < grid; i++)
+			{
+				double e = band[k].min_ecc + (band[k].max_ecc -
+						band[k].min_ecc) * i / (grid - 1);
+				for (j = 0; j < grid; j++)
+					sum += kepler_solve(e, band[k].max_M *
+							(2.0 * j / (grid - 1) - 1), NULL);
+			}
+		elapsed = wall_time() - start;
+
+		printf("%8.6f - %9.6f | %13.3g | %4.2f (%2d) | %8.1f\n",
+				band[k].min_ecc, band[k].max_ecc, max_err,
+				(double) total_iterations / (grid * grid), max_iterations,
+				1e9 * elapsed / ((double) reps * grid * grid));
+		if (sum == 42) /* Keep the timing loop from being optimized out */
+			printf("\n");
+	}
+
+	return 0;
+}
+
+static const Benchmark benchmark[] = {
+	{"kepler", "Batched SoA propagation against the per-body loop",
+			bench_kepler},
+	{"orbits", "Per-body update time on sol.ini scaled to N bodies",
+			bench_orbits},
+	{"solver", "Accuracy and cost of the Kepler solver over an (e, M) grid",
+			bench_solver},
+	{"warm", "Warm-started against cold solves at a fixed time step",
+			bench_warm},
+	{"state", "Positions and velocities from one solve, single and batched",
+			bench_state},
+	{"ephemeris", "Chebyshev ephemeris lookups against Kepler solves",
+			bench_ephemeris},
+	{"trajectory", "Writing ephemgen files in each format and reading back",
+			bench_trajectory},
+	{"cache", "Loading from an .ini file against the compiled cache",
+			bench_cache},
+	{"load", "Loading 10k to 1M bodies and finding them by name",
+			bench_load},
+	{"nbody", "N-body integrators, throughput and energy error",
+			bench_nbody},
+	{"barneshut", "Barnes-Hut tree forces against direct summation",
+			bench_barneshut},
+	{"lod", "Time level of detail: solves skipped and the error in pixels",
+			bench_lod},
+	{"timeline", "Scrubbing through cached keyframes against solving",
+			bench_timeline},
+	{"parallel", "solsys_update() scaling with the number of threads",
+			bench_parallel},
+	{"approach", "Close approach search against comparing pairs on a grid",
+			bench_approach},
+	{"events", "Orbital events in closed form against hourly sampling",
+			bench_events},
+	{"porkchop", "Lambert transfers on a grid, states cached or per cell",
+			bench_porkchop},
+};
+
+int main(int argc, char **argv)
+{
+	unsigned i;
+	const unsigned num_benchmarks = sizeof(benchmark)/sizeof(benchmark[0]);
+
+	if (argc < 2)
+	{
+		fprintf(stderr, "Usage: %s <benchmark> [arguments]\n", argv[0]);
+		for (i = 0; i < num_benchmarks; i++)
+			fprintf(stderr, "    %-12s %s\n", benchmark[i].name,
+					benchmark[i].description);
+		return 1;
+	}
+
+	for (i = 0; i < num_benchmarks; i++)
+		if (strcmp(argv[1], benchmark[i].name) == 0)
+			return benchmark[i].run(argc - 1, argv + 1);
+
+	fprintf(stderr, "Unknown benchmark: %s\n", argv[1]);
+	return 1;
+}
@@ -0,0 +1,456 @@
+#define _POSIX_C_SOURCE 200112L
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <ralloc.h>
+
+#include "ephemeris.h"
+#include "log.h"
+
+#define EPHEM_MAGIC "KOSEPH1"
+#define EPHEM_BYTE_ORDER 0x01020304u
+
+#define NUM_COEFFS 13 /* Degree 12, as in most DE segments */
+#define MAX_COEFFS 32 /* Largest degree a loaded file may use */
+#define SEGMENTS_PER_ORBIT 8 /* First guess, doubled until it fits */
+#define CHECKS_PER_COEFF 4 /* Error samples per segment and coefficient */
+#define MAX_SEGMENTS (1 << 22)
+
+/* T_k(x) and T'_k(x) for k < n by the three term recurrence */
+static void chebyshev_basis(int n, double x, double *T, double *dT)
+{
+	int k;
+
+	T[0] = 1;
+	dT[0] = 0;
+	if (n > 1)
+	{
+		T[1] = x;
+		dT[1] = 1;
+	}
+	for (k = 2; k < n; k++)
+	{
+		T[k] = 2*x*T[k - 1] - T[k - 2];
+		dT[k] = 2*T[k - 1] + 2*x*dT[k - 1] - dT[k - 2];
+	}
+}
+
+/* The series of one segment at x in [-1, 1], and its derivative in x */
+static void eval_segment(const double *coeff, int n, double x,
+		Vec3 *f, Vec3 *df)
+{
+	double T[MAX_COEFFS], dT[MAX_COEFFS];
+	double p[3] = {0, 0, 0}, v[3] = {0, 0, 0};
+	int axis, k;
+
+	chebyshev_basis(n, x, T, dT);
+	for (axis = 0; axis < 3; axis++)
+	{
+		const double *c = &coeff[axis*n];
+
+		for (k = 0; k < n; k++)
+		{
+			p[axis] += c[k] * T[k];
+			v[axis] += c[k] * dT[k];
+		}
+	}
+
+	*f = (Vec3) {p[0], p[1], p[2]};
+	if (df != NULL)
+		*df = (Vec3) {v[0], v[1], v[2]};
+}
+
+/* Interpolate the orbit at the Chebyshev nodes of [t0, t0 + length] and
+ * return the largest error seen on a grid of CHECKS_PER_COEFF points per
+ * coefficient, ends included. The extrema of T_n alone are no bound, the
+ * error can peak in between. */
+static double fit_segment(KeplerOrbit *orbit, double t0, double length,
+		double *coeff)
+{
+	const int n = NUM_COEFFS;
+	double half = length / 2, mid = t0 + half, error = 0;
+	Vec3 f[NUM_COEFFS], p;
+	int j, k;
+
+	for (j = 0; j < n; j++)
+		f[j] = kepler_position_at_time(orbit,
+				mid + half*cos(M_PI*(j + 0.5)/n));
+
+	for (k = 0; k < n; k++)
+	{
+		double sx = 0, sy = 0, sz = 0, w = (k == 0 ? 1.0 : 2.0) / n;
+
+		for (j = 0; j < n; j++)
+		{
+			double T = cos(M_PI*k*(j + 0.5)/n);
+
+			sx += f[j].x * T;
+			sy += f[j].y * T;
+			sz += f[j].z * T;
+		}
+		coeff[k] = w * sx;
+		coeff[n + k] = w * sy;
+		coeff[2*n + k] = w * sz;
+	}
+
+	for (j = 0; j <= CHECKS_PER_COEFF*n; j++)
+	{
+		double x = cos(M_PI*j/(CHECKS_PER_COEFF*n));
+
+		eval_segment(coeff, n, x, &p, NULL);
+		p = vec3_sub(p, kepler_position_at_time(orbit, mid + half*x));
+		error = MAX(error, vec3_length(p));
+	}
+
+	return error;
+}
+
+/* Fit one body with the fewest segments that meet the tolerance. Returns
+ * its coefficients, or NULL if it would take more than MAX_SEGMENTS. */
+static double *fit_body(void *ctx, Body *body, double start, double end,
+		double tolerance, EphemerisBody *rec)
+{
+	KeplerOrbit *orbit = &body->orbit;
+	double span = end - start, *coeff = NULL;
+	long n = 1;
+	int s;
+
+	rec->num_segments = 0;
+	rec->num_coeffs = NUM_COEFFS;
+	rec->segment_length = span;
+
+	/* Bodies that never leave the tolerance around their primary don't
+	 * need any segments at all */
+	if (body->primary == NULL ||
+			(orbit->Ecc < 1 && orbit->SMa*(1 + orbit->Ecc) <= tolerance))
+		return ralloc_array(ctx, double, 0);
+
+	if (isfinite(orbit->period) && orbit->period > 0)
+		n = MAX(1, (long) ceil(span / orbit->period * SEGMENTS_PER_ORBIT));
+
+	for (; n <= MAX_SEGMENTS; n *= 2)
+	{
+		double length = span / n;
+		bool fits = true;
+
+		coeff = reralloc(ctx, coeff, double, 3*NUM_COEFFS*n);
+		if (coeff == NULL)
+		{
+			log_err("Out of memory\n");
+			return NULL;
+		}
+
+		for (s = 0; s < n && fits; s++)
+			fits = fit_segment(orbit, start + s*length, length,
+					&coeff[3*NUM_COEFFS*s]) <= tolerance;
+
+		if (fits)
+		{
+			rec->num_segments = n;
+			rec->segment_length = length;
+			return coeff;
+		}
+	}
+
+	log_err("%s needs more than %d segments for a tolerance of %g m\n",
+			body->name, MAX_SEGMENTS, tolerance);
+	ralloc_free(coeff);
+	return NULL;
+}
+
+/* Lay out the header, body records and coefficients as they will sit in a
+ * file, and point the Ephemeris at them */
+static bool ephem_attach(Ephemeris *ephem, void *data, size_t size)
+{
+	const EphemerisHeader *header = data;
+	const EphemerisBody *body;
+	size_t records;
+	uint32_t i;
+
+	if (size < sizeof(*header) ||
+			memcmp(header->magic, EPHEM_MAGIC, sizeof(header->magic)) != 0)
+	{
+		log_err("Not an ephemeris file\n");
+		return false;
+	}
+	if (header->byte_order != EPHEM_BYTE_ORDER)
+	{
+		log_err("Ephemeris was written with a different byte order\n");
+		return false;
+	}
+
+	records = sizeof(*header) + header->num_bodies * sizeof(EphemerisBody);
+	if (header->num_bodies > INT32_MAX || size < records ||
+			(size - records) / sizeof(double) < header->num_coeffs)
+	{
+		log_err("Ephemeris is truncated\n");
+		return false;
+	}
+
+	body = (const EphemerisBody *) (header + 1);
+	for (i = 0; i < header->num_bodies; i++)
+	{
+		uint64_t used = 3 * (uint64_t) body[i].num_coeffs *
+				(uint64_t) body[i].num_segments;
+
+		if (body[i].primary >= (int32_t) header->num_bodies ||
+				body[i].num_segments < 0 || body[i].num_coeffs < 1 ||
+				body[i].num_coeffs > MAX_COEFFS ||
+				body[i].offset > header->num_coeffs ||
+				used > header->num_coeffs - body[i].offset)
+		{
+			log_err("Ephemeris record %u is corrupt\n", i);
+			return false;
+		}
+	}
+
+	/* ephem_state() follows the primaries up to the root */
+	for (i = 0; i < header->num_bodies; i++)
+	{
+		int32_t p = body[i].primary;
+		uint32_t depth = 0;
+
+		while (p >= 0 && depth++ < header->num_bodies)
+			p = body[p].primary;
+		if (p >= 0)
+		{
+			log_err("Ephemeris primaries form a cycle\n");
+			return false;
+		}
+	}
+
+	ephem->start = header->start;
+	ephem->end = header->end;
+	ephem->num_bodies = header->num_bodies;
+	ephem->body = body;
+	ephem->coeff = (const double *) ((const char *) data + records);
+	ephem->data = data;
+	ephem->size = size;
+
+	return true;
+}
+
+/* Fit every body of the system over [start, end] to within tolerance
+ * metres of its Kepler orbit. The tolerance holds for each body relative to
+ * its primary, so absolute positions of moons can be off by a bit more. */
+Ephemeris *ephem_build(SolarSystem *solsys, double start, double end,
+		double tolerance)
+{
+	Ephemeris *ephem;
+	EphemerisHeader *header;
+	EphemerisBody *rec;
+	double **coeff, *all;
+	uint64_t total = 0;
+	size_t size;
+	int i;
+
+	if (!(end > start) || !(tolerance > 0))
+	{
+		log_err("Invalid ephemeris interval or tolerance\n");
+		return NULL;
+	}
+
+	ephem = rzalloc(NULL, Ephemeris);
+	if (ephem == NULL)
+	{
+		log_err("Out of memory\n");
+		return NULL;
+	}
+
+	rec = ralloc_array(ephem, EphemerisBody, solsys->num_bodies);
+	coeff = ralloc_array(ephem, double *, solsys->num_bodies);
+	if (rec == NULL || coeff == NULL)
+	{
+		log_err("Out of memory\n");
+		ralloc_free(ephem);
+		return NULL;
+	}
+
+	for (i = 0; i < solsys->num_bodies; i++)
+	{
+		Body *body = &solsys->body[i];
+
+		coeff[i] = fit_body(coeff, body, start, end, tolerance, &rec[i]);
+		if (coeff[i] == NULL)
+		{
+			ralloc_free(ephem);
+			return NULL;
+		}
+		rec[i].primary = (body->primary ? body->primary - solsys->body : -1);
+		rec[i].reserved = 0;
+		rec[i].offset = total;
+		total += 3 * rec[i].num_coeffs * (uint64_t) rec[i].num_segments;
+	}
+
+	size = sizeof(*header) + solsys->num_bodies * sizeof(*rec) +
+			total * sizeof(double);
+	header = rzalloc_size(ephem, size);
+	if (header == NULL)
+	{
+		log_err("Out of memory\n");
+		ralloc_free(ephem);
+		return NULL;
+	}
+
+	memcpy(header->magic, EPHEM_MAGIC, sizeof(header->magic));
+	header->byte_order = EPHEM_BYTE_ORDER;
+	header->num_bodies = solsys->num_bodies;
+	header->start = start;
+	header->end = end;
+	header->num_coeffs = total;
+	memcpy(header + 1, rec, solsys->num_bodies * sizeof(*rec));
+
+	all = (double *) ((EphemerisBody *) (header + 1) + solsys->num_bodies);
+	for (i = 0; i < solsys->num_bodies; i++)
+		memcpy(&all[rec[i].offset], coeff[i], 3 * rec[i].num_coeffs *
+				(size_t) rec[i].num_segments * sizeof(double));
+
+	/* The per-body pieces were only scaffolding */
+	ralloc_free(coeff);
+	ralloc_free(rec);
+
+	if (!ephem_attach(ephem, header, size))
+	{
+		ralloc_free(ephem);
+		return NULL;
+	}
+
+	return ephem;
+}
+
+static void ephem_unmap(void *ptr)
+{
+	Ephemeris *ephem = ptr;
+
+	if (ephem->mapped)
+		munmap(ephem->data, ephem->size);
+}
+
+/* Map an ephemeris written by ephem_save(). Nothing is copied; pages are
+ * read in as queries touch them. */
+Ephemeris *ephem_load(const char *filename)
+{
+	Ephemeris *ephem;
+	struct stat st;
+	void *data;
+	int fd;
+
+	if ((fd = open(filename, O_RDONLY)) < 0)
+	{
+		log_err("Couldn't open file: %s\n", filename);
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size <= 0)
+	{
+		log_err("Couldn't determine size of file: %s\n", filename);
+		close(fd);
+		return NULL;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+	{
+		log_err("Couldn't map file: %s\n", filename);
+		return NULL;
+	}
+
+	ephem = rzalloc(NULL, Ephemeris);
+	if (ephem == NULL)
+	{
+		log_err("Out of memory\n");
+		munmap(data, st.st_size);
+		return NULL;
+	}
+	ephem->data = data;
+	ephem->size = st.st_size;
+	ephem->mapped = true;
+	ralloc_set_destructor(ephem, ephem_unmap);
+
+	if (!ephem_attach(ephem, data, st.st_size))
+	{
+		log_err("Couldn't load ephemeris from file: %s\n", filename);
+		ralloc_free(ephem);
+		return NULL;
+	}
+
+	return ephem;
+}
+
+bool ephem_save(const Ephemeris *ephem, const char *filename)
+{
+	FILE *fd;
+	bool ok;
+
+	if ((fd = fopen(filename, "wb")) == NULL)
+	{
+		log_err("Couldn't open file: %s\n", filename);
+		return false;
+	}
+
+	ok = fwrite(ephem->data, 1, ephem->size, fd) == ephem->size;
+	ok = (fclose(fd) == 0) && ok;
+	if (!ok)
+		log_err("Error writing ephemeris file %s\n", filename);
+
+	return ok;
+}
+
+/* Position and velocity (optional) of a body relative to its primary.
+ * Returns false if t lies outside the ephemeris. */
+bool ephem_relative_state(const Ephemeris *ephem, int body, double t,
+		Vec3 *position, Vec3 *velocity)
+{
+	const EphemerisBody *rec = &ephem->body[body];
+	double u;
+	long s;
+
+	if (!(t >= ephem->start && t <= ephem->end))
+		return false;
+
+	if (rec->num_segments == 0)
+	{
+		*position = (Vec3) {0, 0, 0};
+		if (velocity != NULL)
+			*velocity = (Vec3) {0, 0, 0};
+		return true;
+	}
+
+	u = (t - ephem->start) / rec->segment_length;
+	s = MIN((long) u, rec->num_segments - 1);
+
+	eval_segment(&ephem->coeff[rec->offset + 3*rec->num_coeffs*s],
+			rec->num_coeffs, 2*(u - s) - 1, position, velocity);
+	/* dx/dt = 2 / segment length */
+	if (velocity != NULL)
+		*velocity = vec3_scale(*velocity, 2 / rec->segment_length);
+
+	return true;
+}
+
+/* Like ephem_relative_state(), but relative to the root of the system */
+bool ephem_state(const Ephemeris *ephem, int body, double t,
+		Vec3 *position, Vec3 *velocity)
+{
+	Vec3 p, v;
+
+	if (!ephem_relative_state(ephem, body, t, position, velocity))
+		return false;
+
+	for (body = ephem->body[body].primary; body >= 0;
+			body = ephem->body[body].primary)
+	{
+		ephem_relative_state(ephem, body, t, &p, velocity ? &v : NULL);
+		*position = vec3_add(*position, p);
+		if (velocity != NULL)
+			*velocity = vec3_add(*velocity, v);
+	}
+
+	return true;
+}
@@ -0,0 +1,58 @@
+#ifndef KOSMOS_EPHEMERIS_H
+#define KOSMOS_EPHEMERIS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "mathlib.h"
+#include "solarsystem.h"
+
+/* Piecewise Chebyshev fits of every body's position relative to its
+ * primary, in the spirit of the JPL DE files. Each body gets its own
+ * segment length, so looking up a time is a division, not a search.
+ *
+ * The in-memory layout is the file layout: a header, one record per body
+ * and one array of coefficients. A saved ephemeris is mapped straight
+ * into memory by ephem_load(), which is why the records use fixed size
+ * types. Files are only readable on machines with the same byte order. */
+
+typedef struct EphemerisHeader {
+	char magic[8];
+	uint32_t byte_order; /* EPHEM_BYTE_ORDER as written by the creator */
+	uint32_t num_bodies;
+	double start, end; /* Covered interval */
+	uint64_t num_coeffs;
+} EphemerisHeader;
+
+typedef struct EphemerisBody {
+	int32_t primary; /* Index of the primary, -1 if there is none */
+	int32_t num_segments; /* 0 for a body that stays at its primary */
+	int32_t num_coeffs; /* Per axis per segment, the degree plus one */
+	int32_t reserved;
+	double segment_length;
+	/* Segment s starts at coefficient offset + 3*num_coeffs*s and holds
+	 * the x, y and z series one after another */
+	uint64_t offset;
+} EphemerisBody;
+
+typedef struct Ephemeris {
+	double start, end;
+	int num_bodies;
+	const EphemerisBody *body;
+	const double *coeff;
+
+	void *data; /* The header, body records and coefficients in one block */
+	size_t size;
+	bool mapped; /* data is a mapping of a file rather than ralloc'd */
+} Ephemeris;
+
+Ephemeris *ephem_build(SolarSystem *solsys, double start, double end,
+		double tolerance);
+Ephemeris *ephem_load(const char *filename);
+bool ephem_save(const Ephemeris *ephem, const char *filename);
+bool ephem_relative_state(const Ephemeris *ephem, int body, double t,
+		Vec3 *position, Vec3 *velocity);
+bool ephem_state(const Ephemeris *ephem, int body, double t,
+		Vec3 *position, Vec3 *velocity);
+
+#endif
@@ -0,0 +1,216 @@
+#define _POSIX_C_SOURCE 200112L
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <ralloc.h>
+
+#include "solarsystem.h"
+#include "trajectory.h"
+#include "util.h"
+#include "workpool.h"
+
+/* Propagates every body of a system over a range of time and writes their
+ * positions to a trajectory file, see trajectory.h. Steps are independent,
+ * so each chunk of rows is spread over the threads and then written out. */
+
+#define CHUNK_BYTES (16 << 20) /* Rows buffered before writing */
+
+typedef struct Job {
+	SolarSystem *solsys;
+	double start, step;
+	long first; /* Step of the first row */
+	double *rows;
+} Job;
+
+/* Row r is the positions at step first + r, relative to the root like
+ * solsys_update() does. Cold solves, as warm ones would write to the
+ * orbits. */
+static void propagate(void *data, int begin, int end)
+{
+	Job *job = data;
+	SolarSystem *solsys = job->solsys;
+	int r, k, n = solsys->num_bodies;
+
+	for (r = begin; r < end; r++)
+	{
+		double t = job->start + (job->first + r) * job->step;
+		double *row = job->rows + 3 * (size_t) n * r;
+
+		for (k = 0; k < n; k++)
+		{
+			int i = solsys->order[k], primary = solsys->order_primary[k];
+			Vec3 p = {0, 0, 0};
+
+			if (primary >= 0)
+			{
+				p = kepler_position_at_time(&solsys->body[i].orbit, t);
+				p.x += row[3*primary + 0];
+				p.y += row[3*primary + 1];
+				p.z += row[3*primary + 2];
+			}
+			row[3*i + 0] = p.x;
+			row[3*i + 1] = p.y;
+			row[3*i + 2] = p.z;
+		}
+	}
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-f double|float|delta] [-j threads] "
+			"[-s system.ini] <start> <end> <step> <output>\n"
+			"Times are in days. Writes the positions of all bodies from "
+			"start up to and\nincluding end.\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	const char *filename = STRINGIFY(ROOT_PATH) "/data/sol.ini";
+	const char *output, **path;
+	TrajFormat format = TRAJ_DOUBLE;
+	int k, n, arg, num_threads, rows, chunk_rows;
+	long num_steps, done;
+	double start, end, step, begin_time, solve_time = 0, total_time;
+	SolarSystem *sol;
+	WorkPool *pool = NULL;
+	TrajWriter *writer;
+	Job job;
+
+	num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	for (arg = 1; arg + 1 < argc && argv[arg][0] == '-'; arg += 2)
+	{
+		if (strcmp(argv[arg], "-f") == 0)
+		{
+			if (strcmp(argv[arg + 1], "double") == 0)
+				format = TRAJ_DOUBLE;
+			else if (strcmp(argv[arg + 1], "float") == 0)
+				format = TRAJ_FLOAT;
+			else if (strcmp(argv[arg + 1], "delta") == 0)
+				format = TRAJ_DELTA;
+			else
+			{
+				fprintf(stderr, "Unknown format: %s\n", argv[arg + 1]);
+				return 1;
+			}
+		} else if (strcmp(argv[arg], "-j") == 0)
+			num_threads = atoi(argv[arg + 1]);
+		else if (strcmp(argv[arg], "-s") == 0)
+			filename = argv[arg + 1];
+		else
+		{
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (argc - arg != 4)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	start = 86400 * atof(argv[arg]);
+	end = 86400 * atof(argv[arg + 1]);
+	step = 86400 * atof(argv[arg + 2]);
+	output = argv[arg + 3];
+	if (!(step > 0) || !(end >= start))
+	{
+		fprintf(stderr, "Need a positive step and end no earlier than "
+				"start\n");
+		return 1;
+	}
+	if ((end - start) / step >= TRAJ_MAX_STEPS)
+	{
+		fprintf(stderr, "More than %ld steps, use a longer step\n",
+				(long) TRAJ_MAX_STEPS);
+		return 1;
+	}
+	num_steps = (long) ((end - start) / step) + 1;
+
+	sol = solsys_load(filename);
+	if (sol == NULL)
+		return 1;
+	n = sol->num_bodies;
+
+	/* Paths, so bodies with the same name can be told apart */
+	path = ralloc_array(sol, const char *, n);
+	if (path == NULL)
+		goto nomemory;
+	for (k = 0; k < n; k++)
+	{
+		Body *body = &sol->body[sol->order[k]];
+		int primary = sol->order_primary[k];
+
+		if (primary < 0)
+			path[sol->order[k]] = body->name;
+		else
+			path[sol->order[k]] = ralloc_asprintf(path, "%s/%s",
+					path[primary], body->name);
+		if (path[sol->order[k]] == NULL)
+			goto nomemory;
+	}
+
+	if (num_threads > 1 && (pool = workpool_create(sol, num_threads)) == NULL)
+	{
+		fprintf(stderr, "Couldn't create a pool of %d threads\n",
+				num_threads);
+		ralloc_free(sol);
+		return 1;
+	}
+
+	chunk_rows = MAX(1, MIN(num_steps, CHUNK_BYTES / (24 * (long) n)));
+	job.solsys = sol;
+	job.start = start;
+	job.step = step;
+	job.rows = ralloc_array(sol, double, 3 * (size_t) n * chunk_rows);
+	if (job.rows == NULL)
+		goto nomemory;
+
+	writer = traj_create(sol, output, format, path, n, start, step,
+			num_steps);
+	if (writer == NULL)
+	{
+		ralloc_free(sol);
+		return 1;
+	}
+
+	begin_time = wall_time();
+	for (done = 0; done < num_steps; done += rows)
+	{
+		double t0 = wall_time();
+
+		rows = MIN(chunk_rows, num_steps - done);
+		job.first = done;
+		workpool_run(pool, propagate, &job, rows, MAX(1, 4096 / n));
+		solve_time += wall_time() - t0;
+
+		if (!traj_write(writer, job.rows, rows))
+		{
+			fprintf(stderr, "Error writing %s\n", output);
+			ralloc_free(sol);
+			return 1;
+		}
+	}
+	if (!traj_close(writer))
+	{
+		fprintf(stderr, "Error writing %s\n", output);
+		ralloc_free(sol);
+		return 1;
+	}
+	total_time = wall_time() - begin_time;
+
+	printf("%d bodies, %ld steps, %d threads\n", n, num_steps,
+			MAX(1, num_threads));
+	printf("    propagating %.3g body steps per second\n",
+			n * (double) num_steps / solve_time);
+	printf("    with output %.3g body steps per second\n",
+			n * (double) num_steps / total_time);
+
+	ralloc_free(sol);
+	return 0;
+
+nomemory:
+	fprintf(stderr, "Out of memory\n");
+	ralloc_free(sol);
+	return 1;
+}
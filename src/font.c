@@ -400,7 +400,7 @@ void text_upload_to_gpu(Shader *shader, Text *text)
 
 void text_render(Shader *shader, Text *text)
 {
-	glUniform1i(glGetUniformLocation(shader->program, "uTexture"), 0);
+	glUniform1i(shader->location[SHADER_UNI_TEXTURE], 0);
 	glmUniformMatrix(shader->location[SHADER_UNI_P_MATRIX], glmProjectionMatrix);
 	glmUniformMatrix(shader->location[SHADER_UNI_V_MATRIX], glmViewMatrix);
 	glmUniformMatrix(shader->location[SHADER_UNI_M_MATRIX], glmModelMatrix);
@@ -59,14 +59,24 @@ GLvoid glmPrintMatrix(Matrix *mat)
 	printf("%g\t%g\t%g\t%g\n", m[ 3], m[ 7], m[11], m[15]);
 }
 
-GLvoid glmUniformMatrix(GLint location, Matrix *mat)
+GLvoid glmGetMatrix(Matrix *mat, GLdouble m[16])
+{
+	memcpy(m, mat->m, 16 * sizeof(double));
+}
+
+GLvoid glmMatrixToFloat(Matrix *mat, GLfloat m[16])
 {
-	GLfloat m[16];
 	int i;
 
 	for (i = 0; i < 16; i++)
 		m[i] = (GLfloat) mat->m[i];
+}
+
+GLvoid glmUniformMatrix(GLint location, Matrix *mat)
+{
+	GLfloat m[16];
 
+	glmMatrixToFloat(mat, m);
 	glUniformMatrix4fv(location, 1, GL_FALSE, m);
 }
 
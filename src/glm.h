@@ -53,6 +53,8 @@ extern Matrix *glmViewMatrix;
 extern Matrix *glmModelMatrix;
 
 GLvoid glmPrintMatrix(Matrix *mat);
+GLvoid glmGetMatrix(Matrix *mat, GLdouble m[16]);
+GLvoid glmMatrixToFloat(Matrix *mat, GLfloat m[16]);
 GLvoid glmUniformMatrix(GLint location, Matrix *mat);
 GLvoid glmLoadIdentity(Matrix *mat);
 Matrix *glmNewMatrixStack(void);
@@ -0,0 +1,342 @@
+#define _POSIX_C_SOURCE 200112L
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <ralloc.h>
+
+#include "ini.h"
+#include "log.h"
+
+#define IS_SPACE(c) ((c) == ' ' || (c) == '\t' || (c) == '\r')
+#define IS_DIGIT(c) ((c) >= '0' && (c) <= '9')
+
+static void ini_unmap(void *ptr)
+{
+	IniFile *ini = ptr;
+
+	if (ini->end > ini->data)
+		munmap((void *) ini->data, ini->end - ini->data);
+}
+
+/* Map filename for reading. Free the IniFile to unmap it again. */
+IniFile *ini_open(void *ctx, const char *filename)
+{
+	IniFile *ini;
+	struct stat st;
+	void *data = NULL;
+	int fd;
+
+	if ((fd = open(filename, O_RDONLY)) < 0)
+	{
+		log_err("Error opening file %s\n", filename);
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0)
+	{
+		log_err("Couldn't determine size of file: %s\n", filename);
+		close(fd);
+		return NULL;
+	}
+
+	/* Mapping nothing is an error, but an empty file is just empty */
+	if (st.st_size > 0)
+	{
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED)
+		{
+			log_err("Couldn't map file: %s\n", filename);
+			close(fd);
+			return NULL;
+		}
+	}
+	close(fd);
+
+	ini = rzalloc(ctx, IniFile);
+	if (ini == NULL)
+	{
+		log_err("Out of memory\n");
+		if (data != NULL)
+			munmap(data, st.st_size);
+		return NULL;
+	}
+	ini->filename = filename;
+	ini->data = data;
+	ini->end = ini->data + st.st_size;
+	ralloc_set_destructor(ini, ini_unmap);
+	ini_rewind(ini);
+
+	/* The reader goes through the file once, front to back */
+	if (data != NULL)
+		posix_madvise(data, st.st_size, POSIX_MADV_SEQUENTIAL);
+
+	return ini;
+}
+
+void ini_rewind(IniFile *ini)
+{
+	ini->pos = ini->data;
+	ini->line = 0;
+}
+
+/* An upper bound on the number of sections and the total length of their
+ * names, for sizing arrays before reading. Only looks for '[', so it runs
+ * at memchr() speed, but a '[' in a comment or a value counts too. */
+long ini_count_sections(const IniFile *ini, size_t *name_bytes)
+{
+	const char *c = ini->data, *close;
+	long count = 0;
+
+	*name_bytes = 0;
+	while (c < ini->end && (c = memchr(c, '[', ini->end - c)) != NULL)
+	{
+		close = memchr(c, '\n', ini->end - c);
+		if (close == NULL)
+			close = ini->end;
+		*name_bytes += close - c;
+		count++;
+		c = close;
+	}
+
+	return count;
+}
+
+static IniString trim(const char *start, const char *end)
+{
+	while (start < end && IS_SPACE(*start))
+		start++;
+	while (end > start && IS_SPACE(end[-1]))
+		end--;
+
+	return (IniString) {start, end - start};
+}
+
+/* The next section header or key, skipping blank lines and comments */
+IniToken ini_next(IniFile *ini, IniString *name, IniString *value)
+{
+	while (ini->pos < ini->end)
+	{
+		const char *start = ini->pos, *end, *c;
+		IniString line;
+
+		end = memchr(start, '\n', ini->end - start);
+		if (end == NULL)
+			end = ini->end;
+		ini->pos = (end < ini->end ? end + 1 : end);
+		ini->line++;
+
+		line = trim(start, end);
+		if (line.len == 0 || line.str[0] == '#')
+			continue;
+
+		if (line.str[0] == '[')
+		{
+			if (line.str[line.len - 1] != ']')
+			{
+				log_err("%s:%d: Unterminated section name\n",
+						ini->filename, ini->line);
+				return INI_ERROR;
+			}
+			*name = trim(line.str + 1, line.str + line.len - 1);
+			return INI_SECTION;
+		}
+
+		c = memchr(line.str, '=', line.len);
+		if (c == NULL)
+		{
+			log_err("%s:%d: Expected key = value\n", ini->filename,
+					ini->line);
+			return INI_ERROR;
+		}
+		*name = trim(line.str, c);
+		*value = trim(c + 1, line.str + line.len);
+		return INI_KEY;
+	}
+
+	return INI_END;
+}
+
+bool ini_equal(IniString a, const char *b)
+{
+	return strlen(b) == a.len && memcmp(a.str, b, a.len) == 0;
+}
+
+/* Decimal numbers with at most 19 significant digits, read exactly */
+static bool parse_decimal(IniString value, uint64_t *mantissa,
+		int *exponent, int *num_digits)
+{
+	const char *c = value.str, *end = value.str + value.len;
+	int digits = 0, exp = 0, e = 0, exp_sign = 1;
+	uint64_t m = 0;
+	bool any = false;
+
+	for (; c < end && IS_DIGIT(*c); c++, any = true)
+	{
+		if (m == 0 && *c == '0')
+			continue;
+		if (digits++ == 19)
+			return false;
+		m = 10*m + (*c - '0');
+	}
+	if (c < end && *c == '.')
+	{
+		for (c++; c < end && IS_DIGIT(*c); c++, any = true)
+		{
+			exp--;
+			if (m == 0 && *c == '0')
+				continue;
+			if (digits++ == 19)
+				return false;
+			m = 10*m + (*c - '0');
+		}
+	}
+	if (!any)
+		return false;
+
+	if (c < end && (*c == 'e' || *c == 'E'))
+	{
+		c++;
+		if (c < end && (*c == '+' || *c == '-'))
+			exp_sign = (*c++ == '-' ? -1 : 1);
+		if (c == end || !IS_DIGIT(*c))
+			return false;
+		for (; c < end && IS_DIGIT(*c); c++)
+			if (e < 10000)
+				e = 10*e + (*c - '0');
+	}
+
+	*mantissa = m;
+	*exponent = exp + exp_sign*e;
+	*num_digits = digits;
+
+	return c == end;
+}
+
+#ifdef __SIZEOF_INT128__
+__extension__ typedef unsigned __int128 uint128;
+
+static int bit_length(uint128 x)
+{
+	uint64_t high = (uint64_t) (x >> 64), low = (uint64_t) x;
+
+	if (high != 0)
+		return 128 - __builtin_clzll(high);
+	return (low != 0 ? 64 - __builtin_clzll(low) : 0);
+}
+
+/* x * 2^shift to the nearest double, ties to even. sticky says whether
+ * something nonzero below x was lost. x must have more than 53 bits if
+ * sticky is set. */
+static double round_to_double(uint128 x, int shift, bool sticky)
+{
+	int drop = bit_length(x) - 53;
+	uint128 rest, half;
+	uint64_t m;
+
+	if (drop <= 0)
+		return ldexp((double) (uint64_t) x, shift);
+
+	rest = x & (((uint128) 1 << drop) - 1);
+	half = (uint128) 1 << (drop - 1);
+	m = (uint64_t) (x >> drop);
+	if (rest > half || (rest == half && (sticky || (m & 1))))
+		m++; /* 2^53 at most, which is still exact */
+
+	return ldexp((double) m, shift + drop);
+}
+
+/* mantissa * 10^exponent, correctly rounded, for |exponent| <= 27. Since
+ * 10^k = 5^k 2^k and 5^27 < 2^63, everything is exact in 128 bits: a
+ * product for positive exponents, and for negative ones a quotient with
+ * at least 63 significant bits plus whether there was a remainder. */
+static double scale_exact(uint64_t mantissa, int exponent)
+{
+	uint128 pow5 = 1, x;
+	int i, shift;
+
+	for (i = 0; i < (exponent < 0 ? -exponent : exponent); i++)
+		pow5 *= 5;
+
+	if (exponent >= 0)
+		return round_to_double(mantissa * pow5, exponent, false);
+
+	shift = 127 - bit_length(mantissa);
+	x = (uint128) mantissa << shift;
+	return round_to_double(x / pow5, exponent - shift, x % pow5 != 0);
+}
+#endif
+
+/* Like strtod(), but for a whole token. Mantissas of up to 15 digits with
+ * small exponents are the common case. Both the mantissa and the power of
+ * ten are exact doubles then, so one multiplication or division rounds
+ * correctly (Clinger's fast path). Up to 19 digits, as written by "%.17g",
+ * go through exact integer arithmetic where the compiler has 128 bit
+ * integers. Everything else goes to strtod(). */
+bool ini_parse_double(IniString value, double *ret)
+{
+	static const double pow10[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+	IniString digits = value;
+	uint64_t mantissa;
+	int exponent, num_digits, saved_errno;
+	char buf[64], *copy, *endptr;
+	bool negative = false, ok;
+
+	if (digits.len > 0 && (digits.str[0] == '-' || digits.str[0] == '+'))
+	{
+		negative = (digits.str[0] == '-');
+		digits.str++;
+		digits.len--;
+	}
+
+	if (parse_decimal(digits, &mantissa, &exponent, &num_digits))
+	{
+		double d;
+
+		if (num_digits <= 15 && exponent >= -22 && exponent <= 22)
+		{
+			d = (double) mantissa;
+			d = (exponent < 0 ? d / pow10[-exponent] : d * pow10[exponent]);
+			*ret = (negative ? -d : d);
+			return true;
+		}
+#ifdef __SIZEOF_INT128__
+		if (exponent >= -27 && exponent <= 27)
+		{
+			d = scale_exact(mantissa, exponent);
+			*ret = (negative ? -d : d);
+			return true;
+		}
+#endif
+	}
+
+	if (value.len == 0)
+		return false;
+
+	/* strtod() wants a terminated string */
+	if (value.len < sizeof(buf))
+		copy = buf;
+	else if ((copy = ralloc_size(NULL, value.len + 1)) == NULL)
+		return false;
+	memcpy(copy, value.str, value.len);
+	copy[value.len] = '\0';
+
+	saved_errno = errno;
+	errno = 0;
+	*ret = strtod(copy, &endptr);
+	ok = (errno == 0 && endptr == copy + value.len);
+	errno = saved_errno;
+
+	if (copy != buf)
+		ralloc_free(copy);
+
+	return ok;
+}
@@ -0,0 +1,38 @@
+#ifndef KOSMOS_INI_H
+#define KOSMOS_INI_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* A streaming reader for the .ini dialect of the data files: [sections],
+ * "key = value" lines and comments starting with '#'. The file is mapped
+ * and every token points straight into it, so nothing is copied and the
+ * tokens are only valid until the IniFile is freed. */
+
+typedef struct IniString {
+	const char *str; /* Not null-terminated */
+	size_t len;
+} IniString;
+
+typedef enum IniToken {
+	INI_END,
+	INI_SECTION, /* name is the section name */
+	INI_KEY, /* name and value are the key and its value */
+	INI_ERROR /* Malformed line, already logged */
+} IniToken;
+
+typedef struct IniFile {
+	const char *filename;
+	const char *data, *end;
+	const char *pos; /* Start of the next line */
+	int line; /* Number of the last line read */
+} IniFile;
+
+IniFile *ini_open(void *ctx, const char *filename);
+void ini_rewind(IniFile *ini);
+long ini_count_sections(const IniFile *ini, size_t *name_bytes);
+IniToken ini_next(IniFile *ini, IniString *name, IniString *value);
+bool ini_equal(IniString a, const char *b);
+bool ini_parse_double(IniString value, double *ret);
+
+#endif
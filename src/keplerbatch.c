@@ -0,0 +1,167 @@
+#include <ralloc.h>
+
+#include "log.h"
+#include "mathlib.h"
+#include "keplerbatch.h"
+#include "simd.h"
+
+#define MAX_ITERATIONS 32
+#define TOLERANCE 1e-12
+
+KeplerBatch *kepler_batch_create(void *ctx, int num_orbits)
+{
+	KeplerBatch *batch;
+
+	batch = rzalloc(ctx, KeplerBatch);
+	if (batch == NULL)
+		return NULL;
+	batch->num_orbits = num_orbits;
+
+#define ALLOC(field) \
+	if ((batch->field = rzalloc_array(batch, double, num_orbits)) == NULL) \
+		goto errorout
+	ALLOC(ecc); ALLOC(sma); ALLOC(smi);
+	ALLOC(mean_anomaly); ALLOC(mean_motion); ALLOC(epoch);
+	ALLOC(px); ALLOC(py); ALLOC(pz);
+	ALLOC(qx); ALLOC(qy); ALLOC(qz);
+#undef ALLOC
+
+	return batch;
+
+errorout:
+	ralloc_free(batch);
+	return NULL;
+}
+
+/* Returns false for parabolic and hyperbolic orbits, which the batch can't
+ * propagate. Those are left for kepler_position_at_time(). */
+bool kepler_batch_set_orbit(KeplerBatch *batch, int i,
+		const KeplerOrbit *orbit)
+{
+	if (!(orbit->Ecc < 1))
+	{
+		log_err("Orbit %d isn't elliptic, e = %g\n", i, orbit->Ecc);
+		return false;
+	}
+
+	batch->ecc[i] = orbit->Ecc;
+	batch->sma[i] = orbit->SMa;
+	batch->smi[i] = orbit->SMi;
+	batch->mean_anomaly[i] = orbit->mean_anomaly;
+	batch->mean_motion[i] = orbit->mean_motion;
+	batch->epoch[i] = orbit->epoch;
+
+	batch->px[i] = orbit->P.x; batch->py[i] = orbit->P.y; batch->pz[i] = orbit->P.z;
+	batch->qx[i] = orbit->Q.x; batch->qy[i] = orbit->Q.y; batch->qz[i] = orbit->Q.z;
+
+	return true;
+}
+
+/* Propagate the SIMD_WIDTH orbits starting at index i. The velocities are
+ * optional. */
+static void propagate_lanes(const KeplerBatch *b, int i, double t,
+		double *x, double *y, double *z, double *vx, double *vy, double *vz)
+{
+	const vdouble zero = vd_set(0.0), one = vd_set(1.0);
+	vdouble e, M, E, dE, s, c, u, v, a, bs;
+	int iter;
+
+	e = vd_load(&b->ecc[i]);
+	M = vd_sub(vd_set(t), vd_load(&b->epoch[i]));
+	M = vd_add(vd_load(&b->mean_anomaly[i]), vd_mul(vd_load(&b->mean_motion[i]), M));
+	/* Wrap the mean anomaly to [-pi, pi] */
+	M = vd_sub(M, vd_mul(vd_set(M_TWO_PI),
+			vd_round(vd_mul(M, vd_set(1/M_TWO_PI)))));
+
+	/* Danby's starting value, E = M + 0.85 e sgn(sin M), keeps Newton's
+	 * method on the right side of the root for all elliptic orbits */
+	E = vd_add(M, vd_mul(vd_set(0.85),
+			vd_select(vd_lt(M, zero), vd_neg(e), e)));
+	for (iter = 0; iter < MAX_ITERATIONS; iter++)
+	{
+		vd_sincos(E, &s, &c);
+		dE = vd_sub(vd_sub(E, vd_mul(e, s)), M);
+		dE = vd_div(dE, vd_sub(one, vd_mul(e, c)));
+		E = vd_sub(E, dE);
+		if (!vm_any(vd_lt(vd_set(TOLERANCE), vd_abs(dE))))
+			break;
+	}
+	vd_sincos(E, &s, &c);
+
+	/* Position in the orbital plane, then onto the P, Q basis */
+	a = vd_load(&b->sma[i]);
+	bs = vd_load(&b->smi[i]);
+	u = vd_mul(a, vd_sub(c, e));
+	v = vd_mul(bs, s);
+	vd_store(&x[i], vd_add(vd_mul(u, vd_load(&b->px[i])),
+			vd_mul(v, vd_load(&b->qx[i]))));
+	vd_store(&y[i], vd_add(vd_mul(u, vd_load(&b->py[i])),
+			vd_mul(v, vd_load(&b->qy[i]))));
+	vd_store(&z[i], vd_add(vd_mul(u, vd_load(&b->pz[i])),
+			vd_mul(v, vd_load(&b->qz[i]))));
+
+	if (vx == NULL)
+		return;
+
+	/* The derivative with respect to E, times dE/dt = n / (1 - e cos E) */
+	dE = vd_div(vd_load(&b->mean_motion[i]), vd_sub(one, vd_mul(e, c)));
+	u = vd_neg(vd_mul(vd_mul(a, s), dE));
+	v = vd_mul(vd_mul(bs, c), dE);
+	vd_store(&vx[i], vd_add(vd_mul(u, vd_load(&b->px[i])),
+			vd_mul(v, vd_load(&b->qx[i]))));
+	vd_store(&vy[i], vd_add(vd_mul(u, vd_load(&b->py[i])),
+			vd_mul(v, vd_load(&b->qy[i]))));
+	vd_store(&vz[i], vd_add(vd_mul(u, vd_load(&b->pz[i])),
+			vd_mul(v, vd_load(&b->qz[i]))));
+}
+
+void kepler_batch_positions(const KeplerBatch *batch, double t,
+		double *x, double *y, double *z)
+{
+	kepler_batch_states(batch, t, x, y, z, NULL, NULL, NULL);
+}
+
+/* Positions and velocities from the same solves. The velocity arrays may
+ * be NULL. */
+void kepler_batch_states(const KeplerBatch *batch, double t,
+		double *x, double *y, double *z, double *vx, double *vy, double *vz)
+{
+	int i, j, n = batch->num_orbits;
+
+	for (i = 0; i + SIMD_WIDTH <= n; i += SIMD_WIDTH)
+		propagate_lanes(batch, i, t, x, y, z, vx, vy, vz);
+
+	if (i < n)
+	{
+		/* Copy the stragglers into a full-width batch, repeating the last
+		 * orbit to pad it out */
+		double elem[12][SIMD_WIDTH], out[6][SIMD_WIDTH];
+		KeplerBatch tail;
+
+		tail.num_orbits = SIMD_WIDTH;
+#define TAIL(k, field) \
+		tail.field = elem[k]; \
+		for (j = 0; j < SIMD_WIDTH; j++) \
+			tail.field[j] = batch->field[MIN(i + j, n - 1)]
+		TAIL(0, ecc); TAIL(1, sma); TAIL(2, smi);
+		TAIL(3, mean_anomaly); TAIL(4, mean_motion); TAIL(5, epoch);
+		TAIL(6, px); TAIL(7, py); TAIL(8, pz);
+		TAIL(9, qx); TAIL(10, qy); TAIL(11, qz);
+#undef TAIL
+
+		propagate_lanes(&tail, 0, t, out[0], out[1], out[2],
+				vx != NULL ? out[3] : NULL, out[4], out[5]);
+		for (j = 0; i + j < n; j++)
+		{
+			x[i + j] = out[0][j];
+			y[i + j] = out[1][j];
+			z[i + j] = out[2][j];
+			if (vx != NULL)
+			{
+				vx[i + j] = out[3][j];
+				vy[i + j] = out[4][j];
+				vz[i + j] = out[5][j];
+			}
+		}
+	}
+}
@@ -0,0 +1,34 @@
+#ifndef KOSMOS_KEPLERBATCH_H
+#define KOSMOS_KEPLERBATCH_H
+
+#include <stdbool.h>
+#include "keplerorbit.h"
+
+/* Orbital elements of many orbits, stored as a structure of arrays so that
+ * they can be propagated SIMD_WIDTH orbits at a time. Elliptic orbits only,
+ * kepler_batch_set_orbit() turns away the rest. */
+typedef struct KeplerBatch {
+	int num_orbits;
+
+	double *ecc; /* Eccentricity */
+	double *sma; /* Semi-major axis */
+	double *smi; /* Semi-minor axis */
+	double *mean_anomaly; /* Mean anomaly at epoch, in radians */
+	double *mean_motion; /* Radians per second */
+	double *epoch;
+
+	/* Orbital plane basis: P points to periapsis, Q is P rotated by 90
+	 * degrees in the direction of motion */
+	double *px, *py, *pz;
+	double *qx, *qy, *qz;
+} KeplerBatch;
+
+KeplerBatch *kepler_batch_create(void *ctx, int num_orbits);
+bool kepler_batch_set_orbit(KeplerBatch *batch, int i,
+		const KeplerOrbit *orbit);
+void kepler_batch_positions(const KeplerBatch *batch, double t,
+		double *x, double *y, double *z);
+void kepler_batch_states(const KeplerBatch *batch, double t,
+		double *x, double *y, double *z, double *vx, double *vy, double *vz);
+
+#endif
@@ -1,75 +1,383 @@
+#include <stdbool.h>
+#include <stddef.h>
 #include <math.h>
 
 #include "mathlib.h"
 #include "keplerorbit.h"
-#include "log.h"
 
-static double solve_kepler_equation(const double ecc, const double M)
+#define MAX_ITERATIONS 16
+/* Once a Halley step is this small, the next one would be below 1e-16 */
+#define CONVERGED 1e-6
+
+/* Halley's method on f(x) = 0, given f, f' and f''. Cubic convergence. */
+static double halley_step(double f, double fp, double fpp)
+{
+	return f / (fp - 0.5*f*fpp/fp);
+}
+
+/* x - sin(x), or sinh(x) - x if hyperbolic, for |x| <= 0.5. Both cancel
+ * near zero, so sum the series instead. */
+static double odd_remainder(double x, bool hyperbolic)
 {
-	double E, E0;
-	int i = 0;
-	double TOLERANCE = 1e-9; /* XXX Complete arbitrary */
+	double term, sum, x2 = (hyperbolic ? x*x : -x*x);
+	int n;
+
+	term = fabs(x2)*x/6;
+	sum = term;
+	for (n = 4; fabs(term) > 1e-17*fabs(sum); n += 2)
+	{
+		term *= x2 / (n*(n + 1));
+		sum += term;
+	}
+
+	return sum;
+}
+
+/* Halley's method on E - e sin(E) = M, starting from E. If esc is not NULL,
+ * e sin(E) and e cos(E) of the last iterate are stored in it. */
+static double refine_elliptic(double e, double M, double E, int *iterations,
+		double esc[2])
+{
+	double es = 0, ec = 0;
+	int i;
+
+	for (i = 0; i < MAX_ITERATIONS; )
+	{
+		double f, dE;
+
+		es = e*sin(E);
+		ec = e*cos(E);
+
+		/* Near periapsis, E - e sin(E) cancels badly for e ~ 1 */
+		if (fabs(E) > 0.5)
+			f = E - es - M;
+		else
+			f = (1 - e)*E + e*odd_remainder(E, false) - M;
+		dE = halley_step(f, 1 - ec, es);
+
+		E -= dE;
+		i++;
+		if (fabs(dE) < CONVERGED)
+			break;
+	}
+
+	if (esc != NULL)
+	{
+		esc[0] = es;
+		esc[1] = ec;
+	}
+	*iterations = i;
+	return E;
+}
+
+/* E - e sin(E) = M, for 0 <= e < 1.
+ * Markley's (1995) cubic starter is within 1e-4 of the root for every
+ * (e, M), so Halley's method needs at most two steps. */
+static double solve_elliptic(double e, double M, int *iterations,
+		double esc[2])
+{
+	double E, alpha, d, q, r, w, sign = 1.0;
+
+	/* E(-M) = -E(M), so solve for M in [0, pi] */
+	M = remainder(M, M_TWO_PI);
+	if (M < 0)
+	{
+		M = -M;
+		sign = -1.0;
+	}
+
+	alpha = (3*M_PI*M_PI + 1.6*M_PI*(M_PI - M)/(1 + e)) / (M_PI*M_PI - 6);
+	d = 3*(1 - e) + alpha*e;
+	q = 2*alpha*d*(1 - e) - M*M;
+	r = 3*alpha*d*(d - 1 + e)*M + M*M*M;
+	w = pow(fabs(r) + sqrt(q*q*q + r*r), 2.0/3.0);
+	E = (2*r*w / (w*w + w*q + q*q) + M) / d;
+
+	E = refine_elliptic(e, M, E, iterations, esc);
+	if (esc != NULL)
+		esc[0] *= sign;
+
+	return sign*E;
+}
+
+/* e sinh(H) - H = M, for e > 1 */
+static double solve_hyperbolic(double e, double M, int *iterations)
+{
+	double H, sign = 1.0;
+	int i;
+
+	if (M < 0)
+	{
+		M = -M;
+		sign = -1.0;
+	}
+
+	/* For large M, e sinh(H) ~ M. For small M the series
+	 * (e - 1) H + e H^3/6 = M is dominated by whichever term is larger, and
+	 * the smallest of the three guesses is the closest. */
+	H = log(2*M/e + 1.8);
+	H = MIN(H, cbrt(6*M/e));
+	H = MIN(H, M/(e - 1));
+
+	for (i = 0; i < MAX_ITERATIONS; )
+	{
+		double es = e*sinh(H), ec = e*cosh(H), f, dH;
+
+		if (fabs(H) > 0.5)
+			f = es - H - M;
+		else
+			f = (e - 1)*H + e*odd_remainder(H, true) - M;
+		dH = halley_step(f, ec - 1, es);
+
+		H -= dH;
+		i++;
+		if (fabs(dH) < CONVERGED*MAX(1.0, fabs(H)))
+			break;
+	}
+
+	*iterations = i;
+	return sign*H;
+}
+
+/* For a parabola the universal variable equation loses its transcendental
+ * terms and becomes Barker's cubic, D + D^3/3 = M with D = tan(theta/2),
+ * which has a closed-form solution. */
+static double solve_parabolic(double M)
+{
+	return 2*sinh(asinh(1.5*M)/3);
+}
+
+/* Solve Kepler's equation for the eccentric anomaly E (elliptic orbits), the
+ * hyperbolic anomaly H (e > 1) or Barker's D = tan(theta/2) (e == 1). The
+ * number of refinement steps is stored in iterations, if it is not NULL. */
+double kepler_solve(double ecc, double M, int *iterations)
+{
+	int dummy;
+	double anomaly;
+
+	if (iterations == NULL)
+		iterations = &dummy;
 
-	E0 = 0;
-	E = M;
 	if (ecc == 0)
-		E = M;
-	else if (ecc < 0.2)
 	{
-		for (i = 0; fabs(E - E0) > TOLERANCE; i++)
-		{
-			E0 = E;
-			E = M + ecc*sin(E);
-		}
-	} else if (ecc < 0.9999) /* TODO */
+		*iterations = 0;
+		anomaly = M;
+	} else if (ecc < 1)
+		anomaly = solve_elliptic(ecc, M, iterations, NULL);
+	else if (ecc > 1)
+		anomaly = solve_hyperbolic(ecc, M, iterations);
+	else
 	{
-		for (i = 0; fabs(E - E0) > TOLERANCE; i++)
-		{
-			E0 = E;
-			E = E + (M + ecc * sin(E) - E) / (1 - ecc * cos(E));
-		}
+		*iterations = 0;
+		anomaly = solve_parabolic(M);
+	}
+
+	return anomaly;
+}
+
+/* Fill in the period, orientation and everything else that follows from the
+ * orbital elements and the gravitational parameter of the primary. */
+void kepler_orbit_init(KeplerOrbit *orbit, double grav_param)
+{
+	Mat3 m;
+	double e = orbit->Ecc, a = fabs(orbit->SMa);
+
+	orbit->plane_orientation = quat_euler(RAD(orbit->LAN), RAD(orbit->Inc),
+			RAD(orbit->APe));
+	orbit->mean_anomaly = RAD(orbit->MnA);
+
+	if (e < 1)
+	{
+		orbit->period = M_TWO_PI * sqrt(CUBE(a) / grav_param);
+		orbit->mean_motion = M_TWO_PI / orbit->period;
+		orbit->SMi = a * sqrt(1 - e*e);
+	} else if (e > 1)
+	{
+		orbit->period = INFINITY;
+		orbit->mean_motion = sqrt(grav_param / CUBE(a));
+		orbit->SMi = a * sqrt(e*e - 1);
 	} else
 	{
-		log_err("Eccentricity too high %g\n", ecc);
-		return 0;
+		/* SMa is the periapsis distance q. Barker's equation uses
+		 * M = sqrt(mu / 2q^3) t and y = 2q tan(theta/2) */
+		orbit->period = INFINITY;
+		orbit->mean_motion = sqrt(grav_param / (2 * CUBE(a)));
+		orbit->SMi = 2 * a;
 	}
 
-	return E;
+	/* The images of the x and y axes of the orbital plane */
+	mat3_from_quat(m, orbit->plane_orientation);
+	orbit->P = (Vec3) {m[0], m[1], m[2]};
+	orbit->Q = (Vec3) {m[3], m[4], m[5]};
+
+	orbit->have_last = false;
 }
 
-Vec3 kepler_position_at_true_anomaly(KeplerOrbit *orbit, double theta)
+/* Map a point (x, y) in the orbital plane to space */
+static Vec3 plane_to_space(const KeplerOrbit *orbit, double x, double y)
 {
-	double e = orbit->Ecc;
-	double p = orbit->SMa * (1-e*e);
-	Vec3 plane_pos;
+	Vec3 v;
 
-	plane_pos.x = p / (1 + e*cos(theta)) * cos(theta);
-	plane_pos.y = p / (1 + e*cos(theta)) * sin(theta);
-	plane_pos.z = 0;
+	v.x = x*orbit->P.x + y*orbit->Q.x;
+	v.y = x*orbit->P.y + y*orbit->Q.y;
+	v.z = x*orbit->P.z + y*orbit->Q.z;
 
-	return quat_transform(orbit->plane_orientation, plane_pos);
+	return v;
 }
 
+Vec3 kepler_position_at_true_anomaly(KeplerOrbit *orbit, double theta)
+{
+	double e = orbit->Ecc, a = fabs(orbit->SMa);
+	double p = (e == 1 ? 2*a : a * fabs(1 - e*e)); /* Semi-latus rectum */
+	double r = p / (1 + e*cos(theta));
+
+	return plane_to_space(orbit, r * cos(theta), r * sin(theta));
+}
+
+/* E is the eccentric, hyperbolic or parabolic anomaly, depending on the
+ * eccentricity, as returned by kepler_solve() */
 Vec3 kepler_position_at_E(KeplerOrbit *orbit, double E)
 {
-	double e = orbit->Ecc;
-	double a = orbit->SMa, b = a * sqrt(1 - e*e);
-	Vec3 plane_pos;
+	double e = orbit->Ecc, a = fabs(orbit->SMa);
 
-	plane_pos.x = a * (cos(E) - e);
-	plane_pos.y = b * sin(E);
-	plane_pos.z = 0;
+	if (e < 1)
+		return plane_to_space(orbit, a * (cos(E) - e), orbit->SMi * sin(E));
+	else if (e > 1)
+		return plane_to_space(orbit, a * (e - cosh(E)), orbit->SMi * sinh(E));
+	else
+		return plane_to_space(orbit, a * (1 - E*E), orbit->SMi * E);
+}
 
-	return quat_transform(orbit->plane_orientation, plane_pos);
+/* Velocity at the anomaly E, the derivative of kepler_position_at_E() with
+ * respect to E times dE/dt from Kepler's equation */
+Vec3 kepler_velocity_at_E(KeplerOrbit *orbit, double E)
+{
+	Vec3 position, velocity;
+
+	kepler_state_at_E(orbit, E, &position, &velocity);
+
+	return velocity;
+}
+
+/* kepler_position_at_E() and kepler_velocity_at_E() together, sharing the
+ * sine and cosine of E */
+void kepler_state_at_E(KeplerOrbit *orbit, double E, Vec3 *position,
+		Vec3 *velocity)
+{
+	double e = orbit->Ecc, a = fabs(orbit->SMa), n = orbit->mean_motion;
+	double s, c, dE;
+
+	if (e < 1)
+	{
+		s = sin(E);
+		c = cos(E);
+		dE = n / (1 - e*c);
+		*position = plane_to_space(orbit, a * (c - e), orbit->SMi * s);
+		*velocity = plane_to_space(orbit, -a * s * dE, orbit->SMi * c * dE);
+	} else if (e > 1)
+	{
+		s = sinh(E);
+		c = cosh(E);
+		dE = n / (e*c - 1);
+		*position = plane_to_space(orbit, a * (e - c), orbit->SMi * s);
+		*velocity = plane_to_space(orbit, -a * s * dE, orbit->SMi * c * dE);
+	} else
+	{
+		dE = n / (1 + E*E);
+		*position = plane_to_space(orbit, a * (1 - E*E), orbit->SMi * E);
+		*velocity = plane_to_space(orbit, -2*a * E * dE, orbit->SMi * dE);
+	}
 }
 
 Vec3 kepler_position_at_time(KeplerOrbit *orbit, double jd)
 {
 	double t = jd - orbit->epoch;
-	double M, E, mean_motion; /* mean and eccentric anomaly */
-	mean_motion = M_TWO_PI*t/orbit->period;
-	M = RAD(orbit->MnA) + mean_motion;
-	E = solve_kepler_equation(orbit->Ecc, M);
+	double M, E; /* mean and eccentric anomaly */
+
+	M = orbit->mean_anomaly + orbit->mean_motion * t;
+	E = kepler_solve(orbit->Ecc, M, NULL);
 
 	return kepler_position_at_E(orbit, E);
 }
+
+/* Solve for the anomaly at jd, starting from the solution of the previous
+ * call advanced by the change in mean anomaly. When time moves smoothly one
+ * Halley step is enough. The change is taken modulo a full revolution, so a
+ * step of nearly a whole period is still smooth. */
+static double solve_warm(KeplerOrbit *orbit, double jd, int *iterations)
+{
+	const double MAX_PREDICTION = 0.1; /* Radians of E */
+	double e = orbit->Ecc, M, dM, dE, g;
+	double E = 0;
+	bool cold = true;
+	int dummy;
+
+	if (iterations == NULL)
+		iterations = &dummy;
+
+	M = orbit->mean_anomaly + orbit->mean_motion * (jd - orbit->epoch);
+	if (e <= 0 || e >= 1)
+		return kepler_solve(e, M, iterations); /* Nothing to gain */
+	M = remainder(M, M_TWO_PI);
+
+	if (orbit->have_last)
+	{
+		/* Second order Taylor expansion of E(M) around the last solution,
+		 * using dE/dM = 1/(1 - e cos E) */
+		dM = remainder(orbit->mean_motion * (jd - orbit->last_t), M_TWO_PI);
+		g = 1 / (1 - orbit->last_ecosE);
+		dE = g*dM - 0.5*orbit->last_esinE*g*g*g*dM*dM;
+
+		if (fabs(dE) < MAX_PREDICTION)
+		{
+			double esc[2];
+
+			/* E - M = e sin(E) is small, so this puts E on M's branch */
+			E = orbit->last_E + dE;
+			E -= M_TWO_PI * nearbyint((E - M) / M_TWO_PI);
+			E = refine_elliptic(e, M, E, iterations, esc);
+			orbit->last_esinE = esc[0];
+			orbit->last_ecosE = esc[1];
+			cold = (*iterations == MAX_ITERATIONS); /* Didn't converge */
+		}
+	}
+
+	if (cold) /* First call, or time jumped */
+	{
+		double esc[2];
+
+		E = solve_elliptic(e, M, iterations, esc);
+		orbit->last_esinE = esc[0];
+		orbit->last_ecosE = esc[1];
+	}
+
+	orbit->last_t = jd;
+	orbit->last_E = E;
+	orbit->have_last = true;
+
+	return E;
+}
+
+/* Like kepler_position_at_time(), but warm started, see solve_warm() */
+Vec3 kepler_position_at_time_warm(KeplerOrbit *orbit, double jd,
+		int *iterations)
+{
+	return kepler_position_at_E(orbit, solve_warm(orbit, jd, iterations));
+}
+
+/* Position and velocity from a single solve */
+void kepler_state_at_time(KeplerOrbit *orbit, double jd, Vec3 *position,
+		Vec3 *velocity)
+{
+	double M = orbit->mean_anomaly + orbit->mean_motion * (jd - orbit->epoch);
+
+	kepler_state_at_E(orbit, kepler_solve(orbit->Ecc, M, NULL), position,
+			velocity);
+}
+
+void kepler_state_at_time_warm(KeplerOrbit *orbit, double jd,
+		Vec3 *position, Vec3 *velocity, int *iterations)
+{
+	kepler_state_at_E(orbit, solve_warm(orbit, jd, iterations), position,
+			velocity);
+}
@@ -1,11 +1,12 @@
 #ifndef KOSMOS_KEPLERORBIT_H
 #define KOSMOS_KEPLERORBIT_H
 
+#include <stdbool.h>
 #include "mathlib.h"
 
 typedef struct KeplerOrbit {
 	double Ecc; /* Eccentricity */
-	double SMa; /* Semi-major axis */
+	double SMa; /* Semi-major axis, periapsis distance if Ecc == 1 */
 	double Inc; /* Inclination */
 	double LAN; /* Longitude of ascending node */
 	double APe; /* Argument of periapsis */
@@ -14,9 +15,32 @@ typedef struct KeplerOrbit {
 	double epoch;
 	double period;
 	Quaternion plane_orientation;
+
+	/* Invariants cached by kepler_orbit_init() */
+	double mean_anomaly; /* Mean anomaly at epoch, in radians */
+	double mean_motion; /* Radians per second */
+	double SMi; /* Semi-minor axis */
+	Vec3 P, Q; /* Orbital plane basis, P points towards the periapsis */
+
+	/* Last solution, for kepler_position_at_time_warm() */
+	bool have_last;
+	double last_t;
+	double last_E;
+	double last_esinE, last_ecosE;
 } KeplerOrbit;
 
+void kepler_orbit_init(KeplerOrbit *orbit, double grav_param);
+double kepler_solve(double ecc, double M, int *iterations);
 Vec3 kepler_position_at_true_anomaly(KeplerOrbit *orbit, double theta);
 Vec3 kepler_position_at_E(KeplerOrbit *orbit, double E);
+Vec3 kepler_velocity_at_E(KeplerOrbit *orbit, double E);
+void kepler_state_at_E(KeplerOrbit *orbit, double E, Vec3 *position,
+		Vec3 *velocity);
 Vec3 kepler_position_at_time(KeplerOrbit *orbit, double jd);
+Vec3 kepler_position_at_time_warm(KeplerOrbit *orbit, double jd,
+		int *iterations);
+void kepler_state_at_time(KeplerOrbit *orbit, double jd, Vec3 *position,
+		Vec3 *velocity);
+void kepler_state_at_time_warm(KeplerOrbit *orbit, double jd,
+		Vec3 *position, Vec3 *velocity, int *iterations);
 #endif
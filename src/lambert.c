@@ -0,0 +1,270 @@
+#include <math.h>
+#include <stdbool.h>
+#include <ralloc.h>
+
+#include "lambert.h"
+#include "log.h"
+
+#define MAX_ITERATIONS 15
+#define CONVERGED 1e-11
+#define BATTIN_RANGE 0.01 /* Around x = 1, where the series is needed */
+#define LAGRANGE_RANGE 0.2
+
+/* The hypergeometric function 2F1(3, 1; 5/2; z) of Battin's series */
+static double hypergeometric(double z)
+{
+	double term = 1, sum = 1;
+	int j;
+
+	for (j = 0; j < 100; j++)
+	{
+		term *= (3.0 + j) * (1.0 + j) / (2.5 + j) * z / (j + 1);
+		sum += term;
+		if (fabs(term) < 1e-15)
+			break;
+	}
+
+	return sum;
+}
+
+/* Lagrange's expression for the time of flight, fine away from x = 1 */
+static double lagrange_time(double x, double lambda)
+{
+	double a = 1 / (1 - x*x), alpha, beta;
+
+	if (a > 0)
+	{
+		alpha = 2 * acos(x);
+		beta = 2 * asin(sqrt(lambda*lambda / a));
+		if (lambda < 0)
+			beta = -beta;
+		return a * sqrt(a) * ((alpha - sin(alpha)) - (beta - sin(beta))) / 2;
+	} else
+	{
+		alpha = 2 * acosh(x);
+		beta = 2 * asinh(sqrt(-lambda*lambda / a));
+		if (lambda < 0)
+			beta = -beta;
+		return -a * sqrt(-a) * ((beta - sinh(beta)) -
+				(alpha - sinh(alpha))) / 2;
+	}
+}
+
+/* The non-dimensional time of flight as a function of Izzo's x. Battin's
+ * series near the parabola at x = 1, Lagrange's expression a bit further
+ * out and Lancaster's everywhere else. */
+static double time_of_flight(double x, double lambda)
+{
+	double dist = fabs(x - 1), E = x*x - 1, z, eta, y, g, d;
+
+	if (dist < LAGRANGE_RANGE && dist > BATTIN_RANGE)
+		return lagrange_time(x, lambda);
+
+	z = sqrt(1 + lambda*lambda * E);
+	if (dist < BATTIN_RANGE)
+	{
+		eta = z - lambda * x;
+		return (CUBE(eta) * 4.0/3 * hypergeometric(0.5 * (1 - lambda -
+				x * eta)) + 4 * lambda * eta) / 2;
+	}
+
+	y = sqrt(fabs(E));
+	g = x * z - lambda * E;
+	if (E < 0)
+		d = acos(g);
+	else
+		d = log(y * (z - lambda * x) + g);
+
+	return (x - lambda * z - d / y) / E;
+}
+
+/* Householder's method on T(x) = T, which converges in a few steps from
+ * Izzo's starting guess */
+static double find_x(double lambda, double T)
+{
+	double T0 = acos(lambda) + lambda * sqrt(1 - lambda*lambda);
+	double T1 = 2.0/3 * (1 - CUBE(lambda));
+	double x, l2 = lambda*lambda, l3 = l2*lambda, l5 = l3*l2;
+	int i;
+
+	if (T >= T0)
+		x = pow(T0 / T, 2.0/3) - 1;
+	else if (T < T1)
+		x = 2.5 * T1 / T * (T1 - T) / (1 - l5) + 1;
+	else
+		x = pow(T / T0, 1 / log2(T1 / T0)) - 1;
+
+	for (i = 0; i < MAX_ITERATIONS; i++)
+	{
+		double t = time_of_flight(x, lambda), f = t - T;
+		double y = sqrt(1 - l2 * (1 - x*x)), u = 1 - x*x;
+		double dT, ddT, dddT, step;
+
+		dT = (3 * t * x - 2 + 2 * l3 * x / y) / u;
+		ddT = (3 * t + 5 * x * dT + 2 * (1 - l2) * l3 / CUBE(y)) / u;
+		dddT = (7 * x * ddT + 8 * dT - 6 * (1 - l2) * l5 * x /
+				(CUBE(y) * y*y)) / u;
+		step = f * (dT*dT - f * ddT / 2) /
+				(dT * (dT*dT - f * ddT) + dddT * f*f / 6);
+		x -= step;
+		if (fabs(step) < CONVERGED)
+			break;
+	}
+
+	return x;
+}
+
+/* The velocities at both ends of the transfer. Returns false for a
+ * degenerate problem: no time, a zero radius or both ends lined up with
+ * the origin, which leaves the plane undetermined. */
+bool lambert_solve(Vec3 r1, Vec3 r2, double time, double mu, Vec3 *v1,
+		Vec3 *v2)
+{
+	double r1n = vec3_length(r1), r2n = vec3_length(r2);
+	double c = vec3_length(vec3_sub(r2, r1)), s = (r1n + r2n + c) / 2;
+	double lambda, T, x, y, gamma, rho, sigma, vr1, vr2, vt;
+	Vec3 ir1, ir2, ih, it1, it2;
+
+	if (!(time > 0) || r1n == 0 || r2n == 0 || c == 0)
+		return false;
+
+	ir1 = vec3_scale(r1, 1 / r1n);
+	ir2 = vec3_scale(r2, 1 / r2n);
+	ih = vec3_cross(ir1, ir2);
+	if (vec3_length(ih) < 1e-12)
+		return false;
+	ih = vec3_normalize(ih);
+
+	/* Going the short way from r1 to r2 turns clockwise seen from above,
+	 * so the prograde transfer takes the long way, over half a turn */
+	lambda = sqrt(MAX(0, 1 - c / s));
+	if (ih.z < 0)
+	{
+		lambda = -lambda;
+		it1 = vec3_cross(ir1, ih);
+		it2 = vec3_cross(ir2, ih);
+	} else
+	{
+		it1 = vec3_cross(ih, ir1);
+		it2 = vec3_cross(ih, ir2);
+	}
+
+	T = sqrt(2 * mu / CUBE(s)) * time;
+	x = find_x(lambda, T);
+	if (!isfinite(x))
+		return false;
+
+	gamma = sqrt(mu * s / 2);
+	rho = (r1n - r2n) / c;
+	sigma = sqrt(MAX(0, 1 - rho*rho));
+	y = sqrt(1 - lambda*lambda + lambda*lambda * x*x);
+	vr1 = gamma * ((lambda * y - x) - rho * (lambda * y + x)) / r1n;
+	vr2 = -gamma * ((lambda * y - x) + rho * (lambda * y + x)) / r2n;
+	vt = gamma * sigma * (y + lambda * x);
+
+	*v1 = vec3_add(vec3_scale(ir1, vr1), vec3_scale(it1, vt / r1n));
+	*v2 = vec3_add(vec3_scale(ir2, vr2), vec3_scale(it2, vt / r2n));
+
+	return true;
+}
+
+typedef struct PorkchopJob {
+	Porkchop *plot;
+	double mu;
+	const Vec3 *from_position, *from_velocity; /* By row */
+	const Vec3 *to_position, *to_velocity; /* By column */
+} PorkchopJob;
+
+static void porkchop_rows(void *data, int begin, int end)
+{
+	PorkchopJob *job = data;
+	Porkchop *plot = job->plot;
+	int i, j;
+
+	for (i = begin; i < end; i++)
+		for (j = 0; j < plot->num_arrivals; j++)
+		{
+			double time = plot->arrival[j] - plot->departure[i];
+			double *dv = &plot->delta_v[(size_t) i * plot->num_arrivals + j];
+			Vec3 v1, v2;
+
+			*dv = NAN;
+			if (lambert_solve(job->from_position[i], job->to_position[j],
+					time, job->mu, &v1, &v2))
+				*dv = vec3_length(vec3_sub(v1, job->from_velocity[i])) +
+						vec3_length(vec3_sub(v2, job->to_velocity[j]));
+		}
+}
+
+static double grid_time(double first, double last, int i, int n)
+{
+	return (n > 1 ? first + (last - first) * i / (n - 1) : first);
+}
+
+/* Transfers between two bodies around the same primary. The states of the
+ * bodies are only worked out once per row and column, the rows go to
+ * solsys->pool if there is one. */
+Porkchop *porkchop_create(void *ctx, SolarSystem *solsys, Body *from,
+		Body *to, double first_departure, double last_departure,
+		int num_departures, double first_arrival, double last_arrival,
+		int num_arrivals)
+{
+	Porkchop *plot;
+	PorkchopJob job;
+	Vec3 *state;
+	int i;
+
+	if (from->primary == NULL || from->primary != to->primary ||
+			num_departures < 1 || num_arrivals < 1)
+	{
+		log_err("A porkchop plot needs two bodies around one primary\n");
+		return NULL;
+	}
+
+	plot = rzalloc(ctx, Porkchop);
+	if (plot == NULL)
+		goto errorout;
+	plot->num_departures = num_departures;
+	plot->num_arrivals = num_arrivals;
+	plot->departure = ralloc_array(plot, double, num_departures);
+	plot->arrival = ralloc_array(plot, double, num_arrivals);
+	plot->delta_v = ralloc_array(plot, double,
+			(size_t) num_departures * num_arrivals);
+	state = ralloc_array(plot, Vec3, 2 * (num_departures + num_arrivals));
+	if (plot->departure == NULL || plot->arrival == NULL ||
+			plot->delta_v == NULL || state == NULL)
+		goto errorout;
+
+	job.plot = plot;
+	job.mu = from->primary->grav_param;
+	job.from_position = state;
+	job.from_velocity = state + num_departures;
+	job.to_position = state + 2 * num_departures;
+	job.to_velocity = state + 2 * num_departures + num_arrivals;
+
+	for (i = 0; i < num_departures; i++)
+	{
+		plot->departure[i] = grid_time(first_departure, last_departure, i,
+				num_departures);
+		kepler_state_at_time(&from->orbit, plot->departure[i],
+				&state[i], &state[num_departures + i]);
+	}
+	for (i = 0; i < num_arrivals; i++)
+	{
+		plot->arrival[i] = grid_time(first_arrival, last_arrival, i,
+				num_arrivals);
+		kepler_state_at_time(&to->orbit, plot->arrival[i],
+				&state[2 * num_departures + i],
+				&state[2 * num_departures + num_arrivals + i]);
+	}
+
+	workpool_run(solsys->pool, porkchop_rows, &job, num_departures, 1);
+	ralloc_free(state);
+
+	return plot;
+
+errorout:
+	log_err("Out of memory\n");
+	ralloc_free(plot);
+	return NULL;
+}
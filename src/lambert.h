@@ -0,0 +1,32 @@
+#ifndef KOSMOS_LAMBERT_H
+#define KOSMOS_LAMBERT_H
+
+#include <stdbool.h>
+#include "mathlib.h"
+#include "solarsystem.h"
+
+/* Lambert's problem: the orbit around a body with gravitational parameter
+ * mu that goes from r1 to r2 in a given time. Izzo's (2015) method, for
+ * transfers of less than one revolution in the prograde sense, that is
+ * with the angular momentum pointing up the z-axis. */
+bool lambert_solve(Vec3 r1, Vec3 r2, double time, double mu, Vec3 *v1,
+		Vec3 *v2);
+
+/* A porkchop plot: the delta-v of going from one body to another, for
+ * every pair of departure and arrival times on a grid */
+typedef struct Porkchop {
+	int num_departures, num_arrivals;
+	double *departure, *arrival; /* The times of the rows and columns */
+
+	/* Speed relative to the first body on departure plus that relative
+	 * to the second on arrival, at departure i and arrival j in
+	 * delta_v[i*num_arrivals + j]. NaN where there is no transfer. */
+	double *delta_v;
+} Porkchop;
+
+Porkchop *porkchop_create(void *ctx, SolarSystem *solsys, Body *from,
+		Body *to, double first_departure, double last_departure,
+		int num_departures, double first_arrival, double last_arrival,
+		int num_arrivals);
+
+#endif
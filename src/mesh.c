@@ -402,3 +402,19 @@ void mesh_unitize(Mesh *mesh)
 
 	return;
 }
+
+/* Radius of the smallest sphere around the origin holding every vertex */
+GLfloat mesh_bound(const Mesh *mesh)
+{
+	int i;
+	GLfloat r2 = 0;
+
+	for (i = 0; i < mesh->num_vertices; i++)
+	{
+		Vertex3N v = mesh->vertex[i];
+
+		r2 = MAX(r2, v.x*v.x + v.y*v.y + v.z*v.z);
+	}
+
+	return sqrtf(r2);
+}
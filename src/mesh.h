@@ -23,5 +23,6 @@ typedef struct Mesh {
 
 Mesh *mesh_import(const char *filename);
 void mesh_unitize(Mesh *mesh);
+GLfloat mesh_bound(const Mesh *mesh);
 
 #endif
@@ -0,0 +1,219 @@
+#include <math.h>
+#include <stdbool.h>
+#include <ralloc.h>
+
+#include "log.h"
+#include "mathlib.h"
+#include "nbody.h"
+#include "simd.h"
+
+/* An N-body system of num_bodies bodies at rest at the origin, all without
+ * mass. Fill in the state, then step away. */
+NBody *nbody_create(void *ctx, int num_bodies, NBodyMethod method)
+{
+	NBody *nbody;
+	int padded = (num_bodies + SIMD_WIDTH - 1) / SIMD_WIDTH * SIMD_WIDTH;
+
+	nbody = rzalloc(ctx, NBody);
+	if (nbody == NULL)
+		return NULL;
+
+	nbody->method = method;
+	nbody->num_bodies = num_bodies;
+	nbody->padded = padded;
+	nbody->max_step = INFINITY;
+
+	nbody->x = rzalloc_array(nbody, double, padded);
+	nbody->y = rzalloc_array(nbody, double, padded);
+	nbody->z = rzalloc_array(nbody, double, padded);
+	nbody->vx = rzalloc_array(nbody, double, padded);
+	nbody->vy = rzalloc_array(nbody, double, padded);
+	nbody->vz = rzalloc_array(nbody, double, padded);
+	nbody->ax = rzalloc_array(nbody, double, padded);
+	nbody->ay = rzalloc_array(nbody, double, padded);
+	nbody->az = rzalloc_array(nbody, double, padded);
+	nbody->mu = rzalloc_array(nbody, double, padded);
+	if (nbody->x == NULL || nbody->y == NULL || nbody->z == NULL ||
+			nbody->vx == NULL || nbody->vy == NULL || nbody->vz == NULL ||
+			nbody->ax == NULL || nbody->ay == NULL || nbody->az == NULL ||
+			nbody->mu == NULL)
+	{
+		ralloc_free(nbody);
+		return NULL;
+	}
+
+	return nbody;
+}
+
+/* The pull of every body on bodies [begin, end). Lanes run over the bodies
+ * doing the pulling; a body doesn't pull on itself because the distance is
+ * zero, which is masked out. */
+static void accelerate(void *data, int begin, int end)
+{
+	NBody *nbody = data;
+	const vdouble zero = vd_set(0.0), eps = vd_set(nbody->softening);
+	int i, j;
+
+	for (i = begin; i < end; i++)
+	{
+		vdouble xi = vd_set(nbody->x[i]);
+		vdouble yi = vd_set(nbody->y[i]);
+		vdouble zi = vd_set(nbody->z[i]);
+		vdouble ax = zero, ay = zero, az = zero;
+
+		for (j = 0; j < nbody->padded; j += SIMD_WIDTH)
+		{
+			vdouble dx = vd_sub(vd_load(&nbody->x[j]), xi);
+			vdouble dy = vd_sub(vd_load(&nbody->y[j]), yi);
+			vdouble dz = vd_sub(vd_load(&nbody->z[j]), zi);
+			vdouble r2, s;
+
+			r2 = vd_add(vd_mul(dx, dx), vd_mul(dy, dy));
+			r2 = vd_add(vd_add(r2, vd_mul(dz, dz)), eps);
+
+			/* mu / r^3 */
+			s = vd_div(vd_load(&nbody->mu[j]), vd_mul(r2, vd_sqrt(r2)));
+			s = vd_select(vd_eq(r2, zero), zero, s);
+
+			ax = vd_add(ax, vd_mul(s, dx));
+			ay = vd_add(ay, vd_mul(s, dy));
+			az = vd_add(az, vd_mul(s, dz));
+		}
+
+		nbody->ax[i] = vd_hsum(ax);
+		nbody->ay[i] = vd_hsum(ay);
+		nbody->az[i] = vd_hsum(az);
+	}
+}
+
+/* The tree costs O(n log n) to build and to walk, against O(n^2) for
+ * direct summation, at an error set by the opening angle */
+static bool tree_accelerations(NBody *nbody)
+{
+	if (nbody->tree == NULL && (nbody->tree = octree_create(nbody)) == NULL)
+		return false;
+	if (!octree_build(nbody->tree, nbody->x, nbody->y, nbody->z, nbody->mu,
+			nbody->num_bodies, nbody->opening_angle, nbody->pool))
+		return false;
+	octree_accelerations(nbody->tree, nbody->ax, nbody->ay, nbody->az,
+			nbody->softening, nbody->pool);
+
+	return true;
+}
+
+void nbody_accelerations(NBody *nbody)
+{
+	const int CHUNK = 16; /* Bodies per work item */
+
+	nbody->have_accelerations = true;
+	if (nbody->opening_angle > 0)
+	{
+		if (tree_accelerations(nbody))
+			return;
+		log_err("Out of memory for the tree, summing directly\n");
+	}
+
+	workpool_run(nbody->pool, accelerate, nbody, nbody->num_bodies, CHUNK);
+}
+
+static void kick(NBody *nbody, double dt)
+{
+	int i;
+
+	for (i = 0; i < nbody->num_bodies; i++)
+	{
+		nbody->vx[i] += nbody->ax[i] * dt;
+		nbody->vy[i] += nbody->ay[i] * dt;
+		nbody->vz[i] += nbody->az[i] * dt;
+	}
+}
+
+static void drift(NBody *nbody, double dt)
+{
+	int i;
+
+	for (i = 0; i < nbody->num_bodies; i++)
+	{
+		nbody->x[i] += nbody->vx[i] * dt;
+		nbody->y[i] += nbody->vy[i] * dt;
+		nbody->z[i] += nbody->vz[i] * dt;
+	}
+}
+
+/* Kick-drift-kick. The accelerations at the end are those at the start of
+ * the next step, so it costs one force evaluation. */
+static void leapfrog(NBody *nbody, double dt)
+{
+	kick(nbody, dt/2);
+	drift(nbody, dt);
+	nbody_accelerations(nbody);
+	kick(nbody, dt/2);
+}
+
+void nbody_step(NBody *nbody, double dt)
+{
+	/* Yoshida (1990): steps of w1, w0, w1 cancel the third order error */
+	const double cbrt2 = 1.25992104989487316477;
+	const double w1 = 1 / (2 - cbrt2), w0 = -cbrt2 * w1;
+
+	if (!nbody->have_accelerations)
+		nbody_accelerations(nbody);
+
+	switch (nbody->method)
+	{
+	case NBODY_LEAPFROG:
+		leapfrog(nbody, dt);
+		break;
+	case NBODY_YOSHIDA:
+		leapfrog(nbody, w1 * dt);
+		leapfrog(nbody, w0 * dt);
+		leapfrog(nbody, w1 * dt);
+		break;
+	case NBODY_OFF:
+		return;
+	}
+
+	nbody->t += dt;
+}
+
+/* Integrate up to time t in equal steps of at most max_step */
+void nbody_advance(NBody *nbody, double t)
+{
+	double span = t - nbody->t;
+	long i, steps;
+
+	if (span == 0)
+		return;
+
+	steps = (long) ceil(fabs(span) / nbody->max_step);
+	steps = MAX(steps, 1);
+	for (i = 0; i < steps; i++)
+		nbody_step(nbody, span / steps);
+
+	nbody->t = t; /* Rather than the sum of the steps */
+}
+
+/* Total energy in joules, for keeping an eye on the integrator */
+double nbody_energy(const NBody *nbody)
+{
+	double kinetic = 0, potential = 0;
+	int i, j;
+
+	for (i = 0; i < nbody->num_bodies; i++)
+	{
+		double v2 = SQUARE(nbody->vx[i]) + SQUARE(nbody->vy[i]) +
+				SQUARE(nbody->vz[i]);
+
+		kinetic += 0.5 * nbody->mu[i] * v2;
+		for (j = i + 1; j < nbody->num_bodies; j++)
+		{
+			double r2 = SQUARE(nbody->x[j] - nbody->x[i]) +
+					SQUARE(nbody->y[j] - nbody->y[i]) +
+					SQUARE(nbody->z[j] - nbody->z[i]) + nbody->softening;
+
+			potential -= nbody->mu[i] * nbody->mu[j] / sqrt(r2);
+		}
+	}
+
+	return (kinetic + potential) / GRAV_CONST;
+}
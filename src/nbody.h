@@ -0,0 +1,45 @@
+#ifndef KOSMOS_NBODY_H
+#define KOSMOS_NBODY_H
+
+#include <stdbool.h>
+#include "octree.h"
+#include "workpool.h"
+
+/* The mutual gravitation of all bodies, for when fixed two-body orbits
+ * aren't good enough. Forces come from direct summation, or from a
+ * Barnes-Hut tree for large numbers of bodies. The state is kept as a
+ * structure of arrays, padded with massless bodies to a multiple of the
+ * SIMD width. */
+
+typedef enum NBodyMethod {
+	NBODY_OFF, /* Bodies follow their Kepler orbits */
+	NBODY_LEAPFROG, /* Kick-drift-kick, second order */
+	NBODY_YOSHIDA /* Three leapfrog steps composed to fourth order */
+} NBodyMethod;
+
+typedef struct NBody {
+	NBodyMethod method;
+	int num_bodies;
+	int padded; /* Length of the arrays */
+	double t; /* Time of the current state */
+	double max_step; /* Largest step nbody_advance() takes */
+	double softening; /* Added to every distance squared, in m^2 */
+	double opening_angle; /* Barnes-Hut, or 0 for direct summation */
+	bool have_accelerations; /* ax, ay and az match the positions */
+
+	double *x, *y, *z;
+	double *vx, *vy, *vz;
+	double *ax, *ay, *az;
+	double *mu; /* Gravitational parameters, 0 for padding */
+
+	Octree *tree; /* Created on first use */
+	WorkPool *pool; /* Optional, not owned */
+} NBody;
+
+NBody *nbody_create(void *ctx, int num_bodies, NBodyMethod method);
+void nbody_accelerations(NBody *nbody);
+void nbody_step(NBody *nbody, double dt);
+void nbody_advance(NBody *nbody, double t);
+double nbody_energy(const NBody *nbody);
+
+#endif
@@ -0,0 +1,614 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <ralloc.h>
+
+#include "mathlib.h"
+#include "octree.h"
+
+#define LEAF_SIZE 8 /* Bodies a node may hold before it's split */
+#define MAX_LEVEL 21 /* Morton codes have 21 bits per axis */
+#define SPLIT_LEVEL 3 /* Subtrees from this level down are built in parallel */
+#define RADIX_BITS 11
+
+typedef struct OctreeNode {
+	double x, y, z; /* Centre of mass */
+	double mu; /* Total gravitational parameter */
+	double q[6]; /* Traceless quadrupole about the centre of mass: xx, yy,
+	              * zz, xy, xz, yz */
+	double cx, cy, cz, half; /* Centre and half the side of the cell */
+	double open2; /* Open the node for bodies closer than this, squared */
+	int begin, end; /* Bodies in Morton order */
+	int next; /* First node after this subtree */
+	bool leaf;
+} OctreeNode;
+
+/* A job for one of the threads building the tree, or evaluating it */
+typedef struct Subtree {
+	int level, begin, end;
+	double corner[3];
+	int first, num_nodes;
+} Subtree;
+
+typedef enum Walk {
+	WALK_PLAN, /* Hand out subtrees */
+	WALK_LAYOUT, /* Give each subtree its place in the array */
+	WALK_LINK /* Sum up the built subtrees in the nodes above them */
+} Walk;
+
+struct Octree {
+	double opening_angle;
+	double corner[3], size; /* The root cell */
+	int num_bodies, capacity;
+
+	/* Per body, in Morton order */
+	uint64_t *code, *code_tmp;
+	int *order, *order_tmp; /* Index of the body in the caller's arrays */
+	double *x, *y, *z, *mu;
+	double *ax, *ay, *az;
+	double softening;
+
+	/* The caller's arrays, during a build */
+	const double *in_x, *in_y, *in_z, *in_mu;
+
+	OctreeNode *node;
+	int num_nodes, node_capacity;
+	Subtree *subtree;
+	int num_subtrees, subtree_capacity;
+};
+
+Octree *octree_create(void *ctx)
+{
+	return rzalloc(ctx, Octree);
+}
+
+int octree_num_nodes(const Octree *tree)
+{
+	return tree->num_nodes;
+}
+
+static bool reserve_bodies(Octree *tree, int n)
+{
+	if (n <= tree->capacity)
+		return true;
+
+	tree->code = reralloc(tree, tree->code, uint64_t, n);
+	tree->code_tmp = reralloc(tree, tree->code_tmp, uint64_t, n);
+	tree->order = reralloc(tree, tree->order, int, n);
+	tree->order_tmp = reralloc(tree, tree->order_tmp, int, n);
+	tree->x = reralloc(tree, tree->x, double, n);
+	tree->y = reralloc(tree, tree->y, double, n);
+	tree->z = reralloc(tree, tree->z, double, n);
+	tree->mu = reralloc(tree, tree->mu, double, n);
+	tree->ax = reralloc(tree, tree->ax, double, n);
+	tree->ay = reralloc(tree, tree->ay, double, n);
+	tree->az = reralloc(tree, tree->az, double, n);
+	if (tree->code == NULL || tree->code_tmp == NULL ||
+			tree->order == NULL || tree->order_tmp == NULL ||
+			tree->x == NULL || tree->y == NULL || tree->z == NULL ||
+			tree->mu == NULL || tree->ax == NULL || tree->ay == NULL ||
+			tree->az == NULL)
+	{
+		tree->capacity = 0;
+		return false;
+	}
+
+	tree->capacity = n;
+	return true;
+}
+
+/* Spread the low 21 bits of v out to every third bit */
+static uint64_t spread_bits(uint64_t v)
+{
+	v &= 0x1fffff;
+	v = (v | v << 32) & 0x001f00000000ffffULL;
+	v = (v | v << 16) & 0x001f0000ff0000ffULL;
+	v = (v | v << 8) & 0x100f00f00f00f00fULL;
+	v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+	v = (v | v << 2) & 0x1249249249249249ULL;
+
+	return v;
+}
+
+static void morton_codes(void *data, int begin, int end)
+{
+	Octree *tree = data;
+	const double scale = ((1 << MAX_LEVEL) - 1) / tree->size;
+	int i;
+
+	for (i = begin; i < end; i++)
+	{
+		uint64_t qx = (tree->in_x[i] - tree->corner[0]) * scale;
+		uint64_t qy = (tree->in_y[i] - tree->corner[1]) * scale;
+		uint64_t qz = (tree->in_z[i] - tree->corner[2]) * scale;
+
+		tree->code[i] = spread_bits(qx) << 2 | spread_bits(qy) << 1 |
+				spread_bits(qz);
+		tree->order[i] = i;
+	}
+}
+
+/* Least significant digit first, so equal codes keep their order */
+static void sort_codes(Octree *tree)
+{
+	int count[1 << RADIX_BITS];
+	const int mask = (1 << RADIX_BITS) - 1;
+	int shift, i, n = tree->num_bodies;
+
+	for (shift = 0; shift < 3 * MAX_LEVEL; shift += RADIX_BITS)
+	{
+		uint64_t *code;
+		int *order, sum = 0;
+
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < n; i++)
+			count[tree->code[i] >> shift & mask]++;
+		for (i = 0; i <= mask; i++)
+		{
+			int c = count[i];
+			count[i] = sum;
+			sum += c;
+		}
+		for (i = 0; i < n; i++)
+		{
+			int j = count[tree->code[i] >> shift & mask]++;
+			tree->code_tmp[j] = tree->code[i];
+			tree->order_tmp[j] = tree->order[i];
+		}
+
+		code = tree->code, tree->code = tree->code_tmp;
+		tree->code_tmp = code;
+		order = tree->order, tree->order = tree->order_tmp;
+		tree->order_tmp = order;
+	}
+}
+
+static void gather(void *data, int begin, int end)
+{
+	Octree *tree = data;
+	int i;
+
+	for (i = begin; i < end; i++)
+	{
+		int j = tree->order[i];
+
+		tree->x[i] = tree->in_x[j];
+		tree->y[i] = tree->in_y[j];
+		tree->z[i] = tree->in_z[j];
+		tree->mu[i] = tree->in_mu[j];
+	}
+}
+
+static bool is_leaf(int level, int begin, int end)
+{
+	return end - begin <= LEAF_SIZE || level == MAX_LEVEL;
+}
+
+/* The first body in [begin, end) past child octant d of a node on level */
+static int child_end(const Octree *tree, int level, int begin, int end,
+		int d)
+{
+	int shift = 3 * (MAX_LEVEL - 1 - level);
+
+	while (begin < end)
+	{
+		int mid = begin + (end - begin) / 2;
+
+		if ((int) (tree->code[mid] >> shift & 7) <= d)
+			begin = mid + 1;
+		else
+			end = mid;
+	}
+
+	return begin;
+}
+
+static void child_corner(const Octree *tree, int level, const double *corner,
+		int d, double *child)
+{
+	double half = ldexp(tree->size, -level - 1);
+
+	child[0] = corner[0] + (d >> 2 & 1) * half;
+	child[1] = corner[1] + (d >> 1 & 1) * half;
+	child[2] = corner[2] + (d & 1) * half;
+}
+
+static int count_nodes(const Octree *tree, int level, int begin, int end)
+{
+	int d, n = 1;
+
+	if (is_leaf(level, begin, end))
+		return 1;
+
+	for (d = 0; d < 8; d++)
+	{
+		int child = child_end(tree, level, begin, end, d);
+
+		if (child > begin)
+			n += count_nodes(tree, level + 1, begin, child);
+		begin = child;
+	}
+
+	return n;
+}
+
+/* Centre of mass, cell geometry and opening distance. The distance is
+ * stretched by how far the centre of mass is off the middle of the cell
+ * (Barnes 1994), or a lopsided cell close by would pass as far away. */
+static void finish_node(const Octree *tree, OctreeNode *node, int level,
+		const double *corner, double mx, double my, double mz)
+{
+	double side = ldexp(tree->size, -level);
+	double offset;
+
+	node->half = side / 2;
+	node->cx = corner[0] + node->half;
+	node->cy = corner[1] + node->half;
+	node->cz = corner[2] + node->half;
+	if (node->mu > 0)
+	{
+		node->x = mx / node->mu;
+		node->y = my / node->mu;
+		node->z = mz / node->mu;
+	} else
+	{
+		node->x = node->cx;
+		node->y = node->cy;
+		node->z = node->cz;
+	}
+
+	offset = sqrt(SQUARE(node->x - node->cx) + SQUARE(node->y - node->cy) +
+			SQUARE(node->z - node->cz));
+	node->open2 = SQUARE(side / tree->opening_angle + offset);
+}
+
+/* The quadrupole of mass mu at (x, y, z) about the node's centre of mass,
+ * plus the quadrupole q it has about its own */
+static void add_quadrupole(OctreeNode *node, double mu, double x, double y,
+		double z, const double *q)
+{
+	double dx = x - node->x, dy = y - node->y, dz = z - node->z;
+	double r2 = dx*dx + dy*dy + dz*dz;
+	int i;
+
+	node->q[0] += mu * (3*dx*dx - r2);
+	node->q[1] += mu * (3*dy*dy - r2);
+	node->q[2] += mu * (3*dz*dz - r2);
+	node->q[3] += mu * 3*dx*dy;
+	node->q[4] += mu * 3*dx*dz;
+	node->q[5] += mu * 3*dy*dz;
+	if (q != NULL)
+		for (i = 0; i < 6; i++)
+			node->q[i] += q[i];
+}
+
+/* Sum the children of the node at index, which end before next */
+static void link_node(Octree *tree, int index, int next, int level,
+		const double *corner)
+{
+	OctreeNode *node = &tree->node[index];
+	double mx = 0, my = 0, mz = 0;
+	int c;
+
+	node->mu = 0;
+	for (c = index + 1; c < next; c = tree->node[c].next)
+	{
+		const OctreeNode *child = &tree->node[c];
+
+		node->mu += child->mu;
+		mx += child->mu * child->x;
+		my += child->mu * child->y;
+		mz += child->mu * child->z;
+	}
+	node->next = next;
+	finish_node(tree, node, level, corner, mx, my, mz);
+
+	memset(node->q, 0, sizeof(node->q));
+	for (c = index + 1; c < next; c = tree->node[c].next)
+	{
+		const OctreeNode *child = &tree->node[c];
+		add_quadrupole(node, child->mu, child->x, child->y, child->z,
+				child->q);
+	}
+}
+
+/* Build the subtree of bodies [begin, end) from node index on, depth first.
+ * Returns the index past its last node. */
+static int build_node(Octree *tree, int index, int level, int begin, int end,
+		const double *corner)
+{
+	OctreeNode *node = &tree->node[index];
+	int d, next = index + 1;
+
+	node->begin = begin;
+	node->end = end;
+	node->leaf = is_leaf(level, begin, end);
+
+	if (node->leaf)
+	{
+		double mx = 0, my = 0, mz = 0;
+		int i;
+
+		node->mu = 0;
+		for (i = begin; i < end; i++)
+		{
+			node->mu += tree->mu[i];
+			mx += tree->mu[i] * tree->x[i];
+			my += tree->mu[i] * tree->y[i];
+			mz += tree->mu[i] * tree->z[i];
+		}
+		node->next = next;
+		finish_node(tree, node, level, corner, mx, my, mz);
+
+		memset(node->q, 0, sizeof(node->q));
+		for (i = begin; i < end; i++)
+			add_quadrupole(node, tree->mu[i], tree->x[i], tree->y[i],
+					tree->z[i], NULL);
+		return next;
+	}
+
+	for (d = 0; d < 8; d++)
+	{
+		int child = child_end(tree, level, begin, end, d);
+		double sub[3];
+
+		child_corner(tree, level, corner, d, sub);
+		if (child > begin)
+			next = build_node(tree, next, level + 1, begin, child, sub);
+		begin = child;
+	}
+	link_node(tree, index, next, level, corner);
+
+	return next;
+}
+
+/* The levels above SPLIT_LEVEL, which are few enough to do on one thread.
+ * The same walk hands out the subtrees below them, places them in the
+ * array once their sizes are known, and sums them up once they're built.
+ * Returns the index past the last node under the current one. */
+static int walk_top(Octree *tree, Walk walk, int *job, int index, int level,
+		int begin, int end, const double *corner)
+{
+	int d, first = begin, next = index + 1;
+
+	if (level == SPLIT_LEVEL || is_leaf(level, begin, end))
+	{
+		Subtree *s;
+
+		if (walk == WALK_PLAN)
+		{
+			if (tree->num_subtrees == tree->subtree_capacity)
+			{
+				int capacity = MAX(64, 2 * tree->subtree_capacity);
+
+				s = reralloc(tree, tree->subtree, Subtree, capacity);
+				if (s == NULL)
+					return -1;
+				tree->subtree = s;
+				tree->subtree_capacity = capacity;
+			}
+			s = &tree->subtree[tree->num_subtrees++];
+			s->level = level;
+			s->begin = begin;
+			s->end = end;
+			memcpy(s->corner, corner, sizeof(s->corner));
+			return next;
+		}
+
+		s = &tree->subtree[(*job)++];
+		s->first = index;
+		return index + s->num_nodes;
+	}
+
+	/* The octants split [first, end) up among them */
+	for (d = 0; d < 8; d++)
+	{
+		int child = child_end(tree, level, first, end, d);
+		double sub[3];
+
+		child_corner(tree, level, corner, d, sub);
+		if (child > first)
+			next = walk_top(tree, walk, job, next, level + 1, first, child,
+					sub);
+		if (next < 0)
+			return -1;
+		first = child;
+	}
+
+	if (walk == WALK_LINK)
+	{
+		tree->node[index].begin = begin;
+		tree->node[index].end = end;
+		tree->node[index].leaf = false;
+		link_node(tree, index, next, level, corner);
+	}
+
+	return next;
+}
+
+static void count_subtrees(void *data, int begin, int end)
+{
+	Octree *tree = data;
+	int i;
+
+	for (i = begin; i < end; i++)
+	{
+		Subtree *s = &tree->subtree[i];
+		s->num_nodes = count_nodes(tree, s->level, s->begin, s->end);
+	}
+}
+
+static void build_subtrees(void *data, int begin, int end)
+{
+	Octree *tree = data;
+	int i;
+
+	for (i = begin; i < end; i++)
+	{
+		Subtree *s = &tree->subtree[i];
+		build_node(tree, s->first, s->level, s->begin, s->end, s->corner);
+	}
+}
+
+/* Sort the bodies along a Morton curve through their bounding cube and
+ * build the tree over them. Everything but the radix sort and the top few
+ * levels runs on the pool. The caller's arrays are copied. */
+bool octree_build(Octree *tree, const double *x, const double *y,
+		const double *z, const double *mu, int num_bodies,
+		double opening_angle, WorkPool *pool)
+{
+	double lo[3] = {INFINITY, INFINITY, INFINITY};
+	double hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+	int i, job, num_nodes;
+
+	tree->num_bodies = 0;
+	tree->num_nodes = 0;
+	tree->num_subtrees = 0;
+	tree->opening_angle = opening_angle;
+	if (num_bodies == 0)
+		return true;
+	if (!reserve_bodies(tree, num_bodies))
+		return false;
+
+	for (i = 0; i < num_bodies; i++)
+	{
+		lo[0] = MIN(lo[0], x[i]), hi[0] = MAX(hi[0], x[i]);
+		lo[1] = MIN(lo[1], y[i]), hi[1] = MAX(hi[1], y[i]);
+		lo[2] = MIN(lo[2], z[i]), hi[2] = MAX(hi[2], z[i]);
+	}
+	memcpy(tree->corner, lo, sizeof(lo));
+	tree->size = MAX(MAX(hi[0] - lo[0], hi[1] - lo[1]), hi[2] - lo[2]);
+	if (tree->size == 0)
+		tree->size = 1;
+	/* Keep the far faces inside the last cell */
+	tree->size *= 1 + 1e-12;
+
+	tree->num_bodies = num_bodies;
+	tree->in_x = x, tree->in_y = y, tree->in_z = z, tree->in_mu = mu;
+	workpool_run(pool, morton_codes, tree, num_bodies, 4096);
+	sort_codes(tree);
+	workpool_run(pool, gather, tree, num_bodies, 4096);
+
+	if (walk_top(tree, WALK_PLAN, NULL, 0, 0, 0, num_bodies,
+			tree->corner) < 0)
+		goto errorout;
+	workpool_run(pool, count_subtrees, tree, tree->num_subtrees, 1);
+
+	job = 0;
+	num_nodes = walk_top(tree, WALK_LAYOUT, &job, 0, 0, 0, num_bodies,
+			tree->corner);
+	if (num_nodes > tree->node_capacity)
+	{
+		int capacity = MAX(num_nodes, tree->node_capacity * 3 / 2);
+
+		tree->node = reralloc(tree, tree->node, OctreeNode, capacity);
+		if (tree->node == NULL)
+			goto errorout;
+		tree->node_capacity = capacity;
+	}
+	tree->num_nodes = num_nodes;
+
+	workpool_run(pool, build_subtrees, tree, tree->num_subtrees, 1);
+	job = 0;
+	walk_top(tree, WALK_LINK, &job, 0, 0, 0, num_bodies, tree->corner);
+
+	return true;
+
+errorout:
+	tree->num_bodies = 0;
+	tree->num_nodes = 0;
+	tree->node_capacity = 0;
+	return false;
+}
+
+/* Walk the tree for bodies [begin, end) in Morton order. Neighbouring
+ * bodies take nearly the same path, which keeps the nodes in cache. */
+static void evaluate(void *data, int begin, int end)
+{
+	Octree *tree = data;
+	const double eps = tree->softening;
+	int i;
+
+	for (i = begin; i < end; i++)
+	{
+		const double xi = tree->x[i], yi = tree->y[i], zi = tree->z[i];
+		double ax = 0, ay = 0, az = 0;
+		int n = 0;
+
+		while (n < tree->num_nodes)
+		{
+			const OctreeNode *node = &tree->node[n];
+			double dx = node->x - xi, dy = node->y - yi, dz = node->z - zi;
+			double r2 = dx*dx + dy*dy + dz*dz;
+			bool inside = fabs(xi - node->cx) <= node->half &&
+					fabs(yi - node->cy) <= node->half &&
+					fabs(zi - node->cz) <= node->half;
+
+			if (!inside && r2 > node->open2)
+			{
+				const double *q = node->q;
+				double qx, qy, qz, qr, r5, s;
+
+				/* Monopole plus quadrupole, from the potential
+				 * -mu/r - d.Q.d / (2 r^5) */
+				r2 += eps;
+				r5 = r2 * r2 * sqrt(r2);
+				qx = q[0]*dx + q[3]*dy + q[4]*dz;
+				qy = q[3]*dx + q[1]*dy + q[5]*dz;
+				qz = q[4]*dx + q[5]*dy + q[2]*dz;
+				qr = 2.5 * (qx*dx + qy*dy + qz*dz) / r2;
+				s = (node->mu * r2 + qr) / r5;
+				ax += s * dx - qx / r5;
+				ay += s * dy - qy / r5;
+				az += s * dz - qz / r5;
+			} else if (node->leaf)
+			{
+				int j;
+
+				for (j = node->begin; j < node->end; j++)
+				{
+					double s;
+
+					dx = tree->x[j] - xi;
+					dy = tree->y[j] - yi;
+					dz = tree->z[j] - zi;
+					r2 = dx*dx + dy*dy + dz*dz + eps;
+					if (r2 == 0)
+						continue;
+					s = tree->mu[j] / (r2 * sqrt(r2));
+					ax += s * dx, ay += s * dy, az += s * dz;
+				}
+			} else
+			{
+				n++; /* Open it: the first child comes right after */
+				continue;
+			}
+			n = node->next;
+		}
+
+		tree->ax[i] = ax;
+		tree->ay[i] = ay;
+		tree->az[i] = az;
+	}
+}
+
+/* Accelerations of all bodies, in the order of the arrays given to the last
+ * octree_build(). softening is added to every distance squared. */
+void octree_accelerations(Octree *tree, double *ax, double *ay, double *az,
+		double softening, WorkPool *pool)
+{
+	int i;
+
+	tree->softening = softening;
+	workpool_run(pool, evaluate, tree, tree->num_bodies, 64);
+
+	for (i = 0; i < tree->num_bodies; i++)
+	{
+		int j = tree->order[i];
+
+		ax[j] = tree->ax[i];
+		ay[j] = tree->ay[i];
+		az[j] = tree->az[i];
+	}
+}
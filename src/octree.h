@@ -0,0 +1,23 @@
+#ifndef KOSMOS_OCTREE_H
+#define KOSMOS_OCTREE_H
+
+#include <stdbool.h>
+#include "workpool.h"
+
+/* Barnes-Hut gravity. Bodies are sorted along a Morton curve and the tree
+ * is laid out depth first in one array, so every subtree is a contiguous
+ * run of nodes and the walk needs neither pointers nor a stack. A node is
+ * replaced by its centre of mass when it looks smaller than the opening
+ * angle (in radians, roughly) from the body being pulled. */
+
+typedef struct Octree Octree;
+
+Octree *octree_create(void *ctx);
+bool octree_build(Octree *tree, const double *x, const double *y,
+		const double *z, const double *mu, int num_bodies,
+		double opening_angle, WorkPool *pool);
+void octree_accelerations(Octree *tree, double *ax, double *ay, double *az,
+		double softening, WorkPool *pool);
+int octree_num_nodes(const Octree *tree);
+
+#endif
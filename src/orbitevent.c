@@ -0,0 +1,446 @@
+#include <float.h>
+#include <math.h>
+#include <stdbool.h>
+#include <ralloc.h>
+
+#include "log.h"
+#include "orbitevent.h"
+
+#define MAX_ITERATIONS 100
+
+/* Where the next event of one kind for one body comes from */
+typedef struct EventSource {
+	double t; /* Of the next event, the heap key */
+	int body;
+	OrbitEventType type;
+
+	/* Closed form: at mean anomaly target + 2 pi k, for every k if the
+	 * orbit is periodic and otherwise only for k = 0 */
+	bool sampled, periodic;
+	double target;
+	long k;
+
+	/* Sampled: scanned up to cursor, where the distance to the root
+	 * minus the threshold was excess */
+	double cursor, excess, step;
+	double max_speed; /* Bound on how fast that distance changes */
+} EventSource;
+
+struct EventFinder {
+	SolarSystem *solsys;
+	double start, end, threshold;
+	unsigned types;
+
+	int num_sources;
+	EventSource *heap; /* A binary heap on t */
+};
+
+/* The mean anomaly at true anomaly theta, or NaN for a direction a
+ * hyperbola or parabola never goes */
+static double mean_anomaly_at(double e, double theta)
+{
+	double x, anomaly;
+
+	theta = remainder(theta, M_TWO_PI);
+	if (e < 1)
+	{
+		anomaly = 2 * atan2(sqrt(1 - e) * sin(theta / 2),
+				sqrt(1 + e) * cos(theta / 2));
+		return anomaly - e * sin(anomaly);
+	} else if (e > 1)
+	{
+		x = sqrt((e - 1) / (e + 1)) * tan(theta / 2);
+		if (!(fabs(x) < 1))
+			return NAN;
+		anomaly = 2 * atanh(x);
+		return e * sinh(anomaly) - anomaly;
+	} else
+	{
+		if (!(fabs(theta) < M_PI))
+			return NAN;
+		x = tan(theta / 2);
+		return x + x*x*x / 3;
+	}
+}
+
+/* The mean anomaly where the distance to the primary grows through r, or
+ * NaN if it never does. It shrinks through r at minus that. */
+static double mean_anomaly_at_distance(const KeplerOrbit *orbit, double r)
+{
+	double e = orbit->Ecc, a = fabs(orbit->SMa), x;
+
+	if (e < 1)
+	{
+		x = (1 - r / a) / e;
+		if (!(fabs(x) < 1)) /* Circular, or always on one side */
+			return NAN;
+		x = acos(x);
+		return x - e * sin(x);
+	} else if (e > 1)
+	{
+		x = (r / a + 1) / e;
+		if (!(x > 1))
+			return NAN;
+		x = acosh(x);
+		return e * sinh(x) - x;
+	} else
+	{
+		x = r / a - 1;
+		if (!(x > 0))
+			return NAN;
+		x = sqrt(x);
+		return x + x*x*x / 3;
+	}
+}
+
+static double closed_form_time(const SolarSystem *solsys,
+		const EventSource *src)
+{
+	const KeplerOrbit *orbit = &solsys->body[src->body].orbit;
+
+	return orbit->epoch + (src->target + M_TWO_PI * src->k -
+			orbit->mean_anomaly) / orbit->mean_motion;
+}
+
+/* Distance to the root minus the threshold */
+static double distance_excess(const EventFinder *finder, int i, double t)
+{
+	Vec3 p;
+
+	solsys_state_at_time(finder->solsys, i, t, &p, NULL);
+
+	return vec3_length(p) - finder->threshold;
+}
+
+/* Brent's method on the distance excess between a and b, where it changes
+ * sign */
+static double brent(const EventFinder *finder, int body, double a,
+		double fa, double b, double fb)
+{
+	double c = a, fc = fa, d = b - a, e = d;
+	int iter;
+
+	for (iter = 0; iter < MAX_ITERATIONS; iter++)
+	{
+		double tol, m, p, q, r, s;
+
+		if ((fb > 0) == (fc > 0))
+		{
+			c = a;
+			fc = fa;
+			d = e = b - a;
+		}
+		if (fabs(fc) < fabs(fb))
+		{
+			a = b; b = c; c = a;
+			fa = fb; fb = fc; fc = fa;
+		}
+
+		tol = 2 * DBL_EPSILON * fabs(b) + 0.5 * SOLSYS_TIME_TOLERANCE;
+		m = 0.5 * (c - b);
+		if (fabs(m) <= tol || fb == 0)
+			break;
+
+		if (fabs(e) < tol || fabs(fa) <= fabs(fb))
+		{
+			d = e = m; /* Bisection */
+		} else
+		{
+			s = fb / fa;
+			if (a == c)
+			{
+				/* Secant */
+				p = 2 * m * s;
+				q = 1 - s;
+			} else
+			{
+				/* Inverse quadratic interpolation */
+				q = fa / fc;
+				r = fb / fc;
+				p = s * (2 * m * q * (q - r) - (b - a) * (r - 1));
+				q = (q - 1) * (r - 1) * (s - 1);
+			}
+			if (p > 0)
+				q = -q;
+			else
+				p = -p;
+
+			if (2 * p < MIN(3 * m * q - fabs(tol * q), fabs(e * q)))
+			{
+				e = d;
+				d = p / q;
+			} else
+				d = e = m;
+		}
+
+		a = b;
+		fa = fb;
+		b += (fabs(d) > tol ? d : (m > 0 ? tol : -tol));
+		fb = distance_excess(finder, body, b);
+	}
+
+	return b;
+}
+
+/* Scan on from the cursor to the next crossing of a wanted kind. Far from
+ * the threshold it takes a while to get there even at full speed, so the
+ * scan leaps ahead. Returns false if there is none before the end. */
+static bool next_crossing(const EventFinder *finder, EventSource *src)
+{
+	double u = src->cursor, fu = src->excess;
+
+	while (u < finder->end)
+	{
+		double w = MIN(finder->end, u + MAX(src->step,
+				fabs(fu) / src->max_speed));
+		double fw = distance_excess(finder, src->body, w);
+
+		if ((fu > 0) != (fw > 0))
+		{
+			src->type = (fw > 0 ? EVENT_OUTBOUND : EVENT_INBOUND);
+			if (finder->types & EVENT_MASK(src->type))
+			{
+				src->t = brent(finder, src->body, u, fu, w, fw);
+				src->cursor = w;
+				src->excess = fw;
+				return true;
+			}
+		}
+		u = w;
+		fu = fw;
+	}
+
+	return false;
+}
+
+static void swap(EventSource *a, EventSource *b)
+{
+	EventSource tmp = *a;
+
+	*a = *b;
+	*b = tmp;
+}
+
+static void sift_down(EventFinder *finder, int i)
+{
+	EventSource *heap = finder->heap;
+
+	for (;;)
+	{
+		int child = 2 * i + 1;
+
+		if (child >= finder->num_sources)
+			break;
+		if (child + 1 < finder->num_sources &&
+				heap[child + 1].t < heap[child].t)
+			child++;
+		if (heap[i].t <= heap[child].t)
+			break;
+		swap(&heap[i], &heap[child]);
+		i = child;
+	}
+}
+
+static void push(EventFinder *finder, const EventSource *src)
+{
+	EventSource *heap = finder->heap;
+	int i = finder->num_sources++;
+
+	heap[i] = *src;
+	while (i > 0 && heap[(i - 1) / 2].t > heap[i].t)
+	{
+		swap(&heap[i], &heap[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+}
+
+/* An event at mean anomaly target, on every revolution of an ellipse */
+static void add_closed_form(EventFinder *finder, int i, OrbitEventType type,
+		double target)
+{
+	const KeplerOrbit *orbit = &finder->solsys->body[i].orbit;
+	EventSource src;
+
+	if (!(finder->types & EVENT_MASK(type)) || isnan(target))
+		return;
+
+	src.body = i;
+	src.type = type;
+	src.sampled = false;
+	src.periodic = orbit->Ecc < 1;
+	src.target = target;
+	src.k = 0;
+	if (src.periodic)
+		src.k = ceil((orbit->mean_anomaly + orbit->mean_motion *
+				(finder->start - orbit->epoch) - target) / M_TWO_PI);
+	src.t = closed_form_time(finder->solsys, &src);
+	if (src.periodic && src.t < finder->start) /* Rounding */
+	{
+		src.k++;
+		src.t = closed_form_time(finder->solsys, &src);
+	}
+
+	if (src.t >= finder->start && src.t <= finder->end)
+		push(finder, &src);
+}
+
+/* Crossings of the threshold distance from the root by a satellite */
+static void add_sampled(EventFinder *finder, int i, double step,
+		double max_speed)
+{
+	EventSource src;
+
+	src.body = i;
+	src.sampled = true;
+	src.cursor = finder->start;
+	src.excess = distance_excess(finder, i, finder->start);
+	src.step = step;
+	src.max_speed = max_speed;
+	if (next_crossing(finder, &src))
+		push(finder, &src);
+}
+
+/* Every event of the given types, a mask of EVENT_MASK() bits, from start
+ * to end. The threshold is a distance from the root in metres, for
+ * EVENT_INBOUND and EVENT_OUTBOUND. */
+EventFinder *event_finder_create(void *ctx, SolarSystem *solsys,
+		double start, double end, unsigned types, double threshold)
+{
+	EventFinder *finder;
+	double *time_scale, *max_speed;
+	int i, k, n = solsys->num_bodies;
+
+	finder = rzalloc(ctx, EventFinder);
+	if (finder == NULL)
+		goto errorout;
+	finder->solsys = solsys;
+	finder->start = start;
+	finder->end = end;
+	finder->threshold = threshold;
+	finder->types = types;
+	finder->heap = ralloc_array(finder, EventSource,
+			NUM_EVENT_TYPES * (size_t) n);
+	time_scale = ralloc_array(finder, double, n);
+	max_speed = solsys_max_speeds(finder, solsys);
+	if (finder->heap == NULL || time_scale == NULL || max_speed == NULL)
+		goto errorout;
+
+	if (!(threshold > 0))
+		finder->types &= ~(EVENT_MASK(EVENT_INBOUND) |
+				EVENT_MASK(EVENT_OUTBOUND));
+
+	for (k = 0; k < n; k++)
+	{
+		Body *body = &solsys->body[solsys->order[k]];
+		KeplerOrbit *orbit = &body->orbit;
+		Body *primary = body->primary;
+		double e = orbit->Ecc, node, m;
+
+		i = solsys->order[k];
+		time_scale[i] = end - start;
+		if (primary == NULL)
+			continue;
+
+		/* Samples a satellite's distance to the root is followed by. An
+		 * orbit so small that the primary's motion takes it across within
+		 * the tolerance can't make crossings that far apart, so its period
+		 * doesn't count. */
+		time_scale[i] = fabs(M_TWO_PI / orbit->mean_motion) /
+				SOLSYS_SAMPLES_PER_ORBIT;
+		if (primary->primary != NULL)
+		{
+			int p = primary - solsys->body;
+
+			if (orbit->Ecc < 1 &&
+					vec3_length(kepler_position_at_E(orbit, M_PI)) <
+					max_speed[p] * SOLSYS_TIME_TOLERANCE)
+				time_scale[i] = time_scale[p];
+			else
+				time_scale[i] = MIN(time_scale[i], time_scale[p]);
+		}
+
+		add_closed_form(finder, i, EVENT_PERIAPSIS, 0);
+		if (e < 1)
+			add_closed_form(finder, i, EVENT_APOAPSIS, M_PI);
+
+		/* The plane's z is x P.z + y Q.z, which goes up through zero at
+		 * this true anomaly */
+		if (orbit->P.z != 0 || orbit->Q.z != 0)
+		{
+			node = atan2(-orbit->P.z, orbit->Q.z);
+			add_closed_form(finder, i, EVENT_ASCENDING_NODE,
+					mean_anomaly_at(e, node));
+			add_closed_form(finder, i, EVENT_DESCENDING_NODE,
+					mean_anomaly_at(e, node + M_PI));
+		}
+
+		/* The sphere of influence of the primary in its own orbit */
+		if (primary->primary != NULL)
+		{
+			m = mean_anomaly_at_distance(orbit, fabs(primary->orbit.SMa) *
+					pow(primary->grav_param /
+					primary->primary->grav_param, 0.4));
+			add_closed_form(finder, i, EVENT_SOI_EXIT, m);
+			add_closed_form(finder, i, EVENT_SOI_ENTRY, -m);
+		}
+
+		if (!(finder->types & (EVENT_MASK(EVENT_INBOUND) |
+				EVENT_MASK(EVENT_OUTBOUND))))
+			continue;
+		if (primary->primary == NULL)
+		{
+			m = mean_anomaly_at_distance(orbit, threshold);
+			add_closed_form(finder, i, EVENT_OUTBOUND, m);
+			add_closed_form(finder, i, EVENT_INBOUND, -m);
+		} else
+			add_sampled(finder, i, time_scale[i], max_speed[i]);
+	}
+	ralloc_free(time_scale);
+	ralloc_free(max_speed);
+
+	return finder;
+
+errorout:
+	log_err("Out of memory\n");
+	ralloc_free(finder);
+	return NULL;
+}
+
+/* The next event in time, false once there are no more */
+bool event_finder_next(EventFinder *finder, OrbitEvent *event)
+{
+	EventSource *src = &finder->heap[0];
+	bool more;
+
+	if (finder->num_sources == 0)
+		return false;
+
+	event->t = src->t;
+	event->body = src->body;
+	event->type = src->type;
+
+	if (src->sampled)
+		more = next_crossing(finder, src);
+	else
+	{
+		src->k++;
+		src->t = closed_form_time(finder->solsys, src);
+		more = src->periodic && src->t <= finder->end;
+	}
+
+	if (!more)
+		*src = finder->heap[--finder->num_sources];
+	sift_down(finder, 0);
+
+	return true;
+}
+
+const char *event_type_name(OrbitEventType type)
+{
+	static const char *name[NUM_EVENT_TYPES] = {
+		"periapsis", "apoapsis", "ascending node", "descending node",
+		"inbound", "outbound", "SOI exit", "SOI entry"
+	};
+
+	return (type < NUM_EVENT_TYPES ? name[type] : "unknown");
+}
@@ -0,0 +1,42 @@
+#ifndef KOSMOS_ORBITEVENT_H
+#define KOSMOS_ORBITEVENT_H
+
+#include <stdbool.h>
+#include "solarsystem.h"
+
+/* Times at which something happens along the orbits, handed out in order
+ * one at a time. Almost all of them are at a fixed anomaly, so their
+ * times follow from Kepler's equation in closed form. Only a satellite's
+ * distance from the root depends on more than one orbit; that one is
+ * bracketed by sampling and found with Brent's method. Goes by the
+ * orbits, also in N-body mode. */
+
+typedef enum OrbitEventType {
+	EVENT_PERIAPSIS,
+	EVENT_APOAPSIS,
+	EVENT_ASCENDING_NODE, /* Through the primary's xy-plane, going up */
+	EVENT_DESCENDING_NODE,
+	EVENT_INBOUND, /* Closer to the root than the threshold */
+	EVENT_OUTBOUND, /* ...and further away again */
+	EVENT_SOI_EXIT, /* Out of the primary's sphere of influence */
+	EVENT_SOI_ENTRY,
+	NUM_EVENT_TYPES
+} OrbitEventType;
+
+#define EVENT_MASK(type) (1u << (type))
+#define EVENT_ALL ((1u << NUM_EVENT_TYPES) - 1)
+
+typedef struct OrbitEvent {
+	double t;
+	int body; /* Index into solsys->body */
+	OrbitEventType type;
+} OrbitEvent;
+
+typedef struct EventFinder EventFinder;
+
+EventFinder *event_finder_create(void *ctx, SolarSystem *solsys,
+		double start, double end, unsigned types, double threshold);
+bool event_finder_next(EventFinder *finder, OrbitEvent *event);
+const char *event_type_name(OrbitEventType type);
+
+#endif
@@ -12,6 +12,7 @@
 #include "camera.h"
 #include "mesh.h"
 #include "solarsystem.h"
+#include "simthread.h"
 #include "render.h"
 #include "input.h"
 #include "util.h"
@@ -20,7 +21,12 @@
 #define M_PI 3.14159265358979323846L
 #endif
 
-static void calcfps(void);
+#define SIM_RATE 60 /* Simulation ticks per second */
+#define SIM_STEP (365*86400.0) /* Simulated seconds per tick */
+
+static void calcfps(SimThread *sim, const CullStats *cull);
+static Scene *scene_from_solsys(void *ctx, const SolarSystem *sol,
+		Renderable *renderable);
 int init_allegro(Camera *cam);
 
 ALLEGRO_DISPLAY *dpy;
@@ -33,8 +39,6 @@ GLfloat light_specular[3] = {0.296648, 0.296648, 0.296648};
 
 SolarSystem *solsys;
 
-double t = 0;
-
 int init_allegro(Camera *cam)
 {
 	if (!al_init())
@@ -59,27 +63,62 @@ int init_allegro(Camera *cam)
 	return 0;
 }
 
-static void calcfps()
+/* Frame rate and the share of Kepler solves the time level of detail
+ * saved, over the last sample, and how many bodies were in view */
+static void calcfps(SimThread *sim, const CullStats *cull)
 {
 	const double SAMPLE_TIME = 0.250;
 	static int frames;
 	static double tock=0.0;
+	static unsigned long last_performed, last_skipped;
+	unsigned long performed, skipped, total;
+	int percent;
 	double tick;
-	char string[64];
+	char string[96];
 
 	frames++;
 
 	tick = al_get_time();
 	if (tick - tock > SAMPLE_TIME)
 	{
-		snprintf(string, 64, "%d FPS", (int) (frames/(tick - tock) + 0.5));
+		simthread_lod_counts(sim, &performed, &skipped);
+		total = (performed - last_performed) + (skipped - last_skipped);
+		percent = (total > 0 ? 100 * (skipped - last_skipped) / total : 0);
+		snprintf(string, sizeof(string), "%d FPS, %d%% of updates skipped, "
+				"%d of %d bodies in view", (int) (frames/(tick - tock) + 0.5),
+				percent, cull->drawn, cull->tested);
 		al_set_window_title(dpy, string);
 
 		frames = 0;
 		tock = tick;
+		last_performed = performed;
+		last_skipped = skipped;
 	}
 }
 
+/* One entity for every body, with the same index. Their positions come
+ * from scene_update_positions(). */
+static Scene *scene_from_solsys(void *ctx, const SolarSystem *sol,
+		Renderable *renderable)
+{
+	Quaternion identity = {1, 0, 0, 0};
+	Scene *scene;
+	int i;
+
+	if ((scene = scene_new(ctx)) == NULL)
+		return NULL;
+
+	for (i = 0; i < sol->num_bodies; i++)
+		if (scene_add(scene, renderable, sol->body[i].position,
+				identity, sol->body[i].radius) < 0)
+		{
+			ralloc_free(scene);
+			return NULL;
+		}
+
+	return scene;
+}
+
 int main(int argc, char **argv)
 {
 	int i;
@@ -90,9 +129,13 @@ int main(int argc, char **argv)
 	Vec3 up =  {0, 1, 0};
 	Vec3 target = {0, 0, 0};
 	Shader *shader_light;
+	Shader *shader_instanced;
 	Shader *shader_simple;
 	Mesh *mesh;
 	Renderable planet;
+	SimThread *sim;
+	Scene *scene;
+	Vec3 *body_position;
 	if (argc < 2)
 		filename = STRINGIFY(ROOT_PATH) "/data/teapot.ply";
 	else
@@ -101,6 +144,7 @@ int main(int argc, char **argv)
 	solsys = solsys_load(STRINGIFY(ROOT_PATH) "/data/sol.ini");
 	if (solsys == NULL)
 		return 1;
+	solsys->incremental = true; /* Time advances by a fixed step */
 
 	mesh = mesh_import(filename);
 	if (mesh == NULL)
@@ -129,6 +173,13 @@ int main(int argc, char **argv)
 	if (shader_light == NULL)
 		return 1;
 	
+	/* Every body in one draw call, with the lighting of shader_light */
+	shader_instanced = shader_create(
+			STRINGIFY(ROOT_PATH) "/data/instanced.v.glsl",
+			STRINGIFY(ROOT_PATH) "/data/lighting.f.glsl");
+	if (shader_instanced == NULL)
+		return 1;
+
 	shader_simple = shader_create(STRINGIFY(ROOT_PATH) "/data/simple.v.glsl", 
 	                              STRINGIFY(ROOT_PATH) "/data/simple.f.glsl");
 	if (shader_simple == NULL)
@@ -152,43 +203,35 @@ int main(int argc, char **argv)
 	planet.data = mesh;
 	planet.upload_to_gpu = mesh_upload_to_gpu;
 	planet.render = mesh_render;
-	planet.shader = shader_light;
+	planet.render_instanced = mesh_render_instanced;
+	planet.shader = shader_instanced;
 	renderable_upload_to_gpu(&planet);
 
 	/* Transformation matrices */
 	cam_projection_matrix(&cam, glmProjectionMatrix);
 
+	/* An entity for every body, from here on only the positions change.
+	 * Once the simulation thread runs the bodies are its own, so this
+	 * has to come first. */
+	scene = scene_from_solsys(NULL, solsys, &planet);
+	if (scene == NULL)
+		return 1;
+
+	/* Physics runs on a thread of its own from here on */
+	sim = simthread_create(NULL, solsys, 0, SIM_STEP, SIM_RATE);
+	if (sim == NULL)
+		return 1;
+	body_position = ralloc_array(sim, Vec3, solsys->num_bodies);
+	if (body_position == NULL)
+		return 1;
+
 	/* Start rendering */
 	while(handle_input(ev_queue, &cam))
 	{
-		void *ctx;
-		Entity *renderlist, *prev;
-
-		t += 365*86400;
-
-		/* Physics stuff */
-		solsys_update(solsys, t);
-		ctx = ralloc_context(NULL);
-
-		prev = NULL;
-		for (i = 0; i < solsys->num_bodies; i++)
-		{
-			Entity *e;
-
-			e = ralloc(ctx, Entity);
-			e->orientation = (Quaternion) {1, 0, 0, 0};
-			e->renderable = &planet;
-			e->position = solsys->body[i].position;
-			e->radius = solsys->body[i].radius;
-			e->prev = prev;
-			e->next = NULL;
-			if (prev != NULL)
-				e->prev->next = e;
-			prev = e;
-
-			if (i == 0)
-				renderlist = e;
-		}
+		/* Bodies moving less than a pixel needn't be solved again */
+		simthread_set_lod(sim, cam.position, cam.fov / cam.height);
+		simthread_positions(sim, body_position);
+		scene_update_positions(scene, body_position);
 
 		/* Rendering stuff */
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -197,20 +240,21 @@ int main(int argc, char **argv)
 		glmLoadIdentity(glmViewMatrix);
 		cam_view_matrix(&cam, glmViewMatrix); /* view */
 
-		light_upload_to_gpu(&light, shader_light);
+		frame_upload_to_gpu(&light);
 
-		render_entity_list(renderlist);
+		render_entity_list(scene);
 
 		al_flip_display();
-		calcfps();
-
-		ralloc_free(ctx);
+		calcfps(sim, &scene->cull);
 	}
 
+	ralloc_free(sim);
+	ralloc_free(scene);
 	ralloc_free(mesh);
 	ralloc_free(solsys);
 
 	shader_delete(shader_light);
+	shader_delete(shader_instanced);
 	shader_delete(shader_simple);
 	glmFreeMatrixStack(glmProjectionMatrix);
 	glmFreeMatrixStack(glmViewMatrix);
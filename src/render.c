@@ -1,15 +1,45 @@
+#include <string.h>
+#include <math.h>
 #include <GL/glew.h>
 #include <GL/gl.h>
+#include <ralloc.h>
 
 #include "render.h"
 #include "mesh.h"
+#include "log.h"
+#include "simd.h"
+
+/* What goes into the instance buffer for every entity. The position is in
+ * eye space, worked out in double precision, so that bodies far from the
+ * origin don't lose their place in single precision. */
+typedef struct Instance {
+	GLfloat position[3];
+	GLfloat radius;
+	GLfloat orientation[4]; /* w, x, y, z */
+} Instance;
+
+/* The Frame uniform block, in std140 layout, where a vec3 takes up as
+ * much space as a vec4 */
+typedef struct FrameUniforms {
+	GLfloat projection[16];
+	GLfloat view[16];
+	GLfloat light_pos[4]; /* In eye space */
+	GLfloat light_ambient[4];
+	GLfloat light_diffuse[4];
+	GLfloat light_specular[4];
+} FrameUniforms;
 
 GLuint orbit_vbo;
+static GLuint frame_ubo;
 
 void mesh_upload_to_gpu(Renderable *obj)
 {
 	Mesh *mesh = (Mesh *) obj->data;
 	Shader *shader = obj->shader;
+
+	/* After any scaling of the vertices, which only happens before this */
+	obj->bound = mesh_bound(mesh);
+
 	/* Vertices */
 	glGenBuffers(1, &mesh->vbo);
 	glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo);
@@ -37,6 +67,7 @@ void point_upload_to_gpu(Renderable *obj)
 	GLuint vbo;
 	GLfloat origin[] = {0, 0, 0};
 
+	obj->bound = 0;
 	glGenBuffers(1, &vbo);
 	glBindBuffer(GL_ARRAY_BUFFER, vbo);
 	glBufferData(GL_ARRAY_BUFFER, sizeof(origin), origin, GL_STATIC_DRAW);
@@ -45,12 +76,36 @@ void point_upload_to_gpu(Renderable *obj)
 			GL_FALSE, sizeof(origin), 0);
 }
 
+/* The instance buffer, one attribute step per instance instead of per
+ * vertex. Only if both the shader and the renderable are up for it. */
+static void instance_upload_to_gpu(Renderable *obj)
+{
+	GLint pos_loc = obj->shader->location[SHADER_ATT_INSTANCE_POSITION];
+	GLint rot_loc = obj->shader->location[SHADER_ATT_INSTANCE_ORIENTATION];
+
+	obj->instance_vbo = 0;
+	if (obj->render_instanced == NULL || pos_loc < 0 || rot_loc < 0)
+		return;
+
+	glGenBuffers(1, &obj->instance_vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, obj->instance_vbo);
+	glEnableVertexAttribArray(pos_loc);
+	glVertexAttribPointer(pos_loc, 4, GL_FLOAT, GL_FALSE, sizeof(Instance),
+			(void *) offsetof(Instance, position));
+	glVertexAttribDivisor(pos_loc, 1);
+	glEnableVertexAttribArray(rot_loc);
+	glVertexAttribPointer(rot_loc, 4, GL_FLOAT, GL_FALSE, sizeof(Instance),
+			(void *) offsetof(Instance, orientation));
+	glVertexAttribDivisor(rot_loc, 1);
+}
+
 void renderable_upload_to_gpu(Renderable *obj)
 {
 	glGenVertexArrays(1, &obj->vao);
 	glBindVertexArray(obj->vao);
 
 	obj->upload_to_gpu(obj);
+	instance_upload_to_gpu(obj);
 	obj->memloc = MEMLOC_GPU;
 
 	glBindVertexArray(0); /* So we don't accidentally overwrite the VAO */
@@ -58,23 +113,35 @@ void renderable_upload_to_gpu(Renderable *obj)
 	return;
 }
 
-void light_upload_to_gpu(void *data, Shader *shader)
+/* The projection and view matrices and the light, set once per frame for
+ * every shader with the Frame uniform block */
+void frame_upload_to_gpu(const Light *light)
 {
-	Vec3 newpos;
-	GLfloat pos3f[3];
-	Light *light = (Light *) data;
-	GLint pos_loc, ambi_loc, diff_loc, spec_loc;
+	FrameUniforms frame;
+	Vec3 pos;
+
+	if (frame_ubo == 0)
+	{
+		glGenBuffers(1, &frame_ubo);
+		glBindBufferBase(GL_UNIFORM_BUFFER, SHADER_FRAME_BINDING, frame_ubo);
+	}
+
+	glmMatrixToFloat(glmProjectionMatrix, frame.projection);
+	glmMatrixToFloat(glmViewMatrix, frame.view);
+	pos = glmTransformVector(glmViewMatrix, light->position);
+	frame.light_pos[0] = pos.x;
+	frame.light_pos[1] = pos.y;
+	frame.light_pos[2] = pos.z;
+	frame.light_pos[3] = 1;
+	memcpy(frame.light_ambient, light->ambient, sizeof(light->ambient));
+	memcpy(frame.light_diffuse, light->diffuse, sizeof(light->diffuse));
+	memcpy(frame.light_specular, light->specular, sizeof(light->specular));
+	frame.light_ambient[3] = frame.light_diffuse[3] =
+			frame.light_specular[3] = 0;
 
-	newpos = glmTransformVector(glmViewMatrix, light->position);
-	pos3f[0] = newpos.x; pos3f[1] = newpos.y; pos3f[2] = newpos.z;
-	pos_loc = glGetUniformLocation(shader->program, "light_pos");
-	ambi_loc = glGetUniformLocation(shader->program, "light_ambient");
-	diff_loc = glGetUniformLocation(shader->program, "light_diffuse");
-	spec_loc = glGetUniformLocation(shader->program, "light_specular");
-	glUniform3fv(pos_loc, 1, pos3f);
-	glUniform3fv(ambi_loc, 1, light->ambient);
-	glUniform3fv(diff_loc, 1, light->diffuse);
-	glUniform3fv(spec_loc, 1, light->specular);
+	glBindBuffer(GL_UNIFORM_BUFFER, frame_ubo);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(frame), &frame, GL_STREAM_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
 }
 
 void mesh_render(Renderable *obj)
@@ -91,9 +158,26 @@ void point_render(Renderable *obj)
 	glDrawArrays(GL_POINTS, 0, 1);
 }
 
-static void entity_render(Entity *ent)
+void mesh_render_instanced(Renderable *obj, int count)
 {
+	Mesh *mesh = (Mesh *) obj->data;
+
+	glDrawElementsInstanced(GL_TRIANGLES, mesh->num_indices,
+			GL_UNSIGNED_INT, NULL, count);
+}
+
+void point_render_instanced(Renderable *obj, int count)
+{
+	(void) obj;
+	glDrawArraysInstanced(GL_POINTS, 0, 1, count);
+}
+
+/* A DrawFunc for one entity, data is the Entity */
+static void entity_render(void *data, int count)
+{
+	Entity *ent = data;
 	Shader *shader = ent->renderable->shader;
+	(void) count;
 	glmPushMatrix(&glmModelMatrix);
 
 	glmLoadIdentity(glmModelMatrix);
@@ -101,26 +185,305 @@ static void entity_render(Entity *ent)
 	glmMultQuaternion(glmModelMatrix, ent->orientation);
 	glmScaleUniform(glmModelMatrix, ent->radius);
 
-	glmUniformMatrix(shader->location[SHADER_UNI_P_MATRIX], glmProjectionMatrix);
-	glmUniformMatrix(shader->location[SHADER_UNI_V_MATRIX], glmViewMatrix);
+	/* The projection and view matrices are in the Frame block */
 	glmUniformMatrix(shader->location[SHADER_UNI_M_MATRIX], glmModelMatrix);
 
-	glBindVertexArray(ent->renderable->vao);
-
 	ent->renderable->render(ent->renderable);
 
-	glBindVertexArray(0);
-
 	glmPopMatrix(&glmModelMatrix);
 }
 
-void render_entity_list(Entity *ent)
+static void instance_set(Instance *instance, const Entity *ent)
+{
+	Vec3 p = glmTransformVector(glmViewMatrix, ent->position);
+
+	instance->position[0] = p.x;
+	instance->position[1] = p.y;
+	instance->position[2] = p.z;
+	instance->radius = ent->radius;
+	instance->orientation[0] = ent->orientation.w;
+	instance->orientation[1] = ent->orientation.x;
+	instance->orientation[2] = ent->orientation.y;
+	instance->orientation[3] = ent->orientation.z;
+}
+
+/* Stream the instances into the renderable's buffer, orphaning last
+ * frame's storage so the driver needn't wait for it */
+static void instances_upload(Renderable *obj, const Instance *instance,
+		int count)
+{
+	GLsizeiptr size = (GLsizeiptr) count * sizeof(Instance);
+
+	glBindBuffer(GL_ARRAY_BUFFER, obj->instance_vbo);
+	glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_STREAM_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, size, instance);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+/* A DrawFunc for count instances, data is the Renderable */
+static void instances_render(void *data, int count)
+{
+	Renderable *obj = data;
+
+	obj->render_instanced(obj, count);
+}
+
+#define MIN_ENTITIES 16
+
+Scene *scene_new(void *ctx)
+{
+	Scene *scene = rzalloc(ctx, Scene);
+
+	if (scene == NULL)
+	{
+		log_err("Out of memory\n");
+		return NULL;
+	}
+	if ((scene->queue = render_queue_new(scene)) == NULL)
+	{
+		ralloc_free(scene);
+		return NULL;
+	}
+
+	return scene;
+}
+
+/* Returns the new entity's handle, its index in scene->entity, or -1. The
+ * array may move as it grows, so hold on to the handle, not a pointer. */
+int scene_add(Scene *scene, Renderable *renderable, Vec3 position,
+		Quaternion orientation, double radius)
 {
-	while(ent)
+	Entity *ent;
+
+	if (scene->num_entities == scene->max_entities)
 	{
-		if (ent->prev == NULL || ent->prev->renderable->shader != ent->renderable->shader)
-			glUseProgram(ent->renderable->shader->program);
-		entity_render(ent);
-		ent = ent->next;
+		int max = MAX(MIN_ENTITIES, 2 * scene->max_entities);
+		Entity *entity = reralloc(scene, scene->entity, Entity, max);
+
+		if (entity == NULL)
+		{
+			log_err("Out of memory\n");
+			return -1;
+		}
+		scene->entity = entity;
+		scene->max_entities = max;
 	}
+
+	ent = &scene->entity[scene->num_entities];
+	ent->position = position;
+	ent->orientation = orientation;
+	ent->radius = radius;
+	ent->renderable = renderable;
+
+	return scene->num_entities++;
+}
+
+void scene_update_positions(Scene *scene, const Vec3 *position)
+{
+	int i;
+
+	for (i = 0; i < scene->num_entities; i++)
+		scene->entity[i].position = position[i];
+}
+
+/* The scratch space of render_entity_list(), kept from frame to frame and
+ * only grown when the scene has */
+static bool scene_reserve_scratch(Scene *scene)
+{
+	int n = scene->max_entities;
+
+	if (scene->scratch_size >= n)
+		return true;
+
+	scene->kind = reralloc(scene, scene->kind, Renderable *, n);
+	scene->which = reralloc(scene, scene->which, int, n);
+	scene->first = reralloc(scene, scene->first, int, n + 1);
+	scene->next = reralloc(scene, scene->next, int, n);
+	scene->visible = reralloc(scene, scene->visible, unsigned char, n);
+	scene->instance = reralloc(scene, scene->instance, Instance, n);
+	if (scene->kind == NULL || scene->which == NULL ||
+			scene->first == NULL || scene->next == NULL ||
+			scene->visible == NULL || scene->instance == NULL)
+	{
+		/* Whatever did get allocated hangs off the scene */
+		scene->scratch_size = 0;
+		return false;
+	}
+	scene->scratch_size = n;
+
+	return true;
+}
+
+/* The planes of the view frustum in world space, from the rows of P·V as
+ * by Gribb and Hartmann: left, right, bottom, top, near and far. Scaled
+ * so that a x + b y + c z + d is the distance in front of the plane. */
+static void frustum_planes(double plane[6][4])
+{
+	double p[16], v[16], m[16];
+	int i, j, k;
+
+	glmGetMatrix(glmProjectionMatrix, p);
+	glmGetMatrix(glmViewMatrix, v);
+	for (i = 0; i < 4; i++) /* Column major, m[4*j + i] is row i */
+		for (j = 0; j < 4; j++)
+		{
+			m[4*j + i] = 0;
+			for (k = 0; k < 4; k++)
+				m[4*j + i] += p[4*k + i] * v[4*j + k];
+		}
+
+	for (i = 0; i < 6; i++)
+	{
+		int row = i / 2;
+		double sign = (i % 2 == 0 ? 1 : -1), norm;
+
+		for (j = 0; j < 4; j++)
+			plane[i][j] = m[4*j + 3] + sign * m[4*j + row];
+		norm = sqrt(SQUARE(plane[i][0]) + SQUARE(plane[i][1]) +
+				SQUARE(plane[i][2]));
+		for (j = 0; j < 4; j++)
+			plane[i][j] /= norm;
+	}
+}
+
+/* Marks the entities whose bounding sphere is at least partly inside the
+ * frustum, SIMD_WIDTH of them at a time. Returns how many are. */
+static int frustum_cull(Scene *scene)
+{
+	double plane[6][4];
+	int i, j, k, n = scene->num_entities, drawn = 0;
+
+	frustum_planes(plane);
+
+	for (i = 0; i < n; i += SIMD_WIDTH)
+	{
+		double x[SIMD_WIDTH], y[SIMD_WIDTH], z[SIMD_WIDTH], r[SIMD_WIDTH];
+		double outside[SIMD_WIDTH];
+		vdouble vx, vy, vz, vr;
+		vmask out;
+
+		/* Gather the lanes, repeating the last entity past the end */
+		for (j = 0; j < SIMD_WIDTH; j++)
+		{
+			const Entity *ent = &scene->entity[MIN(i + j, n - 1)];
+
+			x[j] = ent->position.x;
+			y[j] = ent->position.y;
+			z[j] = ent->position.z;
+			r[j] = ent->radius * ent->renderable->bound;
+		}
+		vx = vd_load(x);
+		vy = vd_load(y);
+		vz = vd_load(z);
+		vr = vd_neg(vd_load(r));
+
+		out = vd_lt(vd_set(0), vd_set(0));
+		for (k = 0; k < 6; k++)
+		{
+			vdouble dist = vd_add(vd_add(vd_mul(vd_set(plane[k][0]), vx),
+					vd_mul(vd_set(plane[k][1]), vy)),
+					vd_add(vd_mul(vd_set(plane[k][2]), vz),
+					vd_set(plane[k][3])));
+
+			out = vm_or(out, vd_lt(dist, vr));
+		}
+
+		vd_store(outside, vd_select(out, vd_set(1), vd_set(0)));
+		for (j = 0; j < SIMD_WIDTH && i + j < n; j++)
+		{
+			scene->visible[i + j] = (outside[j] == 0);
+			drawn += scene->visible[i + j];
+		}
+	}
+
+	return drawn;
+}
+
+/* Entities outside the view frustum are left out. Those whose renderable
+ * has an instance buffer are sorted by renderable, with a counting sort,
+ * and go into the render queue as one packet per renderable. The rest go
+ * in one by one, nearest first. */
+void render_entity_list(Scene *scene)
+{
+	RenderQueue *queue = scene->queue;
+	Renderable **kind;
+	Instance *instance;
+	int *which, *first, *next, i, k, n = scene->num_entities;
+	int num_kinds = 0;
+
+	/* Nothing in view until the culling below has actually run */
+	scene->cull.tested = scene->cull.drawn = scene->cull.culled = 0;
+	if (n == 0)
+		return;
+	if (!scene_reserve_scratch(scene) || !render_queue_reserve(queue, n))
+	{
+		/* Instanced renderables can't be drawn without their instance
+		 * data, so the whole frame goes rather than half of it */
+		log_err("Out of memory, not drawing the entities\n");
+		return;
+	}
+	kind = scene->kind;
+	which = scene->which;
+	first = scene->first;
+	next = scene->next;
+	instance = scene->instance;
+
+	scene->cull.tested = n;
+	scene->cull.drawn = frustum_cull(scene);
+	scene->cull.culled = n - scene->cull.drawn;
+
+	first[0] = 0;
+	for (i = 0; i < n; i++)
+	{
+		Entity *ent = &scene->entity[i];
+		Renderable *obj = ent->renderable;
+
+		which[i] = -1;
+		if (!scene->visible[i])
+			continue;
+		if (obj->instance_vbo == 0)
+		{
+			float depth = -glmTransformVector(glmViewMatrix,
+					ent->position).z;
+
+			render_queue_push(queue, RENDER_PASS_OPAQUE,
+					obj->shader->program, obj->vao, depth, entity_render,
+					ent, 1);
+			continue;
+		}
+
+		/* There are only ever a few renderables, the last one is most
+		 * likely to come up again */
+		for (k = num_kinds - 1; k >= 0 && kind[k] != obj; k--)
+			;
+		if (k < 0)
+		{
+			k = num_kinds++;
+			kind[k] = obj;
+			first[k + 1] = 0;
+		}
+		which[i] = k;
+		first[k + 1]++;
+	}
+
+	for (k = 0; k < num_kinds; k++)
+	{
+		first[k + 1] += first[k];
+		next[k] = first[k];
+	}
+	for (i = 0; i < n; i++)
+		if (which[i] >= 0)
+			instance_set(&instance[next[which[i]]++], &scene->entity[i]);
+
+	for (k = 0; k < num_kinds; k++)
+	{
+		int count = first[k + 1] - first[k];
+
+		instances_upload(kind[k], &instance[first[k]], count);
+		render_queue_push(queue, RENDER_PASS_OPAQUE,
+				kind[k]->shader->program, kind[k]->vao, 0,
+				instances_render, kind[k], count);
+	}
+
+	render_queue_submit(queue);
 }
@@ -6,7 +6,7 @@
 #include "mesh.h"
 #include "shader.h"
 #include "camera.h"
-#include "solarsystem.h"
+#include "renderqueue.h"
 
 
 typedef struct Light {
@@ -23,14 +23,19 @@ typedef struct Renderable {
 
 	void (*upload_to_gpu)(struct Renderable *o);
 	void (*render)(struct Renderable *o);
+	/* Draws count copies, NULL if the renderable can't be instanced */
+	void (*render_instanced)(struct Renderable *o, int count);
 
 	enum {MEMLOC_RAM, MEMLOC_GPU} memloc;
+	GLuint instance_vbo; /* Streamed transforms, 0 if drawn one by one */
+	/* Reach of the geometry from its origin before the entity's radius
+	 * scales it, set on upload */
+	double bound;
 
 	void *data;
 } Renderable;
 
 typedef struct Entity {
-	struct Entity *prev, *next;
 	Vec3 position;
 	Quaternion orientation;
 	double radius;
@@ -38,8 +43,35 @@ typedef struct Entity {
 	Renderable *renderable;
 } Entity;
 
-void render_entity_list(Entity *ent);
-void light_upload_to_gpu(void *light, Shader *shader);
+/* Frustum culling over the last render_entity_list() */
+typedef struct CullStats {
+	int tested, culled, drawn;
+} CullStats;
+
+/* The entities to draw, in one array that is kept from frame to frame and
+ * updated in place */
+typedef struct Scene {
+	int num_entities, max_entities;
+	Entity *entity;
+
+	RenderQueue *queue;
+	CullStats cull;
+
+	/* Scratch space for render_entity_list() */
+	int scratch_size;
+	Renderable **kind;
+	int *which, *first, *next;
+	unsigned char *visible;
+	struct Instance *instance;
+} Scene;
+
+Scene *scene_new(void *ctx);
+int scene_add(Scene *scene, Renderable *renderable, Vec3 position,
+		Quaternion orientation, double radius);
+void scene_update_positions(Scene *scene, const Vec3 *position);
+
+void render_entity_list(Scene *scene);
+void frame_upload_to_gpu(const Light *light);
 
 void renderable_upload_to_gpu(Renderable *obj);
 void mesh_upload_to_gpu(Renderable *obj);
@@ -47,5 +79,7 @@ void point_upload_to_gpu(Renderable *obj);
 void renderable_render(Renderable *ent);
 void mesh_render(Renderable *obj);
 void point_render(Renderable *obj);
+void mesh_render_instanced(Renderable *obj, int count);
+void point_render_instanced(Renderable *obj, int count);
 
 #endif
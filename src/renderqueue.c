@@ -0,0 +1,174 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <GL/glew.h>
+#include <GL/gl.h>
+#include <ralloc.h>
+
+#include "renderqueue.h"
+#include "mathlib.h"
+#include "log.h"
+
+#define MIN_PACKETS 64
+
+/* Bits of the key, the pass on top. Program and VAO names wider than their
+ * field wrap around, which costs at most an extra bind, as the submission
+ * compares the names themselves. */
+#define PASS_SHIFT    60
+#define PROGRAM_SHIFT 48
+#define PROGRAM_MASK  0xfffu
+#define VAO_SHIFT     32
+#define VAO_MASK      0xffffu
+
+RenderQueue *render_queue_new(void *ctx)
+{
+	RenderQueue *queue = rzalloc(ctx, RenderQueue);
+
+	if (queue == NULL)
+		log_err("Out of memory\n");
+
+	return queue;
+}
+
+bool render_queue_reserve(RenderQueue *queue, int num_packets)
+{
+	int max = MAX(MIN_PACKETS, queue->max_packets);
+	DrawPacket *packet, *sorted;
+
+	if (num_packets <= queue->max_packets)
+		return true;
+	while (max < num_packets)
+		max *= 2;
+
+	packet = reralloc(queue, queue->packet, DrawPacket, max);
+	if (packet != NULL)
+		queue->packet = packet;
+	sorted = reralloc(queue, queue->sorted, DrawPacket, max);
+	if (sorted != NULL)
+		queue->sorted = sorted;
+	if (packet == NULL || sorted == NULL)
+	{
+		log_err("Out of memory\n");
+		return false;
+	}
+	queue->max_packets = max;
+
+	return true;
+}
+
+/* A positive float's bits sort like the float itself */
+static uint32_t depth_bits(float depth)
+{
+	uint32_t bits;
+
+	if (!(depth > 0))
+		return 0;
+	memcpy(&bits, &depth, sizeof(bits));
+
+	return bits;
+}
+
+bool render_queue_push(RenderQueue *queue, RenderPass pass, GLuint program,
+		GLuint vao, float depth, DrawFunc draw, void *data, int count)
+{
+	DrawPacket *packet;
+	uint32_t z = depth_bits(depth);
+
+	if (!render_queue_reserve(queue, queue->num_packets + 1))
+		return false;
+
+	if (pass == RENDER_PASS_TRANSPARENT)
+		z = ~z;
+
+	packet = &queue->packet[queue->num_packets++];
+	packet->key = (uint64_t) pass << PASS_SHIFT |
+			(uint64_t) (program & PROGRAM_MASK) << PROGRAM_SHIFT |
+			(uint64_t) (vao & VAO_MASK) << VAO_SHIFT | z;
+	packet->program = program;
+	packet->vao = vao;
+	packet->draw = draw;
+	packet->data = data;
+	packet->count = count;
+
+	return true;
+}
+
+/* Least significant digit first radix sort, a byte at a time. Bytes that
+ * are the same in every key, like the pass usually is, are skipped.
+ * Stable, so packets with equal keys are drawn in the order pushed. */
+static void sort_packets(RenderQueue *queue)
+{
+	unsigned count[8][256];
+	DrawPacket *from = queue->packet, *to = queue->sorted, *swap;
+	int i, digit, n = queue->num_packets;
+
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < n; i++)
+		for (digit = 0; digit < 8; digit++)
+			count[digit][(from[i].key >> 8*digit) & 0xff]++;
+
+	for (digit = 0; digit < 8; digit++)
+	{
+		unsigned *c = count[digit], sum = 0, tmp;
+		int shift = 8*digit, b;
+
+		if (c[(from[0].key >> shift) & 0xff] == (unsigned) n)
+			continue;
+
+		for (b = 0; b < 256; b++)
+		{
+			tmp = c[b];
+			c[b] = sum;
+			sum += tmp;
+		}
+		for (i = 0; i < n; i++)
+			to[c[(from[i].key >> shift) & 0xff]++] = from[i];
+
+		swap = from;
+		from = to;
+		to = swap;
+	}
+
+	queue->packet = from;
+	queue->sorted = to;
+}
+
+void render_queue_submit(RenderQueue *queue)
+{
+	RenderStats *stats = &queue->stats;
+	GLuint program = 0, vao = 0;
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->packets = queue->num_packets;
+	if (queue->num_packets == 0)
+		return;
+
+	sort_packets(queue);
+
+	for (i = 0; i < queue->num_packets; i++)
+	{
+		DrawPacket *packet = &queue->packet[i];
+
+		if (packet->program != program)
+		{
+			program = packet->program;
+			glUseProgram(program);
+			stats->program_binds++;
+		} else
+			stats->redundant_binds++;
+
+		if (packet->vao != vao)
+		{
+			vao = packet->vao;
+			glBindVertexArray(vao);
+			stats->vao_binds++;
+		} else
+			stats->redundant_binds++;
+
+		packet->draw(packet->data, packet->count);
+	}
+	glBindVertexArray(0);
+
+	queue->num_packets = 0;
+}
@@ -0,0 +1,50 @@
+#ifndef KOSMOS_RENDERQUEUE_H
+#define KOSMOS_RENDERQUEUE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <GL/gl.h>
+
+/* Draw calls collected over a frame, sorted on a 64-bit key so that those
+ * sharing a shader and then a VAO come together, and submitted binding
+ * only what changes from one to the next. From the top bit down the key
+ * holds the pass, the program, the VAO and the depth. */
+
+typedef enum RenderPass {
+	RENDER_PASS_OPAQUE, /* Front to back */
+	RENDER_PASS_TRANSPARENT, /* Back to front */
+	RENDER_PASS_OVERLAY,
+	NUM_RENDER_PASSES
+} RenderPass;
+
+/* Called with the program and VAO of its packet bound */
+typedef void (*DrawFunc)(void *data, int count);
+
+typedef struct DrawPacket {
+	uint64_t key;
+	GLuint program, vao;
+	DrawFunc draw;
+	void *data;
+	int count;
+} DrawPacket;
+
+/* Counts over the last render_queue_submit() */
+typedef struct RenderStats {
+	int packets;
+	int program_binds, vao_binds;
+	int redundant_binds; /* Binds skipped as the state was already set */
+} RenderStats;
+
+typedef struct RenderQueue {
+	int num_packets, max_packets;
+	DrawPacket *packet, *sorted;
+	RenderStats stats;
+} RenderQueue;
+
+RenderQueue *render_queue_new(void *ctx);
+bool render_queue_reserve(RenderQueue *queue, int num_packets);
+bool render_queue_push(RenderQueue *queue, RenderPass pass, GLuint program,
+		GLuint vao, float depth, DrawFunc draw, void *data, int count);
+void render_queue_submit(RenderQueue *queue);
+
+#endif
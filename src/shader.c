@@ -26,6 +26,7 @@ void shader_delete(Shader *shader)
 Shader *shader_create(const char *vertex_file, const char *fragment_file)
 {
 	GLint link_status;
+	GLuint frame;
 	Shader *shader = NULL;
 
 	/* 0 is a sane default for both shaders and the program */
@@ -81,6 +82,19 @@ Shader *shader_create(const char *vertex_file, const char *fragment_file)
 	shader->location[SHADER_UNI_P_MATRIX] =
 			glGetUniformLocation(shader->program, "uProj");
 
+	/* Per-instance transforms, only in shaders for instanced drawing */
+	shader->location[SHADER_ATT_INSTANCE_POSITION] =
+			glGetAttribLocation(shader->program, "aInstancePosition");
+	shader->location[SHADER_ATT_INSTANCE_ORIENTATION] =
+			glGetAttribLocation(shader->program, "aInstanceOrientation");
+	shader->location[SHADER_UNI_TEXTURE] =
+			glGetUniformLocation(shader->program, "uTexture");
+
+	/* The 3D shaders get their matrices and light from a buffer that's
+	 * updated once per frame, the 2D ones have uniforms of their own */
+	frame = glGetUniformBlockIndex(shader->program, "Frame");
+	if (frame != GL_INVALID_INDEX)
+		glUniformBlockBinding(shader->program, frame, SHADER_FRAME_BINDING);
 
 	return shader;
 
@@ -8,7 +8,7 @@ typedef struct {
 	GLuint vertex_shader;
 	GLuint fragment_shader;
 
-	GLint location[7];
+	GLint location[10];
 } Shader;
 
 #define SHADER_ATT_POSITION 0
@@ -18,6 +18,13 @@ typedef struct {
 #define SHADER_UNI_M_MATRIX 4
 #define SHADER_UNI_V_MATRIX 5
 #define SHADER_UNI_P_MATRIX 6
+#define SHADER_ATT_INSTANCE_POSITION    7
+#define SHADER_ATT_INSTANCE_ORIENTATION 8
+#define SHADER_UNI_TEXTURE  9
+
+/* Where the Frame uniform block of the 3D shaders, with the projection and
+ * view matrices and the light, is bound */
+#define SHADER_FRAME_BINDING 0
 
 
 Shader *shader_create(const char *vertex_source, const char *fragment_source);
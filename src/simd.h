@@ -0,0 +1,178 @@
+#ifndef KOSMOS_SIMD_H
+#define KOSMOS_SIMD_H
+
+/* A thin layer over the widest double precision vector unit the compiler
+ * has been told about. Kernels are written once against vdouble and get
+ * AVX, SSE2 or plain scalar code depending on the -m flags. */
+
+#if defined(__AVX2__) || defined(__AVX__)
+#include <immintrin.h>
+
+#define SIMD_WIDTH 4
+typedef __m256d vdouble;
+typedef __m256d vmask;
+
+static inline vdouble vd_load(const double *p) { return _mm256_loadu_pd(p); }
+static inline void vd_store(double *p, vdouble a) { _mm256_storeu_pd(p, a); }
+static inline vdouble vd_set(double a) { return _mm256_set1_pd(a); }
+static inline vdouble vd_add(vdouble a, vdouble b) { return _mm256_add_pd(a, b); }
+static inline vdouble vd_sub(vdouble a, vdouble b) { return _mm256_sub_pd(a, b); }
+static inline vdouble vd_mul(vdouble a, vdouble b) { return _mm256_mul_pd(a, b); }
+static inline vdouble vd_div(vdouble a, vdouble b) { return _mm256_div_pd(a, b); }
+static inline vdouble vd_sqrt(vdouble a) { return _mm256_sqrt_pd(a); }
+static inline vdouble vd_min(vdouble a, vdouble b) { return _mm256_min_pd(a, b); }
+static inline vdouble vd_max(vdouble a, vdouble b) { return _mm256_max_pd(a, b); }
+static inline vdouble vd_round(vdouble a)
+{
+	return _mm256_round_pd(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+}
+static inline vmask vd_lt(vdouble a, vdouble b) { return _mm256_cmp_pd(a, b, _CMP_LT_OQ); }
+static inline vmask vd_eq(vdouble a, vdouble b) { return _mm256_cmp_pd(a, b, _CMP_EQ_OQ); }
+static inline vmask vm_or(vmask a, vmask b) { return _mm256_or_pd(a, b); }
+static inline int vm_any(vmask m) { return _mm256_movemask_pd(m) != 0; }
+/* m ? a : b, lane by lane */
+static inline vdouble vd_select(vmask m, vdouble a, vdouble b)
+{
+	return _mm256_blendv_pd(b, a, m);
+}
+static inline vdouble vd_abs(vdouble a)
+{
+	return _mm256_andnot_pd(_mm256_set1_pd(-0.0), a);
+}
+
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+
+#define SIMD_WIDTH 2
+typedef __m128d vdouble;
+typedef __m128d vmask;
+
+static inline vdouble vd_load(const double *p) { return _mm_loadu_pd(p); }
+static inline void vd_store(double *p, vdouble a) { _mm_storeu_pd(p, a); }
+static inline vdouble vd_set(double a) { return _mm_set1_pd(a); }
+static inline vdouble vd_add(vdouble a, vdouble b) { return _mm_add_pd(a, b); }
+static inline vdouble vd_sub(vdouble a, vdouble b) { return _mm_sub_pd(a, b); }
+static inline vdouble vd_mul(vdouble a, vdouble b) { return _mm_mul_pd(a, b); }
+static inline vdouble vd_div(vdouble a, vdouble b) { return _mm_div_pd(a, b); }
+static inline vdouble vd_sqrt(vdouble a) { return _mm_sqrt_pd(a); }
+static inline vdouble vd_min(vdouble a, vdouble b) { return _mm_min_pd(a, b); }
+static inline vdouble vd_max(vdouble a, vdouble b) { return _mm_max_pd(a, b); }
+/* SSE2 has no rounding instruction. Adding and subtracting 1.5*2^52 pushes
+ * the fraction out of the mantissa, which is good for |a| < 2^51 */
+static inline vdouble vd_round(vdouble a)
+{
+	const __m128d magic = _mm_set1_pd(6755399441055744.0);
+	return _mm_sub_pd(_mm_add_pd(a, magic), magic);
+}
+static inline vmask vd_lt(vdouble a, vdouble b) { return _mm_cmplt_pd(a, b); }
+static inline vmask vd_eq(vdouble a, vdouble b) { return _mm_cmpeq_pd(a, b); }
+static inline vmask vm_or(vmask a, vmask b) { return _mm_or_pd(a, b); }
+static inline int vm_any(vmask m) { return _mm_movemask_pd(m) != 0; }
+static inline vdouble vd_select(vmask m, vdouble a, vdouble b)
+{
+	return _mm_or_pd(_mm_and_pd(m, a), _mm_andnot_pd(m, b));
+}
+static inline vdouble vd_abs(vdouble a)
+{
+	return _mm_andnot_pd(_mm_set1_pd(-0.0), a);
+}
+
+#else
+#include <math.h>
+
+#define SIMD_WIDTH 1
+typedef double vdouble;
+typedef int vmask;
+
+static inline vdouble vd_load(const double *p) { return *p; }
+static inline void vd_store(double *p, vdouble a) { *p = a; }
+static inline vdouble vd_set(double a) { return a; }
+static inline vdouble vd_add(vdouble a, vdouble b) { return a + b; }
+static inline vdouble vd_sub(vdouble a, vdouble b) { return a - b; }
+static inline vdouble vd_mul(vdouble a, vdouble b) { return a * b; }
+static inline vdouble vd_div(vdouble a, vdouble b) { return a / b; }
+static inline vdouble vd_sqrt(vdouble a) { return sqrt(a); }
+static inline vdouble vd_min(vdouble a, vdouble b) { return a < b ? a : b; }
+static inline vdouble vd_max(vdouble a, vdouble b) { return a > b ? a : b; }
+static inline vdouble vd_round(vdouble a) { return nearbyint(a); }
+static inline vmask vd_lt(vdouble a, vdouble b) { return a < b; }
+static inline vmask vd_eq(vdouble a, vdouble b) { return a == b; }
+static inline vmask vm_or(vmask a, vmask b) { return a || b; }
+static inline int vm_any(vmask m) { return m; }
+static inline vdouble vd_select(vmask m, vdouble a, vdouble b)
+{
+	return m ? a : b;
+}
+static inline vdouble vd_abs(vdouble a) { return fabs(a); }
+
+#endif
+
+static inline vdouble vd_neg(vdouble a) { return vd_sub(vd_set(0.0), a); }
+
+/* Sum of all lanes */
+static inline double vd_hsum(vdouble a)
+{
+	double lane[SIMD_WIDTH], sum = 0;
+	int i;
+
+	vd_store(lane, a);
+	for (i = 0; i < SIMD_WIDTH; i++)
+		sum += lane[i];
+
+	return sum;
+}
+
+/* Sine and cosine of the same argument, accurate to a few ulp for
+ * |x| < 2^20. The argument is reduced to [-pi/4, pi/4] with a three-part
+ * Cody-Waite split of pi/2, after which the fdlibm kernels take over. */
+static inline void vd_sincos(vdouble x, vdouble *s, vdouble *c)
+{
+#if SIMD_WIDTH == 1
+	/* The C library does at least as well without vector units */
+	*s = sin(x);
+	*c = cos(x);
+#else
+	const vdouble one = vd_set(1.0);
+	vdouble q, r, z, sr, cr, n, quarter, sn, cn;
+	vmask odd, sin_neg, cos_neg;
+
+	q = vd_round(vd_mul(x, vd_set(0.636619772367581343076)));
+	r = vd_sub(x, vd_mul(q, vd_set(1.57079632673412561417e+00)));
+	r = vd_sub(r, vd_mul(q, vd_set(6.07710050630396597660e-11)));
+	r = vd_sub(r, vd_mul(q, vd_set(2.02226624879595063154e-21)));
+	z = vd_mul(r, r);
+
+	sr = vd_set(1.58969099521155010221e-10);
+	sr = vd_add(vd_mul(sr, z), vd_set(-2.50507602534068634195e-08));
+	sr = vd_add(vd_mul(sr, z), vd_set(2.75573137070700676789e-06));
+	sr = vd_add(vd_mul(sr, z), vd_set(-1.98412698298579493134e-04));
+	sr = vd_add(vd_mul(sr, z), vd_set(8.33333333332248946124e-03));
+	sr = vd_add(vd_mul(sr, z), vd_set(-1.66666666666666324348e-01));
+	sr = vd_add(r, vd_mul(vd_mul(r, z), sr));
+
+	cr = vd_set(-1.13596475577881948265e-11);
+	cr = vd_add(vd_mul(cr, z), vd_set(2.08757232129817482790e-09));
+	cr = vd_add(vd_mul(cr, z), vd_set(-2.75573143513906633035e-07));
+	cr = vd_add(vd_mul(cr, z), vd_set(2.48015872894767294178e-05));
+	cr = vd_add(vd_mul(cr, z), vd_set(-1.38888888888741095749e-03));
+	cr = vd_add(vd_mul(cr, z), vd_set(4.16666666666666019037e-02));
+	cr = vd_add(vd_sub(one, vd_mul(vd_set(0.5), z)), vd_mul(vd_mul(z, z), cr));
+
+	/* n = q mod 4, picks the quadrant */
+	quarter = vd_round(vd_mul(q, vd_set(0.25)));
+	quarter = vd_select(vd_lt(vd_mul(q, vd_set(0.25)), quarter),
+			vd_sub(quarter, one), quarter);
+	n = vd_sub(q, vd_mul(quarter, vd_set(4.0)));
+
+	odd = vm_or(vd_eq(n, one), vd_eq(n, vd_set(3.0)));
+	sin_neg = vd_lt(vd_set(1.5), n);
+	cos_neg = vm_or(vd_eq(n, one), vd_eq(n, vd_set(2.0)));
+
+	sn = vd_select(odd, cr, sr);
+	cn = vd_select(odd, sr, cr);
+	*s = vd_select(sin_neg, vd_neg(sn), sn);
+	*c = vd_select(cos_neg, vd_neg(cn), cn);
+#endif
+}
+
+#endif
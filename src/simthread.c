@@ -0,0 +1,258 @@
+#define _POSIX_C_SOURCE 200112L
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <ralloc.h>
+
+#include "log.h"
+#include "simthread.h"
+
+#define FRESH 4 /* Flags a slot the reader hasn't seen yet */
+
+typedef struct Snapshot {
+	double t; /* Simulated time */
+	double wall; /* Wall time the tick was due */
+	unsigned long performed, skipped; /* Kepler solves so far, see TimeLod */
+	Vec3 *position;
+} Snapshot;
+
+struct SimThread {
+	SolarSystem *solsys;
+	double step; /* Simulated seconds per tick */
+	double period; /* Wall seconds per tick */
+	pthread_t thread;
+	bool started;
+
+	/* Where the renderer looks from, for the time level of detail, and
+	 * whether the thread should stop */
+	pthread_mutex_t view_lock;
+	bool view_changed;
+	Vec3 eye;
+	double min_angle;
+	bool quit;
+
+	/* The triple buffer. The writer fills slot back while the reader
+	 * looks at slot front. Finished slots are swapped with the one in
+	 * middle, which is the only index both threads touch. The lock is
+	 * only ever held for the swap, so neither side waits on the other
+	 * copying positions. */
+	Snapshot slot[3];
+	int back, middle, front;
+	pthread_mutex_t swap_lock;
+
+	Snapshot previous; /* The reader's front before its last swap */
+
+	/* The positions of all four snapshots. They can't be children of the
+	 * SimThread: ralloc frees those before the destructor has stopped the
+	 * thread writing to them. */
+	Vec3 storage[];
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static void sleep_until(double wall)
+{
+	struct timespec ts;
+
+	ts.tv_sec = (time_t) wall;
+	ts.tv_nsec = (long) ((wall - ts.tv_sec) * 1e9);
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+			EINTR)
+		;
+}
+
+/* Put slot in the middle, and return the one that was there */
+static int swap_middle(SimThread *sim, int slot)
+{
+	int old;
+
+	pthread_mutex_lock(&sim->swap_lock);
+	old = sim->middle;
+	sim->middle = slot;
+	pthread_mutex_unlock(&sim->swap_lock);
+
+	return old;
+}
+
+/* Copy the positions into the back slot and swap it into the middle */
+static void publish(SimThread *sim, double t, double wall)
+{
+	Snapshot *s = &sim->slot[sim->back];
+	int i;
+
+	s->t = t;
+	s->wall = wall;
+	if (sim->solsys->lod != NULL)
+	{
+		s->performed = sim->solsys->lod->performed;
+		s->skipped = sim->solsys->lod->skipped;
+	}
+	for (i = 0; i < sim->solsys->num_bodies; i++)
+		s->position[i] = sim->solsys->body[i].position;
+
+	sim->back = swap_middle(sim, sim->back | FRESH) & ~FRESH;
+}
+
+static void *sim_main(void *arg)
+{
+	SimThread *sim = arg;
+	double t = sim->slot[sim->front].t;
+	double next = sim->slot[sim->front].wall + sim->period;
+
+	for (;;)
+	{
+		double late;
+		bool quit;
+
+		sleep_until(next);
+
+		pthread_mutex_lock(&sim->view_lock);
+		quit = sim->quit;
+		if (sim->view_changed && !quit)
+			solsys_set_lod(sim->solsys, sim->eye, sim->min_angle);
+		sim->view_changed = false;
+		pthread_mutex_unlock(&sim->view_lock);
+		if (quit)
+			break;
+
+		t += sim->step;
+		solsys_update(sim->solsys, t);
+		publish(sim, t, next);
+
+		/* Rather than racing to catch up after a slow tick, drop the
+		 * ticks that were missed. Simulated time falls behind. */
+		next += sim->period;
+		if ((late = now() - next) > 0)
+			next += sim->period * (long) (late / sim->period + 1);
+	}
+
+	return NULL;
+}
+
+static void simthread_destroy(void *ptr)
+{
+	SimThread *sim = ptr;
+
+	if (sim->started)
+	{
+		pthread_mutex_lock(&sim->view_lock);
+		sim->quit = true;
+		pthread_mutex_unlock(&sim->view_lock);
+		pthread_join(sim->thread, NULL);
+	}
+	pthread_mutex_destroy(&sim->view_lock);
+	pthread_mutex_destroy(&sim->swap_lock);
+}
+
+/* Start propagating solsys from time t, advancing step seconds rate times a
+ * second. The thread is stopped when the SimThread is freed. */
+SimThread *simthread_create(void *ctx, SolarSystem *solsys, double t,
+		double step, double rate)
+{
+	SimThread *sim;
+	int i, n = solsys->num_bodies;
+
+	sim = rzalloc_size(ctx, sizeof(SimThread) + 4 * n * sizeof(Vec3));
+	if (sim == NULL)
+		return NULL;
+	sim->solsys = solsys;
+	sim->step = step;
+	sim->period = 1 / rate;
+	pthread_mutex_init(&sim->view_lock, NULL);
+	pthread_mutex_init(&sim->swap_lock, NULL);
+	for (i = 0; i < 3; i++)
+		sim->slot[i].position = &sim->storage[i * n];
+	sim->previous.position = &sim->storage[3 * n];
+
+	/* The first state goes straight to the reader */
+	sim->front = 0;
+	sim->middle = 1;
+	sim->back = 2;
+	solsys_update(solsys, t);
+	for (i = 0; i < n; i++)
+		sim->slot[0].position[i] = solsys->body[i].position;
+	sim->slot[0].t = t;
+	sim->slot[0].wall = now();
+	sim->previous.t = t;
+	sim->previous.wall = sim->slot[0].wall;
+	memcpy(sim->previous.position, sim->slot[0].position, n * sizeof(Vec3));
+
+	ralloc_set_destructor(sim, simthread_destroy);
+	if (pthread_create(&sim->thread, NULL, sim_main, sim) != 0)
+	{
+		log_err("Couldn't start the simulation thread\n");
+		ralloc_free(sim);
+		return NULL;
+	}
+	sim->started = true;
+
+	return sim;
+}
+
+/* Positions as of one tick ago, interpolated between the last two states
+ * that came in. Returns the simulated time they're for. Only to be called
+ * from one thread. */
+double simthread_positions(SimThread *sim, Vec3 *position)
+{
+	const Snapshot *cur, *prev = &sim->previous;
+	double wall = now() - sim->period, alpha;
+	int i, n = sim->solsys->num_bodies;
+	bool fresh;
+
+	/* Only the writer sets FRESH, so it stays until the swap below */
+	pthread_mutex_lock(&sim->swap_lock);
+	fresh = sim->middle & FRESH;
+	pthread_mutex_unlock(&sim->swap_lock);
+
+	if (fresh)
+	{
+		cur = &sim->slot[sim->front];
+		sim->previous.t = cur->t;
+		sim->previous.wall = cur->wall;
+		memcpy(sim->previous.position, cur->position, n * sizeof(Vec3));
+		sim->front = swap_middle(sim, sim->front) & ~FRESH;
+	}
+	cur = &sim->slot[sim->front];
+
+	if (cur->wall > prev->wall)
+		alpha = (wall - prev->wall) / (cur->wall - prev->wall);
+	else
+		alpha = 1;
+	alpha = MAX(0, MIN(1, alpha));
+
+	for (i = 0; i < n; i++)
+		position[i] = vec3_lerp(cur->position[i], prev->position[i],
+				alpha);
+
+	return prev->t + alpha * (cur->t - prev->t);
+}
+
+/* Skip solving for bodies that wouldn't visibly move, as seen from eye. See
+ * solsys_set_lod(), which runs on the simulation thread before its next
+ * tick. */
+void simthread_set_lod(SimThread *sim, Vec3 eye, double min_angle)
+{
+	pthread_mutex_lock(&sim->view_lock);
+	sim->eye = eye;
+	sim->min_angle = min_angle;
+	sim->view_changed = true;
+	pthread_mutex_unlock(&sim->view_lock);
+}
+
+/* The number of Kepler solves done and skipped up to the positions last
+ * returned by simthread_positions() */
+void simthread_lod_counts(const SimThread *sim, unsigned long *performed,
+		unsigned long *skipped)
+{
+	*performed = sim->slot[sim->front].performed;
+	*skipped = sim->slot[sim->front].skipped;
+}
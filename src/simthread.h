@@ -0,0 +1,22 @@
+#ifndef KOSMOS_SIMTHREAD_H
+#define KOSMOS_SIMTHREAD_H
+
+#include "mathlib.h"
+#include "solarsystem.h"
+
+/* Propagates a solar system on a thread of its own, at a fixed number of
+ * ticks per second of wall time. Every tick the positions are published
+ * through a lock-free triple buffer, from which the renderer takes the
+ * latest two and interpolates between them. Once the thread is running it
+ * owns the solar system's positions; read them through here instead. */
+
+typedef struct SimThread SimThread;
+
+SimThread *simthread_create(void *ctx, SolarSystem *solsys, double t,
+		double step, double rate);
+double simthread_positions(SimThread *sim, Vec3 *position);
+void simthread_set_lod(SimThread *sim, Vec3 eye, double min_angle);
+void simthread_lod_counts(const SimThread *sim, unsigned long *performed,
+		unsigned long *skipped);
+
+#endif
@@ -1,398 +1,920 @@
-#include <errno.h>
+#include <limits.h>
 #include <math.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <allegro5/allegro.h>
+#include <string.h>
 #include <ralloc.h>
 
+#include "ini.h"
 #include "log.h"
 #include "solarsystem.h"
-
-static const char *get_next_config_section(ALLEGRO_CONFIG *cfg,
-		ALLEGRO_CONFIG_SECTION **section)
+#include "solcache.h"
+
+#define UPDATE_CHUNK 1024 /* Bodies per work item of solsys_update() */
+
+/* The numbers in a body's section, and where they go */
+static const struct {
+	const char *key;
+	size_t offset; /* Into Body */
+} body_keys[] = {
+	{"Mass", offsetof(Body, mass)},
+	{"Gravitational parameter", offsetof(Body, grav_param)},
+	{"Radius", offsetof(Body, radius)},
+	{"Ecc", offsetof(Body, orbit.Ecc)},
+	{"SMa", offsetof(Body, orbit.SMa)},
+	{"Inc", offsetof(Body, orbit.Inc)},
+	{"LAN", offsetof(Body, orbit.LAN)},
+	{"APe", offsetof(Body, orbit.APe)},
+	{"MnA", offsetof(Body, orbit.MnA)}
+};
+#define NUM_BODY_KEYS (sizeof(body_keys)/sizeof(body_keys[0]))
+#define KEY_MASS (1 << 0)
+#define KEY_GRAV_PARAM (1 << 1)
+#define KEY_RADIUS (1 << 2)
+#define KEYS_ORBIT (0x3f << 3)
+
+/* Start a body from its section name. Full names are of the form
+ * "Primary/Name"; we search backwards to allow for things like
+ * "Sol/Earth/Moon". The name is copied to *names, the name of the primary
+ * is left pointing into the file. */
+static bool begin_body(Body *body, IniString section, char **names,
+		IniString *primary)
 {
-	if (*section == NULL)
-		return al_get_first_config_section(cfg, section);
-	else
-		return al_get_next_config_section(section);
-}
+	const char *end = section.str + section.len, *name = end, *c;
 
-#if 0
-static bool config_get_long(ALLEGRO_CONFIG *cfg, const char *sec,
-		const char *key, long *ret)
-{
-	int saved_errno;
-	const char *value;
-	char *endptr;
+	while (name > section.str && name[-1] != '/')
+		name--;
 
-	value = al_get_config_value(cfg, sec, key);
-	if (value == NULL)
+	if (name == end || name == section.str + 1)
 	{
-		log_err("Section %s: Key %s not found\n", sec, key);
+		/* No name, eg: "Sol/", or no primary name, eg: "/Earth" */
+		log_err("Malformed name: %.*s\n", (int) section.len, section.str);
 		return false;
 	}
-	if (value[0] == '\0')
+
+	if (name == section.str)
 	{
-		log_err("Section %s: Key %s empty\n", sec, key);
-		return false;
+		/* This is a body without a primary */
+		*primary = (IniString) {NULL, 0};
+	} else
+	{
+		for (c = name - 1; c > section.str && c[-1] != '/'; c--);
+		*primary = (IniString) {c, name - 1 - c};
 	}
 
-	saved_errno = errno;
-	errno = 0;
-	*ret = strtol(value, &endptr, 10);
-	if (errno != 0)
+	body->name = *names;
+	memcpy(*names, name, end - name);
+	(*names)[end - name] = '\0';
+	*names += end - name + 1;
+
+	return true;
+}
+
+/* Set key to value in a body's section. Unknown keys are skipped. */
+static bool set_body_key(Body *body, IniString section, IniString key,
+		IniString value, unsigned *seen, IniString *type)
+{
+	unsigned i;
+
+	if (ini_equal(key, "Type"))
 	{
-		log_err("Section %s: Key %s invalid: %s\n", sec, key,
-				strerror(errno));
-		return false;
+		*type = value;
+		return true;
 	}
-	errno = saved_errno;
 
-	if (*endptr != '\0')
+	for (i = 0; i < NUM_BODY_KEYS; i++)
 	{
-		log_err("Section %s: Key %s invalid\n", sec, key);
-		return false;
+		if (!ini_equal(key, body_keys[i].key))
+			continue;
+
+		if (value.len == 0)
+		{
+			log_err("Section %.*s: Key %s empty\n", (int) section.len,
+					section.str, body_keys[i].key);
+			return false;
+		}
+		if (!ini_parse_double(value, (double *) ((char *) body +
+				body_keys[i].offset)))
+		{
+			log_err("Section %.*s: Key %s invalid: %.*s\n",
+					(int) section.len, section.str, body_keys[i].key,
+					(int) value.len, value.str);
+			return false;
+		}
+		*seen |= 1u << i;
+		break;
+	}
+
+	return true;
+}
+
+/* Check a body's section had everything it needs and fill in defaults */
+static bool end_body(Body *body, IniString section, unsigned seen,
+		IniString type, bool has_primary)
+{
+	unsigned required = KEY_MASS | KEY_RADIUS | (has_primary ? KEYS_ORBIT : 0);
+	unsigned i;
+
+	for (i = 0; i < NUM_BODY_KEYS; i++)
+	{
+		if ((required & ~seen) & (1u << i))
+		{
+			log_err("Section %.*s: Key %s not found\n",
+					(int) section.len, section.str, body_keys[i].key);
+			return false;
+		}
 	}
-	if (endptr == value)
+
+	if (!(seen & KEY_GRAV_PARAM))
+		body->grav_param = GRAV_CONST * body->mass;
+
+	/* Figure out what kind of object it is */
+	if (type.len == 0)
+		body->type = (has_primary ? BODY_PLANET : BODY_STAR);
+	else if (ini_equal(type, "Star"))
+		body->type = BODY_STAR;
+	else if (ini_equal(type, "Planet") || ini_equal(type, "Moon"))
+		body->type = BODY_PLANET;
+	else if (ini_equal(type, "Comet"))
+		body->type = BODY_COMET;
+	else
 	{
-		log_err("Section %s: Key %s empty\n", sec, key);
+		log_err("Unknown type: %.*s\n", (int) type.len, type.str);
 		return false;
 	}
 
+	body->orbit.epoch = 0;
+	body->primary = NULL; /* Filled in once all bodies are known */
 
 	return true;
 }
-#endif
 
-static bool config_get_double(ALLEGRO_CONFIG *cfg, const char *sec,
-		const char *key, double *ret, bool optional)
+/* FNV-1a over the first len characters of name */
+static unsigned long hash_name(const char *name, size_t len)
+{
+	unsigned long h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ (unsigned char) name[i]) * 16777619u;
+
+	return h;
+}
+
+/* Linear probing keeps bodies with the same name in the order of the file,
+ * so a short name finds the first body that has it */
+static bool build_index(SolarSystem *solsys)
 {
-	int saved_errno;
-	const char *value;
-	char *endptr;
+	int i, size = 16;
 
-	value = al_get_config_value(cfg, sec, key);
-	if (value == NULL)
+	while (size < 2*solsys->num_bodies)
+		size *= 2;
+
+	ralloc_free(solsys->index);
+	solsys->index = ralloc_array(solsys, int, size);
+	if (solsys->index == NULL)
 	{
-		if (!optional)
-			log_err("Section %s: Key %s not found\n", sec, key);
+		log_err("Out of memory\n");
+		solsys->index_size = 0;
 		return false;
 	}
+	solsys->index_size = size;
+
+	for (i = 0; i < size; i++)
+		solsys->index[i] = -1;
 
-	saved_errno = errno;
-	errno = 0;
-	*ret = strtod(value, &endptr);
-	if (errno != 0)
+	for (i = 0; i < solsys->num_bodies; i++)
 	{
-		if (!optional)
-			log_err("Section %s: Key %s invalid: %s\n", sec, key, 
-					strerror(errno));
-		return false;
+		const char *name = solsys->body[i].name;
+		unsigned long h = hash_name(name, strlen(name)) & (size - 1);
+
+		while (solsys->index[h] >= 0)
+			h = (h + 1) & (size - 1);
+		solsys->index[h] = i;
 	}
-	errno = saved_errno;
 
-	if (*endptr != '\0')
+	return true;
+}
+
+/* Do the components of path before end name body's primaries, innermost
+ * first? The path doesn't have to go all the way up to an independent
+ * body. */
+static bool match_primaries(const Body *body, const char *path,
+		const char *end)
+{
+	while (end > path)
 	{
-		if (!optional)
-			log_err("Section %s: Key %s invalid\n", sec, key);
-		return false;
+		const char *start = end - 1;
+		size_t len;
+
+		/* end points at the '/' after the component */
+		while (start > path && start[-1] != '/')
+			start--;
+		len = end - 1 - start;
+
+		body = body->primary;
+		if (body == NULL || strncmp(body->name, start, len) != 0 ||
+				body->name[len] != '\0')
+			return false;
+		end = start;
 	}
-	if (endptr == value)
+
+	return true;
+}
+
+/* solsys_find_body() for a path of length path_len */
+static Body *find_body(SolarSystem *solsys, const char *path,
+		size_t path_len)
+{
+	const char *name = path + path_len;
+	unsigned long h;
+	size_t len;
+
+	if (solsys->index == NULL && !build_index(solsys))
+		return NULL;
+
+	while (name > path && name[-1] != '/')
+		name--;
+	len = path + path_len - name;
+
+	for (h = hash_name(name, len) & (solsys->index_size - 1);
+			solsys->index[h] >= 0; h = (h + 1) & (solsys->index_size - 1))
 	{
-		if (!optional)
-			log_err("Section %s: Key %s empty\n", sec, key);
-		return false;
+		Body *body = &solsys->body[solsys->index[h]];
+
+		if (strncmp(body->name, name, len) == 0 && body->name[len] == '\0' &&
+				match_primaries(body, path, name))
+			return body;
 	}
 
-	return true;
+	return NULL;
 }
 
-static bool config_get_string(ALLEGRO_CONFIG *cfg, const char *sec,
-		const char *key, char **ret, bool optional)
+/* Find a body by its name, or by a path of names like "Sol/Earth/Moon" or
+ * "Earth/Moon" when a name alone is ambiguous. Returns NULL if there's no
+ * such body. */
+Body *solsys_find_body(SolarSystem *solsys, const char *path)
 {
-	const char *value;
+	return find_body(solsys, path, strlen(path));
+}
 
-	*ret = NULL;
-	value = al_get_config_value(cfg, sec, key);
-	if (value == NULL)
+/* Breadth-first from the independent bodies, which puts every primary
+ * before its satellites and keeps bodies at the same depth together */
+static bool sort_bodies(SolarSystem *solsys)
+{
+	int head, tail = 0, i;
+	int *depth;
+
+	solsys->order = ralloc_array(solsys, int, solsys->num_bodies);
+	solsys->order_primary = ralloc_array(solsys, int, solsys->num_bodies);
+	depth = ralloc_array(solsys, int, solsys->num_bodies);
+	if (solsys->order == NULL || solsys->order_primary == NULL ||
+			depth == NULL)
 	{
-		if (!optional)
-			log_err("Error in section %s: Key %s not found\n", sec, key);
+		log_err("Out of memory\n");
 		return false;
 	}
-	if (value[0] == '\0')
+
+	for (i = 0; i < solsys->num_bodies; i++)
+	{
+		if (solsys->body[i].primary == NULL)
+		{
+			solsys->order[tail] = i;
+			solsys->order_primary[tail] = -1;
+			depth[tail] = 0;
+			tail++;
+		}
+	}
+
+	for (head = 0; head < tail; head++)
 	{
-		if (!optional)
-			log_err("Error in section %s: Key %s empty\n", sec, key);
+		int index = solsys->order[head];
+		Body *body = &solsys->body[index];
+
+		for (i = 0; i < body->num_satellites; i++)
+		{
+			solsys->order[tail] = body->satellite[i] - solsys->body;
+			solsys->order_primary[tail] = index;
+			depth[tail] = depth[head] + 1;
+			tail++;
+		}
+	}
+
+	if (tail < solsys->num_bodies)
+	{
+		log_err("%d bodies don't orbit an independent body\n",
+				solsys->num_bodies - tail);
+		ralloc_free(depth);
 		return false;
 	}
 
-	*ret = ralloc_strdup(NULL, value);
-	if (*ret == NULL)
+	solsys->num_levels = (tail > 0 ? depth[tail - 1] + 1 : 0);
+	solsys->level = ralloc_array(solsys, int, solsys->num_levels + 1);
+	if (solsys->level == NULL)
 	{
 		log_err("Out of memory\n");
+		ralloc_free(depth);
 		return false;
 	}
+	solsys->level[0] = 0;
+	for (i = 1; i < tail; i++)
+		if (depth[i] != depth[i - 1])
+			solsys->level[depth[i]] = i;
+	solsys->level[solsys->num_levels] = tail;
 
+	ralloc_free(depth);
 	return true;
 }
 
-static bool load_body(ALLEGRO_CONFIG *cfg, const char *fullname,
-		Body *body, char **primary_name)
+/* An empty solar system, to be filled in and then passed through
+ * solsys_connect(). Free it with ralloc_free(). */
+SolarSystem *solsys_create(int num_bodies)
 {
-	const char *name;
-	char *type;
+	SolarSystem *solsys;
+	int i;
 
-	/* Just checking */
-	if (al_get_first_config_entry(cfg, fullname, NULL) == NULL)
+	solsys = rzalloc_size(NULL, sizeof(SolarSystem) + num_bodies*sizeof(Body));
+	if (solsys == NULL)
+		return NULL;
+
+	solsys->num_bodies = num_bodies;
+	for (i = 0; i < num_bodies; i++)
+		solsys->body[i].ctx = solsys;
+
+	return solsys;
+}
+
+/* Once every body has its primary set, build the satellite lists, derive
+ * the orbits and sort the hierarchy */
+bool solsys_connect(SolarSystem *solsys)
+{
+	Body **satellites;
+	int i, num_satellites = 0;
+
+	for (i = 0; i < solsys->num_bodies; i++)
 	{
-		log_err("Section %s not in file\n", fullname);
-		return false;
+		solsys->body[i].num_satellites = 0;
+		solsys->body[i].satellite = NULL;
+	}
+	for (i = 0; i < solsys->num_bodies; i++)
+	{
+		if (solsys->body[i].primary != NULL)
+		{
+			solsys->body[i].primary->num_satellites++;
+			num_satellites++;
+		}
 	}
 
-	/* Fill in some common parameters */
-	if (!config_get_double(cfg, fullname, "Mass", &body->mass, false))
+	/* All satellite lists share one array */
+	satellites = ralloc_array(solsys, Body *, MAX(num_satellites, 1));
+	if (satellites == NULL)
+	{
+		log_err("Out of memory\n");
 		return false;
+	}
+	for (i = 0; i < solsys->num_bodies; i++)
+	{
+		Body *body = &solsys->body[i];
+
+		body->satellite = satellites;
+		satellites += body->num_satellites;
+		body->num_satellites = 0;
+	}
 
-	if (!config_get_double(cfg, fullname, "Gravitational parameter",
-			&body->grav_param, true))
+	for (i = 0; i < solsys->num_bodies; i++)
 	{
-		body->grav_param = GRAV_CONST * body->mass;
+		Body *body = &solsys->body[i];
+
+		if (body->primary == NULL)
+			continue;
+
+		body->primary->satellite[body->primary->num_satellites++] = body;
+		kepler_orbit_init(&body->orbit, body->primary->grav_param);
 	}
 
-	if (!config_get_double(cfg, fullname, "Radius", &body->radius, false))
-		return false;
+	return sort_bodies(solsys);
+}
 
-	/* Figure out what kind of object it is */
-	config_get_string(cfg, fullname, "Type", &type, true);
-	if (type == NULL)
-		body->type = BODY_UNKNOWN;
-	else if (strcmp(type, "Star") == 0)
-		body->type = BODY_STAR;
-	else if (strcmp(type, "Planet") == 0)
-		body->type = BODY_PLANET;
-	else if (strcmp(type, "Moon") == 0)
-		body->type = BODY_PLANET;
-	else if (strcmp(type, "Comet") == 0)
-		body->type = BODY_COMET;
-	else
+/* Read the bodies straight into the system as the sections go by, then
+ * connect them up */
+static SolarSystem *load_from_ini(const char *filename)
+{
+	SolarSystem *solsys;
+	IniFile *ini;
+	IniString name, value, section = {NULL, 0}, type = {NULL, 0};
+	IniString *primary_name;
+	IniToken token;
+	Body *body = NULL;
+	char *names;
+	size_t name_bytes;
+	unsigned seen = 0;
+	long max_bodies;
+	int i, num_bodies = 0;
+
+	ini = ini_open(NULL, filename);
+	if (ini == NULL)
+		return NULL;
+
+	max_bodies = ini_count_sections(ini, &name_bytes);
+	if (max_bodies == 0 || max_bodies > INT_MAX)
 	{
-		log_err("Unknown type: %s\n", type);
-		ralloc_free(type);
-		return false;
+		log_err("No bodies in %s\n", filename);
+		ralloc_free(ini);
+		return NULL;
 	}
-	ralloc_free(type);
 
-	/* Does it have a primary or not? 
-	 * Full names are of the form of "Primary/Name"
-	 * We search backwards to allow for things like "Sol/Earth/Moon" */
-	if ((name = strrchr(fullname, '/')) == NULL)
+	solsys = solsys_create(max_bodies);
+	if (solsys == NULL)
 	{
-		/* This is a body without a primary */
-		body->name = ralloc_strdup(body->ctx, fullname);
-		body->type = (body->type == BODY_UNKNOWN ? BODY_STAR : body->type);
-		body->primary = NULL;
-		*primary_name = NULL;
-	} else if (name == fullname) /* No primary name, eg: sec = "/Earth" */
+		log_err("Out of memory\n");
+		ralloc_free(ini);
+		return NULL;
+	}
+	ralloc_steal(solsys, ini);
+	primary_name = ralloc_array(solsys, IniString, max_bodies);
+	names = ralloc_size(solsys, name_bytes);
+	if (primary_name == NULL || names == NULL)
 	{
-		log_err("Malformed name: %s", fullname);
-		return false;
-	} else
+		log_err("Out of memory\n");
+		goto errorout;
+	}
+
+	while ((token = ini_next(ini, &name, &value)) != INI_END)
 	{
-		const char *c;
-		for (c = name - 1; c >= fullname && *c != '/'; c--);
-		c++;
+		if (token == INI_ERROR)
+			goto errorout;
 
-		body->name = ralloc_strdup(body->ctx, name + 1);
-		body->type = (body->type == BODY_UNKNOWN ? BODY_PLANET : body->type);
-		body->primary = NULL; /* Fill in later */
-		*primary_name = ralloc_strndup(body->ctx, c, name - c);
+		if (token == INI_SECTION)
+		{
+			if (body != NULL && !end_body(body, section, seen, type,
+					primary_name[num_bodies - 1].str != NULL))
+				goto errorout;
+
+			/* Keys outside of named sections belong to nobody */
+			body = NULL;
+			if (name.len == 0)
+				continue;
+
+			body = &solsys->body[num_bodies];
+			section = name;
+			seen = 0;
+			type = (IniString) {NULL, 0};
+			if (!begin_body(body, section, &names,
+					&primary_name[num_bodies]))
+				goto errorout;
+			num_bodies++;
+		} else if (body != NULL && !set_body_key(body, section, name, value,
+				&seen, &type))
+		{
+			goto errorout;
+		}
+	}
+	if (body != NULL && !end_body(body, section, seen, type,
+			primary_name[num_bodies - 1].str != NULL))
+		goto errorout;
+
+	if (num_bodies == 0)
+	{
+		log_err("No bodies in %s\n", filename);
+		goto errorout;
+	}
+	solsys->num_bodies = num_bodies;
+
+	/* Find the primary of each satellite body */
+	if (!build_index(solsys))
+		goto errorout;
+	for (i = 0; i < num_bodies; i++)
+	{
+		if (primary_name[i].str == NULL) /* Independent body */
+			continue;
+
+		/* Primaries haven't been found yet, so only the name counts */
+		body = &solsys->body[i];
+		body->primary = find_body(solsys, primary_name[i].str,
+				primary_name[i].len);
+		if (body->primary == NULL)
+		{
+			log_err("Couldn't find %s's primary: %.*s\n", body->name,
+					(int) primary_name[i].len, primary_name[i].str);
+			goto errorout;
+		}
+	}
+
+	ralloc_free(primary_name);
+	ralloc_free(ini);
+
+	/* Connect each satellite body to its primary */
+	if (!solsys_connect(solsys))
+		goto errorout;
+
+	log_dbg("Loaded a solarsystem with %d bodies\n", solsys->num_bodies);
+	return solsys;
+
+errorout:
+	log_err("Couldn't load solarsystem from file: %s\n", filename);
+	ralloc_free(solsys);
+	return NULL;
+}
+
+/* Load a solar system from an .ini file, or from the compiled cache next to
+ * it (filename.cache) if that is still up to date. A stale or missing cache
+ * is rewritten after loading the .ini. */
+SolarSystem *solsys_load(const char *filename)
+{
+	SolarSystem *ret;
+	CacheStamp stamp;
+	char *cachename;
+
+	cachename = ralloc_asprintf(NULL, "%s.cache", filename);
+	if (cachename == NULL)
+	{
+		log_err("Out of memory\n");
+		return NULL;
+	}
+
+	ret = solsys_load_cache(cachename, filename);
+	if (ret == NULL)
+	{
+		/* Stamped before parsing, in case it's edited in the meantime */
+		bool stamped = solsys_stamp_source(filename, &stamp);
+
+		ret = load_from_ini(filename);
+		/* Not being able to write the cache only costs time */
+		if (ret != NULL && (!stamped ||
+				!solsys_save_cache(ret, cachename, filename, &stamp)))
+			log_dbg("Couldn't cache %s\n", filename);
 	}
 
-	body->num_satellites = 0;
-	body->satellite = NULL;
+	ralloc_free(cachename);
+	return ret;
+}
 
-	/* Bodies without primaries can't orbit another body */
-	if (*primary_name == NULL)
+/* Update with num_threads threads, or serially if it is 1 or less */
+bool solsys_set_threads(SolarSystem *solsys, int num_threads)
+{
+	ralloc_free(solsys->pool);
+	solsys->pool = NULL;
+
+	if (num_threads <= 1)
 		return true;
 
-	if (!config_get_double(cfg, fullname, "Ecc", &body->orbit.Ecc, false) ||
-	    !config_get_double(cfg, fullname, "SMa", &body->orbit.SMa, false) ||
-	    !config_get_double(cfg, fullname, "Inc", &body->orbit.Inc, false) ||
-	    !config_get_double(cfg, fullname, "LAN", &body->orbit.LAN, false) ||
-	    !config_get_double(cfg, fullname, "APe", &body->orbit.APe, false) ||
-	    !config_get_double(cfg, fullname, "MnA", &body->orbit.MnA, false))
+	solsys->pool = workpool_create(solsys, num_threads);
+	if (solsys->pool == NULL)
 	{
-		log_err("Couldn't load orbital elements of %s\n", fullname);
+		log_err("Couldn't create a pool of %d threads\n", num_threads);
 		return false;
 	}
 
 	return true;
 }
 
-static SolarSystem *load_from_config(ALLEGRO_CONFIG *cfg)
+/* Integrate the mutual gravitation of all bodies from time t on, in steps
+ * of at most max_step seconds (INFINITY for no limit), starting from where
+ * their orbits put them. NBODY_OFF puts the bodies back on their orbits. */
+bool solsys_set_nbody(SolarSystem *solsys, NBodyMethod method, double t,
+		double max_step)
 {
-	SolarSystem *solsys;
-	char **primary_names;
-	const char *name;
-	long num_bodies;
-	ALLEGRO_CONFIG_SECTION *sec;
-	int i;
+	NBody *nbody;
+	Vec3 *velocity;
+	double total_mu = 0;
+	Vec3 momentum = {0, 0, 0};
+	int i, k;
 
-	/* First pass: Determine the number of bodies in the file */
-	num_bodies = 0;
-	sec = NULL;
-	while ((name = get_next_config_section(cfg, &sec)) != NULL)
+	if (method != NBODY_OFF && !(max_step > 0))
 	{
-		if (name[0] != '\0')
-			num_bodies++;
+		log_err("Invalid N-body step: %g s\n", max_step);
+		return false;
 	}
 
-	if (num_bodies == 0)
-		return NULL; /* Empty solarsystem */
+	if (method == NBODY_OFF)
+	{
+		ralloc_free(solsys->nbody);
+		solsys->nbody = NULL;
+		return true;
+	}
 
-	solsys = ralloc_size(NULL, sizeof(SolarSystem) + num_bodies*sizeof(Body));
-	if (solsys == NULL)
-		return NULL;
-	solsys->num_bodies = num_bodies;
-	primary_names = ralloc_array(solsys, char *, num_bodies);
-	if (primary_names == NULL)
+	/* The old integrator stays until the new one is ready, so running out
+	 * of memory doesn't quietly drop back to Kepler orbits */
+	nbody = nbody_create(solsys, solsys->num_bodies, method);
+	if (nbody == NULL)
 	{
-		ralloc_free(solsys);
-		return NULL;
+		log_err("Out of memory\n");
+		return false;
+	}
+	velocity = ralloc_array(nbody, Vec3, solsys->num_bodies);
+	if (velocity == NULL)
+	{
+		log_err("Out of memory\n");
+		ralloc_free(nbody);
+		return false;
 	}
 
-	/* Second pass: Load all celestial bodies */
-	i = 0;
-	sec = NULL;
-	while ((name = get_next_config_section(cfg, &sec)) != NULL && i < num_bodies)
+	/* Kepler positions and velocities, primaries first */
+	for (k = 0; k < solsys->num_bodies; k++)
 	{
-		if (name[0] == '\0')
-			continue;
+		Body *body = &solsys->body[solsys->order[k]];
+		KeplerOrbit *orbit = &body->orbit;
+		int primary = solsys->order_primary[k];
+		Vec3 p, v;
 
-		solsys->body[i].ctx = solsys;
-		if (!load_body(cfg, name, &solsys->body[i], &primary_names[i]))
+		i = solsys->order[k];
+		if (primary < 0)
 		{
-			log_err("Couldn't load body %s\n", name);
-			ralloc_free(solsys);
-			return NULL;
+			body->position = (Vec3) {0, 0, 0};
+			velocity[i] = (Vec3) {0, 0, 0};
+			continue;
 		}
-		i++;
+
+		kepler_state_at_time(orbit, t, &p, &v);
+		body->position = vec3_add(solsys->body[primary].position, p);
+		velocity[i] = vec3_add(velocity[primary], v);
 	}
 
-	if (i < num_bodies)
-		log_err("Internal consistency error\n");
+	for (i = 0; i < solsys->num_bodies; i++)
+	{
+		total_mu += solsys->body[i].grav_param;
+		momentum = vec3_add(momentum,
+				vec3_scale(velocity[i], solsys->body[i].grav_param));
+	}
 
-	/* Third pass: Connect each satellite body to its primary */
-	for (i = 0; i < num_bodies; i++)
+	/* Without this the whole system would drift away from the root */
+	momentum = vec3_scale(momentum, total_mu > 0 ? 1 / total_mu : 0);
+	for (i = 0; i < solsys->num_bodies; i++)
 	{
 		Body *body = &solsys->body[i];
-		char *primary_name = primary_names[i];
-		if (primary_name == NULL) /* Independent body */
-			continue;
 
-		/* Look for the primary */
-		body->primary = NULL;
-		for (int j = 0; j < num_bodies; j++)
-		{
-			Body *body2 = &solsys->body[j];
-			if (strcmp(primary_name, body2->name) == 0)
-			{
-				body->primary = body2;
-				break;
-			}
-		}
-		if (body->primary == NULL)
-		{
-			log_err("Couldn't find %s's primary: %s\n", body->name,
-					primary_name);
-			ralloc_free(solsys);
-			return NULL;
-		}
-		ralloc_free(primary_name);
-		primary_name = NULL; /* Won't ever be used again */
+		nbody->x[i] = body->position.x;
+		nbody->y[i] = body->position.y;
+		nbody->z[i] = body->position.z;
+		nbody->vx[i] = velocity[i].x - momentum.x;
+		nbody->vy[i] = velocity[i].y - momentum.y;
+		nbody->vz[i] = velocity[i].z - momentum.z;
+		nbody->mu[i] = body->grav_param;
+	}
+	ralloc_free(velocity);
+
+	nbody->t = t;
+	nbody->max_step = max_step;
+	ralloc_free(solsys->nbody);
+	solsys->nbody = nbody;
+
+	return true;
+}
 
-		body->primary->num_satellites++;
-		body->primary->satellite = reralloc(solsys, body->primary->satellite,
-				Body *, body->primary->num_satellites);
-		if (body->primary->satellite == NULL)
+/* Only solve for bodies again once they could have moved min_angle radians
+ * as seen from eye, going by their fastest orbital speed. In between they
+ * keep their last offset from their primary, so they still follow it
+ * around. Call it again whenever the eye moves; a min_angle of 0 turns it
+ * off. Has no effect in N-body mode. */
+bool solsys_set_lod(SolarSystem *solsys, Vec3 eye, double min_angle)
+{
+	TimeLod *lod = solsys->lod;
+	int i, n = solsys->num_bodies;
+
+	if (min_angle <= 0)
+	{
+		ralloc_free(lod);
+		solsys->lod = NULL;
+		return true;
+	}
+
+	if (lod == NULL)
+	{
+		lod = rzalloc(solsys, TimeLod);
+		if (lod == NULL)
+			return false;
+		lod->max_speed = ralloc_array(lod, double, n);
+		lod->time = ralloc_array(lod, double, n);
+		lod->offset = ralloc_array(lod, Vec3, n);
+		lod->velocity = rzalloc_array(lod, Vec3, n);
+		lod->chunk_performed = rzalloc_array(lod, unsigned long,
+				n / UPDATE_CHUNK + 1);
+		lod->chunk_skipped = rzalloc_array(lod, unsigned long,
+				n / UPDATE_CHUNK + 1);
+		if (lod->max_speed == NULL || lod->time == NULL ||
+				lod->offset == NULL || lod->velocity == NULL ||
+				lod->chunk_performed == NULL || lod->chunk_skipped == NULL)
 		{
 			log_err("Out of memory\n");
-			ralloc_free(solsys);
-			return NULL;
+			ralloc_free(lod);
+			return false;
 		}
-		body->primary->satellite[body->primary->num_satellites - 1] = body;
 
-		body->orbit.epoch = 0;
-		body->orbit.period = M_TWO_PI *
-				sqrt(CUBE(body->orbit.SMa) / body->primary->grav_param);
-		body->orbit.plane_orientation = quat_euler(RAD(body->orbit.LAN),
-				RAD(body->orbit.Inc),
-				RAD(body->orbit.APe));
+		/* Every orbit is fastest at periapsis. A held moon is off by
+		 * its own error plus that of its planet, so each level below
+		 * the root gets an equal share of min_angle, which comes down
+		 * to overstating the speed. */
+		for (i = 0; i < n; i++)
+		{
+			Body *body = &solsys->body[solsys->order[i]];
+			double speed = 0;
+
+			if (body->primary != NULL)
+				speed = vec3_length(kepler_velocity_at_E(&body->orbit, 0));
+			lod->max_speed[i] = speed * (solsys->num_levels - 1);
+			lod->time[i] = NAN; /* Not solved yet */
+		}
+		solsys->lod = lod;
 	}
 
-	ralloc_free(primary_names);
-	return solsys;
+	lod->eye = eye;
+	lod->min_angle = min_angle;
+
+	return true;
 }
 
-SolarSystem *solsys_load(const char *filename)
+/* Positions are kept relative to the first independent body, as they are
+ * for Kepler orbits */
+static void update_nbody(SolarSystem *solsys, double t)
 {
-	SolarSystem *ret;
-	ALLEGRO_FILE *file;
-	ALLEGRO_CONFIG *cfg;
+	NBody *nbody = solsys->nbody;
+	int i, root = solsys->order[0];
+
+	nbody->pool = solsys->pool;
+	nbody_advance(nbody, t);
 
-	file = al_fopen(filename, "rb");
-	if (file == NULL)
+	for (i = 0; i < solsys->num_bodies; i++)
 	{
-		log_err("Error opening file %s\n", filename);
-		return NULL;
+		solsys->body[i].position.x = nbody->x[i] - nbody->x[root];
+		solsys->body[i].position.y = nbody->y[i] - nbody->y[root];
+		solsys->body[i].position.z = nbody->z[i] - nbody->z[root];
 	}
 
-	cfg = al_load_config_file_f(file);
-	if (cfg == NULL)
+	if (!solsys->velocities)
+		return;
+	for (i = 0; i < solsys->num_bodies; i++)
 	{
-		al_fclose(file);
-		log_err("Not a valid config file\n");
-		return NULL;
+		solsys->body[i].velocity.x = nbody->vx[i] - nbody->vx[root];
+		solsys->body[i].velocity.y = nbody->vy[i] - nbody->vy[root];
+		solsys->body[i].velocity.z = nbody->vz[i] - nbody->vz[root];
 	}
+}
 
-	ret = load_from_config(cfg);
+/* Whether the body at i in update order, last seen at position, can't have
+ * moved far enough to see since it was last solved. A NaN time never
+ * compares less. */
+static bool lod_hold(const TimeLod *lod, int i, Vec3 position, double t)
+{
+	Vec3 d = vec3_sub(position, lod->eye);
 
-	if (ret == NULL)
-		log_err("Couldn't load solarsystem from file: %s\n", filename);
-	else
-		log_dbg("Loaded a solarsystem with %d bodies\n", ret->num_bodies);
+	return SQUARE(lod->max_speed[i] * (t - lod->time[i])) <
+			SQUARE(lod->min_angle) * vec3_dot(d, d);
+}
 
-	al_destroy_config(cfg);
-	al_fclose(file);
+typedef struct UpdateJob {
+	SolarSystem *solsys;
+	double t;
+	int offset; /* Start of the level in solsys->order */
+} UpdateJob;
 
-	return ret;
+static void update_bodies(void *data, int begin, int end)
+{
+	UpdateJob *job = data;
+	SolarSystem *solsys = job->solsys;
+	TimeLod *lod = solsys->lod;
+	unsigned long performed = 0, skipped = 0;
+	int i;
+
+	for (i = job->offset + begin; i < job->offset + end; i++)
+	{
+		Body *body = &solsys->body[solsys->order[i]];
+		int primary = solsys->order_primary[i];
+		Body *parent;
+		Vec3 p, v;
+
+		if (primary < 0)
+		{
+			body->position = (Vec3) {0, 0, 0};
+			body->velocity = (Vec3) {0, 0, 0};
+			continue;
+		}
+		parent = &solsys->body[primary];
+
+		if (lod != NULL && lod_hold(lod, i, body->position, job->t))
+		{
+			body->position = vec3_add(parent->position, lod->offset[i]);
+			if (solsys->velocities)
+				body->velocity = vec3_add(parent->velocity,
+						lod->velocity[i]);
+			skipped++;
+			continue;
+		}
+
+		/* The velocity comes almost for free from the same solve */
+		if (solsys->velocities && solsys->incremental)
+			kepler_state_at_time_warm(&body->orbit, job->t, &p, &v, NULL);
+		else if (solsys->velocities)
+			kepler_state_at_time(&body->orbit, job->t, &p, &v);
+		else if (solsys->incremental)
+			p = kepler_position_at_time_warm(&body->orbit, job->t, NULL);
+		else
+			p = kepler_position_at_time(&body->orbit, job->t);
+		body->position = vec3_add(parent->position, p);
+		if (solsys->velocities)
+			body->velocity = vec3_add(parent->velocity, v);
+
+		if (lod != NULL)
+		{
+			lod->time[i] = job->t;
+			lod->offset[i] = p;
+			if (solsys->velocities)
+				lod->velocity[i] = v;
+			performed++;
+		}
+	}
+
+	if (lod != NULL)
+	{
+		lod->chunk_performed[begin / UPDATE_CHUNK] = performed;
+		lod->chunk_skipped[begin / UPDATE_CHUNK] = skipped;
+	}
 }
 
-static void update_satellites(Body *body, double t)
+void solsys_update(SolarSystem *solsys, double t)
 {
-	for (int i = 0; i < body->num_satellites; i++)
+	TimeLod *lod = solsys->lod;
+	UpdateJob job = {solsys, t, 0};
+	int d, c;
+
+	if (solsys->nbody != NULL)
 	{
-		Vec3 v = kepler_position_at_time(&body->satellite[i]->orbit, t);
-		body->satellite[i]->position = vec3_add(body->position, v);
-		update_satellites(body->satellite[i], t);
+		update_nbody(solsys, t);
+		return;
 	}
 
-	return;
+	/* Satellites need the position of their primary, so one level has to
+	 * be finished before the next one can start */
+	for (d = 0; d < solsys->num_levels; d++)
+	{
+		int count = solsys->level[d + 1] - solsys->level[d];
+
+		job.offset = solsys->level[d];
+		workpool_run(solsys->pool, update_bodies, &job, count,
+				UPDATE_CHUNK);
+
+		/* Without a pool the whole level counts as the first item, and
+		 * the rest are still zero */
+		for (c = 0; lod != NULL && c <= (count - 1) / UPDATE_CHUNK; c++)
+		{
+			lod->performed += lod->chunk_performed[c];
+			lod->skipped += lod->chunk_skipped[c];
+			lod->chunk_performed[c] = lod->chunk_skipped[c] = 0;
+		}
+	}
 }
 
-void solsys_update(SolarSystem *solsys, double t)
+/* Position, and velocity if asked for, of body i relative to the root at
+ * time t. Solves every orbit up the chain of primaries from scratch, so
+ * that threads can share them and nothing in solsys changes. */
+void solsys_state_at_time(SolarSystem *solsys, int i, double t,
+		Vec3 *position, Vec3 *velocity)
 {
-	int i;
+	Body *body = &solsys->body[i];
 
-	for (i = 0; i < solsys->num_bodies; i++)
+	*position = (Vec3) {0, 0, 0};
+	if (velocity != NULL)
+		*velocity = (Vec3) {0, 0, 0};
+	for (; body->primary != NULL; body = body->primary)
 	{
-		if (solsys->body[i].primary == NULL)
+		Vec3 p, v;
+
+		if (velocity == NULL)
 		{
-			solsys->body[i].position = (Vec3) {0, 0, 0};
-			update_satellites(&solsys->body[i], t);
+			*position = vec3_add(*position,
+					kepler_position_at_time(&body->orbit, t));
+			continue;
 		}
+		kepler_state_at_time(&body->orbit, t, &p, &v);
+		*position = vec3_add(*position, p);
+		*velocity = vec3_add(*velocity, v);
 	}
 }
 
+/* A bound on the speed of each body relative to the root, by body index.
+ * Every orbit is fastest at periapsis, and a satellite is at most that
+ * much faster than its primary. Returns NULL when out of memory. */
+double *solsys_max_speeds(void *ctx, SolarSystem *solsys)
+{
+	double *max_speed;
+	int i, k;
+
+	max_speed = ralloc_array(ctx, double, solsys->num_bodies);
+	if (max_speed == NULL)
+		return NULL;
+
+	for (k = 0; k < solsys->num_bodies; k++)
+	{
+		Body *body = &solsys->body[solsys->order[k]];
+		int primary = solsys->order_primary[k];
+
+		i = solsys->order[k];
+		max_speed[i] = 0;
+		if (primary >= 0)
+			max_speed[i] = max_speed[primary] +
+					vec3_length(kepler_velocity_at_E(&body->orbit, 0));
+	}
+
+	return max_speed;
+}
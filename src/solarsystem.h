@@ -1,8 +1,11 @@
 #ifndef KOSMOS_SOLARSYSTEM_H
 #define KOSMOS_SOLARSYSTEM_H
 
+#include <stdbool.h>
 #include "mathlib.h"
 #include "keplerorbit.h"
+#include "nbody.h"
+#include "workpool.h"
 
 typedef struct Body {
 	void *ctx; /* Memory allocation context */
@@ -12,6 +15,7 @@ typedef struct Body {
 	double radius; /* Equatorial radius */
 
 	Vec3 position; /* Take care to update this before you use it */
+	Vec3 velocity; /* Only updated with SolarSystem.velocities set */
 
 	enum { BODY_STAR, BODY_PLANET, BODY_COMET, BODY_UNKNOWN } type;
 
@@ -21,12 +25,67 @@ typedef struct Body {
 	struct Body **satellite;
 } Body;
 
+/* For searches along the orbits: samples per orbit that see every minimum
+ * or crossing of a distance apart, and how closely its time is found */
+#define SOLSYS_SAMPLES_PER_ORBIT 32
+#define SOLSYS_TIME_TOLERANCE 1e-3 /* Seconds */
+
+/* Time level of detail, see solsys_set_lod() */
+typedef struct TimeLod {
+	Vec3 eye;
+	double min_angle; /* In radians */
+
+	/* By body in update order, see SolarSystem.order */
+	double *max_speed; /* Bound on each body's speed around its primary */
+	double *time; /* When each body was last solved */
+	Vec3 *offset; /* ...and where that put it relative to its primary */
+	Vec3 *velocity; /* ...and how fast it was going, if asked for */
+	unsigned long performed, skipped; /* Solves done and saved */
+	/* The same for each work item of one level of an update, added to
+	 * the totals once the level is done so no two threads share one */
+	unsigned long *chunk_performed, *chunk_skipped;
+} TimeLod;
+
 typedef struct SolarSystem {
+	bool incremental; /* Warm start each solve from the previous update */
+	bool velocities; /* Have solsys_update() set Body.velocity as well */
 	int num_bodies;
+
+	/* Body indices in update order, every primary before its satellites,
+	 * and the index of each one's primary (-1 if there is none). The body
+	 * array itself stays in the order of the file, since its indices are
+	 * what the scene, the events, the approaches and the cache refer to,
+	 * so only these and the TimeLod arrays are walked in order. */
+	int *order;
+	int *order_primary;
+	/* Bodies at depth d are order[level[d]] up to order[level[d + 1]] */
+	int num_levels;
+	int *level;
+
+	WorkPool *pool; /* Optional, for updating in parallel */
+	NBody *nbody; /* Set by solsys_set_nbody(), NULL for Kepler orbits */
+	TimeLod *lod; /* Set by solsys_set_lod(), NULL to solve every body */
+
+	/* Open addressing hash of body indices by name, -1 marks an empty
+	 * slot. The .ini loader builds it to find primaries, otherwise
+	 * solsys_find_body() builds it the first time it's needed. */
+	int index_size;
+	int *index;
+
 	Body body[];
 } SolarSystem;
 
+SolarSystem *solsys_create(int num_bodies);
+bool solsys_connect(SolarSystem *solsys);
 SolarSystem *solsys_load(const char *filename);
+bool solsys_set_threads(SolarSystem *solsys, int num_threads);
+bool solsys_set_nbody(SolarSystem *solsys, NBodyMethod method, double t,
+		double max_step);
+bool solsys_set_lod(SolarSystem *solsys, Vec3 eye, double min_angle);
+Body *solsys_find_body(SolarSystem *solsys, const char *path);
 void solsys_update(SolarSystem *solsys, double time);
+void solsys_state_at_time(SolarSystem *solsys, int i, double t,
+		Vec3 *position, Vec3 *velocity);
+double *solsys_max_speeds(void *ctx, SolarSystem *solsys);
 
 #endif
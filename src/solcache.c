@@ -0,0 +1,390 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <ralloc.h>
+
+#include "log.h"
+#include "solcache.h"
+
+#define CACHE_MAGIC "KOSSYS1"
+#define CACHE_BYTE_ORDER 0x01020304u
+
+typedef struct CacheHeader {
+	char magic[8];
+	uint32_t byte_order;
+	uint32_t record_size; /* sizeof(CacheBody), changes with KeplerOrbit */
+
+	/* The source as it was when the cache was written */
+	int64_t source_size;
+	int64_t source_mtime_sec, source_mtime_nsec;
+
+	int32_t num_bodies;
+	int32_t num_satellites;
+	int32_t num_levels;
+	int32_t int_size; /* The index arrays are plain ints */
+	uint64_t strings_size;
+} CacheHeader;
+
+/* Followed by int satellite[num_satellites], int order[num_bodies],
+ * int order_primary[num_bodies], int level[num_levels + 1] and the
+ * names, each terminated by a null character */
+typedef struct CacheBody {
+	uint64_t name; /* Offset into the names */
+	int32_t primary; /* -1 for independent bodies */
+	int32_t type;
+	int32_t first_satellite; /* Into satellite[] */
+	int32_t num_satellites;
+	double mass;
+	double grav_param;
+	double radius;
+	KeplerOrbit orbit; /* Including everything kepler_orbit_init() derived */
+} CacheBody;
+
+typedef struct CacheMap {
+	void *data;
+	size_t size;
+} CacheMap;
+
+/* Take it before reading the source, so that a cache never claims to be
+ * of a newer version than it is */
+bool solsys_stamp_source(const char *source, CacheStamp *stamp)
+{
+	struct stat st;
+
+	if (stat(source, &st) < 0)
+		return false;
+
+	stamp->size = st.st_size;
+	stamp->mtime_sec = st.st_mtim.tv_sec;
+	stamp->mtime_nsec = st.st_mtim.tv_nsec;
+
+	return true;
+}
+
+static bool same_stamp(const CacheStamp *a, const CacheStamp *b)
+{
+	return a->size == b->size && a->mtime_sec == b->mtime_sec &&
+			a->mtime_nsec == b->mtime_nsec;
+}
+
+static void cache_unmap(void *ptr)
+{
+	CacheMap *map = ptr;
+
+	munmap(map->data, map->size);
+}
+
+/* Check the cache is for this build and this version of the source, and
+ * that its arrays fit in size bytes. Returns the offset of the names. */
+static size_t cache_check(const CacheHeader *header, size_t size,
+		const char *filename, const char *source)
+{
+	CacheStamp stamp, cached;
+	uint64_t n, ints, end;
+
+	if (size < sizeof(*header) ||
+			memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+			header->byte_order != CACHE_BYTE_ORDER ||
+			header->record_size != sizeof(CacheBody) ||
+			header->int_size != sizeof(int))
+	{
+		log_dbg("%s isn't a cache written by this build\n", filename);
+		return 0;
+	}
+
+	cached.size = header->source_size;
+	cached.mtime_sec = header->source_mtime_sec;
+	cached.mtime_nsec = header->source_mtime_nsec;
+	if (!solsys_stamp_source(source, &stamp) || !same_stamp(&stamp, &cached))
+	{
+		log_dbg("%s is out of date\n", filename);
+		return 0;
+	}
+
+	if (header->num_bodies <= 0 || header->num_satellites < 0 ||
+			header->num_levels < 0 || header->num_levels > header->num_bodies)
+	{
+		log_err("Cache %s is corrupt\n", filename);
+		return 0;
+	}
+
+	n = header->num_bodies;
+	ints = header->num_satellites + 2*n + header->num_levels + 1;
+	end = sizeof(*header) + n*sizeof(CacheBody) + ints*sizeof(int);
+	if (size < end || size - end < header->strings_size ||
+			header->strings_size == 0 ||
+			((const char *) header)[size - 1] != '\0')
+	{
+		log_err("Cache %s is truncated\n", filename);
+		return 0;
+	}
+
+	return end;
+}
+
+/* Check every index in the cache points into the array it is for, and
+ * that the levels cover the update order from start to end */
+static bool cache_check_indices(const CacheHeader *header)
+{
+	const CacheBody *rec = (const CacheBody *) (header + 1);
+	const int *satellite = (const int *) (rec + header->num_bodies);
+	const int *order = satellite + header->num_satellites;
+	const int *order_primary = order + header->num_bodies;
+	const int *level = order_primary + header->num_bodies;
+	int i, n = header->num_bodies;
+
+	for (i = 0; i < header->num_satellites; i++)
+		if (satellite[i] < 0 || satellite[i] >= n)
+			return false;
+
+	for (i = 0; i < n; i++)
+	{
+		if (rec[i].name >= header->strings_size ||
+				rec[i].primary < -1 || rec[i].primary >= n ||
+				rec[i].first_satellite < 0 || rec[i].num_satellites < 0 ||
+				rec[i].num_satellites >
+				header->num_satellites - rec[i].first_satellite)
+			return false;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		if (order[i] < 0 || order[i] >= n ||
+				order_primary[i] != rec[order[i]].primary)
+			return false;
+	}
+
+	if (level[0] != 0 || level[header->num_levels] != n)
+		return false;
+	for (i = 1; i <= header->num_levels; i++)
+		if (level[i] < level[i - 1])
+			return false;
+
+	return true;
+}
+
+/* Map a cache compiled from source. Returns NULL without complaining if
+ * there's no cache or it is out of date, so the caller can fall back on
+ * the source. */
+SolarSystem *solsys_load_cache(const char *filename, const char *source)
+{
+	const CacheHeader *header;
+	const CacheBody *rec;
+	const char *names;
+	SolarSystem *solsys;
+	CacheMap *map;
+	Body **satellites;
+	int *index;
+	struct stat st;
+	size_t strings;
+	void *data;
+	int fd, i, n;
+
+	if ((fd = open(filename, O_RDONLY)) < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || st.st_size <= 0)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	/* Private and writable, so the index arrays can be handed out as they
+	 * are without anyone being able to scribble on the file */
+	data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+	{
+		log_err("Couldn't map file: %s\n", filename);
+		return NULL;
+	}
+
+	header = data;
+	strings = cache_check(header, st.st_size, filename, source);
+	if (strings == 0)
+	{
+		munmap(data, st.st_size);
+		return NULL;
+	}
+	if (!cache_check_indices(header))
+	{
+		log_err("Cache %s is corrupt\n", filename);
+		munmap(data, st.st_size);
+		return NULL;
+	}
+
+	n = header->num_bodies;
+	rec = (const CacheBody *) (header + 1);
+	index = (int *) (rec + n);
+	names = (const char *) data + strings;
+
+	solsys = solsys_create(n);
+	map = (solsys ? ralloc(solsys, CacheMap) : NULL);
+	if (map == NULL)
+	{
+		log_err("Out of memory\n");
+		ralloc_free(solsys);
+		munmap(data, st.st_size);
+		return NULL;
+	}
+	map->data = data;
+	map->size = st.st_size;
+	ralloc_set_destructor(map, cache_unmap);
+
+	satellites = ralloc_array(solsys, Body *, MAX(header->num_satellites, 1));
+	if (satellites == NULL)
+	{
+		log_err("Out of memory\n");
+		ralloc_free(solsys);
+		return NULL;
+	}
+	for (i = 0; i < header->num_satellites; i++)
+		satellites[i] = &solsys->body[index[i]];
+
+	for (i = 0; i < n; i++)
+	{
+		Body *body = &solsys->body[i];
+
+		/* The names are never written to, so they stay in the map */
+		body->name = (char *) names + rec[i].name;
+		body->mass = rec[i].mass;
+		body->grav_param = rec[i].grav_param;
+		body->radius = rec[i].radius;
+		body->type = rec[i].type;
+		body->orbit = rec[i].orbit;
+		body->primary = (rec[i].primary < 0 ? NULL :
+				&solsys->body[rec[i].primary]);
+		body->num_satellites = rec[i].num_satellites;
+		body->satellite = &satellites[rec[i].first_satellite];
+	}
+
+	solsys->order = index + header->num_satellites;
+	solsys->order_primary = solsys->order + n;
+	solsys->num_levels = header->num_levels;
+	solsys->level = solsys->order_primary + n;
+
+	log_dbg("Loaded a solarsystem with %d bodies from %s\n", n, filename);
+	return solsys;
+}
+
+static bool write_all(FILE *fd, const void *data, size_t size)
+{
+	return fwrite(data, 1, size, fd) == size;
+}
+
+/* Write the cache of a system read from source while it had the given
+ * stamp. Nothing is written if the source has changed since, as the system
+ * may be of either version.
+ *
+ * The cache goes to a temporary file first and is moved into place, so
+ * nobody ever maps half a cache. A cache that can't be written only costs
+ * time on the next load, a read-only data directory being the usual
+ * reason, so that is only reported when debugging. */
+bool solsys_save_cache(const SolarSystem *solsys, const char *filename,
+		const char *source, const CacheStamp *stamp)
+{
+	CacheHeader header;
+	CacheStamp now;
+	CacheBody rec;
+	char *tmpname;
+	FILE *fd;
+	bool ok = true;
+	int i, j;
+
+	if (!solsys_stamp_source(source, &now) || !same_stamp(&now, stamp))
+	{
+		log_dbg("%s changed while it was read, not caching it\n", source);
+		return false;
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.source_size = stamp->size;
+	header.source_mtime_sec = stamp->mtime_sec;
+	header.source_mtime_nsec = stamp->mtime_nsec;
+	memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+	header.byte_order = CACHE_BYTE_ORDER;
+	header.record_size = sizeof(CacheBody);
+	header.int_size = sizeof(int);
+	header.num_bodies = solsys->num_bodies;
+	header.num_levels = solsys->num_levels;
+	for (i = 0; i < solsys->num_bodies; i++)
+	{
+		header.num_satellites += solsys->body[i].num_satellites;
+		header.strings_size += strlen(solsys->body[i].name) + 1;
+	}
+
+	tmpname = ralloc_asprintf(NULL, "%s.tmp", filename);
+	if (tmpname == NULL)
+	{
+		log_err("Out of memory\n");
+		return false;
+	}
+	if ((fd = fopen(tmpname, "wb")) == NULL)
+	{
+		log_dbg("Couldn't open file: %s\n", tmpname);
+		ralloc_free(tmpname);
+		return false;
+	}
+
+	ok = write_all(fd, &header, sizeof(header));
+
+	header.num_satellites = 0;
+	header.strings_size = 0;
+	for (i = 0; i < solsys->num_bodies && ok; i++)
+	{
+		const Body *body = &solsys->body[i];
+
+		memset(&rec, 0, sizeof(rec));
+		rec.name = header.strings_size;
+		rec.primary = (body->primary ? body->primary - solsys->body : -1);
+		rec.type = body->type;
+		rec.first_satellite = header.num_satellites;
+		rec.num_satellites = body->num_satellites;
+		rec.mass = body->mass;
+		rec.grav_param = body->grav_param;
+		rec.radius = body->radius;
+		rec.orbit = body->orbit;
+		rec.orbit.have_last = false;
+		ok = write_all(fd, &rec, sizeof(rec));
+
+		header.num_satellites += body->num_satellites;
+		header.strings_size += strlen(body->name) + 1;
+	}
+
+	for (i = 0; i < solsys->num_bodies && ok; i++)
+	{
+		const Body *body = &solsys->body[i];
+
+		for (j = 0; j < body->num_satellites && ok; j++)
+		{
+			int index = body->satellite[j] - solsys->body;
+			ok = write_all(fd, &index, sizeof(index));
+		}
+	}
+
+	ok = ok && write_all(fd, solsys->order, solsys->num_bodies*sizeof(int));
+	ok = ok && write_all(fd, solsys->order_primary,
+			solsys->num_bodies*sizeof(int));
+	ok = ok && write_all(fd, solsys->level,
+			(solsys->num_levels + 1)*sizeof(int));
+
+	for (i = 0; i < solsys->num_bodies && ok; i++)
+		ok = write_all(fd, solsys->body[i].name,
+				strlen(solsys->body[i].name) + 1);
+
+	ok = (fclose(fd) == 0) && ok;
+	ok = ok && rename(tmpname, filename) == 0;
+	if (!ok)
+	{
+		log_dbg("Error writing cache file %s\n", filename);
+		remove(tmpname);
+	}
+
+	ralloc_free(tmpname);
+	return ok;
+}
@@ -0,0 +1,27 @@
+#ifndef KOSMOS_SOLCACHE_H
+#define KOSMOS_SOLCACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "solarsystem.h"
+
+/* A solar system compiled into a binary file: bodies with their derived
+ * orbit constants, the hierarchy as indices and the update order. Loading
+ * one maps the file and fixes up pointers, nothing is parsed.
+ *
+ * A cache remembers the size and modification time of the file it was
+ * compiled from and refuses to load once that has changed. It's tied to
+ * the machine and the build that wrote it, so it's no interchange format. */
+
+/* The size and modification time of a source file */
+typedef struct CacheStamp {
+	int64_t size;
+	int64_t mtime_sec, mtime_nsec;
+} CacheStamp;
+
+bool solsys_stamp_source(const char *source, CacheStamp *stamp);
+SolarSystem *solsys_load_cache(const char *filename, const char *source);
+bool solsys_save_cache(const SolarSystem *solsys, const char *filename,
+		const char *source, const CacheStamp *stamp);
+
+#endif
@@ -26,6 +26,8 @@ static struct STATS {
 	int cur_sample;
 	double render_tock;
 	float sample[NUM_SAMPLES]; /* Time to render one frame */
+	RenderStats render; /* Of the last frame's render queue */
+	CullStats cull;
 } STATS;
 
 void stats_begin(Font *f, Shader *text, Shader *simple)
@@ -84,6 +86,16 @@ void stats_end_of_frame(void)
 	}
 }
 
+void stats_render_queue(const RenderStats *render)
+{
+	STATS.render = *render;
+}
+
+void stats_culling(const CullStats *cull)
+{
+	STATS.cull = *cull;
+}
+
 static void graph_render(void)
 {
 	Vertex2C graph[2*NUM_SAMPLES];
@@ -150,6 +162,15 @@ void stats_render(int width, int height)
 	glmTranslate(glmModelMatrix, 0, 20, 0);
 	text_create_and_render(text_shader, font, 16, "Time: %f",
 			al_get_time() - STATS.start_time);
+	glmTranslate(glmModelMatrix, 0, 20, 0);
+	text_create_and_render(text_shader, font, 16,
+			"Draws: %d, binds: %d program %d VAO, %d skipped",
+			STATS.render.packets, STATS.render.program_binds,
+			STATS.render.vao_binds, STATS.render.redundant_binds);
+	glmTranslate(glmModelMatrix, 0, 20, 0);
+	text_create_and_render(text_shader, font, 16,
+			"Entities: %d tested, %d culled, %d drawn", STATS.cull.tested,
+			STATS.cull.culled, STATS.cull.drawn);
 
 	glUseProgram(twod_shader->program);
 	glmUniformMatrix(twod_shader->location[SHADER_UNI_P_MATRIX],
@@ -3,10 +3,14 @@
 
 #include "font.h"
 #include "shader.h"
+#include "renderqueue.h"
+#include "render.h"
 
 void stats_begin(Font *f, Shader *text, Shader *simple);
 void stats_end(void);
 void stats_end_of_frame(void);
+void stats_render_queue(const RenderStats *render);
+void stats_culling(const CullStats *cull);
 void stats_render(int width, int height);
 
 #endif
@@ -77,7 +77,8 @@ int main(int argc, char **argv)
 {
 	Font *font;
 	Light light;
-	Entity ent1, ent2;
+	Scene *scene;
+	int ent1, ent2;
 	Shader *shader, *shader_text, *shader_2d;
 	Renderable teapot;
 	const char *filename;
@@ -151,28 +152,21 @@ int main(int argc, char **argv)
 	memcpy(light.diffuse, light_diffuse, sizeof(light_diffuse));
 	memcpy(light.specular, light_specular, sizeof(light_specular));
 
-	light_upload_to_gpu(&light, shader);
-
 	teapot.data = mesh;
 	teapot.upload_to_gpu = mesh_upload_to_gpu;
 	teapot.render = mesh_render;
+	teapot.render_instanced = NULL;
 	teapot.shader = shader;
 	renderable_upload_to_gpu(&teapot);
 
-	ent1.position = target;
-	ent1.orientation = q0;
-	ent1.radius = 1;
-	ent1.renderable = &teapot;
-	ent1.prev = NULL;
-	ent1.next = &ent2;
-
-	ent2.position = target;
-	ent2.position.y += 1;
-	ent2.orientation = (Quaternion) {1/M_SQRT2, 1/M_SQRT2, 0, 0};
-	ent2.radius = 1;
-	ent2.renderable = &teapot;
-	ent2.prev = &ent1;
-	ent2.next = NULL;
+	scene = scene_new(NULL);
+	if (scene == NULL)
+		return 1;
+	ent1 = scene_add(scene, &teapot, target, q0, 1);
+	ent2 = scene_add(scene, &teapot, vec3_add(target, (Vec3) {0, 1, 0}),
+			(Quaternion) {1/M_SQRT2, 1/M_SQRT2, 0, 0}, 1);
+	if (ent1 < 0 || ent2 < 0)
+		return 1;
 
 	stats_begin(font, shader_text, shader_2d);
 
@@ -191,19 +185,21 @@ int main(int argc, char **argv)
 		glmLoadIdentity(glmViewMatrix);
 		cam_view_matrix(&cam, glmViewMatrix);
 
-		glUseProgram(shader->program);
-		/* First the lights */
+		/* First the lights, and the matrices, for every 3D shader */
 		/* No model matrix yet, location is directly in world space */
 		light.position.x = 5 * cos(M_TWO_PI*t);
 		light.position.y = 1;
 		light.position.z = 5 * sin(M_TWO_PI*t);
-		light_upload_to_gpu(&light, shader);
+		frame_upload_to_gpu(&light);
 
 		/* Now the mesh */
 		/* The model matrix is set in the entity_render code */
-		ent2.position.y = ent1.position.y + sin(M_TWO_PI*t/100);
-		ent1.orientation = q;
-		render_entity_list(&ent1);
+		scene->entity[ent2].position.y = scene->entity[ent1].position.y +
+				sin(M_TWO_PI*t/100);
+		scene->entity[ent1].orientation = q;
+		render_entity_list(scene);
+		stats_render_queue(&scene->queue->stats);
+		stats_culling(&scene->cull);
 
 		glUseProgram(shader_text->program);
 		glmLoadIdentity(glmProjectionMatrix);
@@ -217,6 +213,7 @@ int main(int argc, char **argv)
 		stats_end_of_frame();
 	}
 
+	ralloc_free(scene);
 	ralloc_free(mesh);
 
 	shader_delete(shader);
@@ -0,0 +1,225 @@
+#include <limits.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <ralloc.h>
+
+#include "keplerorbit.h"
+#include "log.h"
+#include "timeline.h"
+
+/* Cubic Hermite interpolation over an interval h is off by at most
+ * h^4/384 times the largest fourth derivative. For Kepler motion that is
+ * under 1.13 q w^4 at any eccentricity (found numerically), with q the
+ * periapsis distance and w the angular speed there. BOUND rounds that up
+ * by 10% as a margin on the numerical search. Returns the exponent of the
+ * largest power of two seconds that is short enough. */
+static int spacing_exponent(KeplerOrbit *orbit, double tolerance)
+{
+	const double BOUND = 1.25; /* 1.13, plus 10% */
+	double q = vec3_length(kepler_position_at_E(orbit, 0));
+	double w = vec3_length(kepler_velocity_at_E(orbit, 0)) / q;
+	double h = pow(384 * tolerance / (BOUND * q * SQUARE(SQUARE(w))), 0.25);
+	int exponent;
+
+	if (!(h > 1e-9)) /* A degenerate orbit, or w overflowed */
+		h = 1e-9;
+	frexp(h, &exponent);
+
+	return exponent - 1;
+}
+
+/* Keyframes of up to max_bytes for every body of solsys, accurate to within
+ * tolerance metres. Errors add
+ * up down the hierarchy, a moon's on top of its planet's, so each level
+ * below the root gets an equal share. */
+Timeline *timeline_create(void *ctx, SolarSystem *solsys, double tolerance,
+		size_t max_bytes)
+{
+	Timeline *tl;
+	int *exponent, i, c, n = solsys->num_bodies;
+	double share = tolerance / MAX(1, solsys->num_levels - 1);
+	double rate = 0; /* Body keyframes per second of time covered */
+
+	tl = rzalloc(ctx, Timeline);
+	if (tl == NULL)
+		return NULL;
+	tl->solsys = solsys;
+	tl->tolerance = tolerance;
+	tl->class_of = ralloc_array(tl, int, n);
+	tl->index_in_class = ralloc_array(tl, int, n);
+	exponent = ralloc_array(tl, int, n);
+	if (tl->class_of == NULL || tl->index_in_class == NULL ||
+			exponent == NULL)
+		goto errorout;
+
+	/* Sort the bodies into classes. There are only a few dozen of them,
+	 * so a linear search does. */
+	for (i = 0; i < n; i++)
+	{
+		Body *body = &solsys->body[solsys->order[i]];
+		TimelineClass *cls;
+
+		tl->class_of[i] = -1;
+		if (solsys->order_primary[i] < 0)
+			continue;
+
+		exponent[i] = spacing_exponent(&body->orbit, share);
+		for (c = 0; c < tl->num_classes; c++)
+			if (tl->classes[c].spacing == ldexp(1, exponent[i]))
+				break;
+		if (c == tl->num_classes)
+		{
+			cls = reralloc(tl, tl->classes, TimelineClass, c + 1);
+			if (cls == NULL)
+				goto errorout;
+			tl->classes = cls;
+			tl->num_classes++;
+			cls = &tl->classes[c];
+			memset(cls, 0, sizeof(*cls));
+			cls->spacing = ldexp(1, exponent[i]);
+		}
+		tl->class_of[i] = c;
+		tl->index_in_class[i] = tl->classes[c].num_bodies++;
+	}
+	ralloc_free(exponent);
+
+	/* Spend the budget so every class covers the same span of time, the
+	 * fast ones with more keyframes */
+	for (c = 0; c < tl->num_classes; c++)
+		rate += tl->classes[c].num_bodies / tl->classes[c].spacing;
+	tl->span = max_bytes / (2 * sizeof(Vec3) * rate);
+	for (c = 0; c < tl->num_classes; c++)
+	{
+		double capacity = floor(tl->span / tl->classes[c].spacing);
+		tl->classes[c].capacity = MAX(2, MIN(capacity, 1 << 24));
+	}
+
+	for (c = 0; c < tl->num_classes; c++)
+	{
+		TimelineClass *cls = &tl->classes[c];
+		size_t size = (size_t) cls->capacity * cls->num_bodies;
+
+		cls->member = ralloc_array(tl, int, cls->num_bodies);
+		cls->keyframe = ralloc_array(tl, long, cls->capacity);
+		cls->position = ralloc_array(tl, Vec3, size);
+		cls->velocity = ralloc_array(tl, Vec3, size);
+		if (cls->member == NULL || cls->keyframe == NULL ||
+				cls->position == NULL || cls->velocity == NULL)
+			goto errorout;
+		for (i = 0; i < cls->capacity; i++)
+			cls->keyframe[i] = LONG_MIN;
+	}
+	for (i = 0; i < n; i++)
+		if (tl->class_of[i] >= 0)
+			tl->classes[tl->class_of[i]].member[tl->index_in_class[i]] = i;
+
+	return tl;
+
+errorout:
+	log_err("Out of memory\n");
+	ralloc_free(tl);
+	return NULL;
+}
+
+size_t timeline_memory(const Timeline *tl)
+{
+	size_t bytes = 0;
+	int c;
+
+	for (c = 0; c < tl->num_classes; c++)
+		bytes += (size_t) tl->classes[c].capacity *
+				tl->classes[c].num_bodies * 2 * sizeof(Vec3);
+
+	return bytes;
+}
+
+static void compute_keyframe(Timeline *tl, TimelineClass *cls, long j,
+		int slot)
+{
+	SolarSystem *solsys = tl->solsys;
+	double t = j * cls->spacing;
+	int k, offset = slot * cls->num_bodies;
+
+	for (k = 0; k < cls->num_bodies; k++)
+	{
+		Body *body = &solsys->body[solsys->order[cls->member[k]]];
+
+		kepler_state_at_time(&body->orbit, t, &cls->position[offset + k],
+				&cls->velocity[offset + k]);
+	}
+	tl->keyframes++;
+}
+
+/* Slot for keyframe j, which is computed unless it's already there */
+static int load_keyframe(Timeline *tl, TimelineClass *cls, long j)
+{
+	int slot = j % cls->capacity;
+
+	if (slot < 0)
+		slot += cls->capacity;
+	if (cls->keyframe[slot] != j)
+	{
+		compute_keyframe(tl, cls, j, slot);
+		cls->keyframe[slot] = j;
+	}
+
+	return slot;
+}
+
+/* Set the positions of all bodies at time t, like solsys_update() does */
+void timeline_update(Timeline *tl, double t)
+{
+	SolarSystem *solsys = tl->solsys;
+	int c, i;
+
+	for (c = 0; c < tl->num_classes; c++)
+	{
+		TimelineClass *cls = &tl->classes[c];
+		double h = cls->spacing, s, s2, s3;
+		long j = (long) floor(t / h);
+
+		cls->slot0 = load_keyframe(tl, cls, j);
+		cls->slot1 = load_keyframe(tl, cls, j + 1);
+
+		s = t / h - j;
+		s2 = s * s;
+		s3 = s2 * s;
+		cls->weight[0] = 2*s3 - 3*s2 + 1;
+		cls->weight[1] = (s3 - 2*s2 + s) * h;
+		cls->weight[2] = -2*s3 + 3*s2;
+		cls->weight[3] = (s3 - s2) * h;
+	}
+
+	for (i = 0; i < solsys->num_bodies; i++)
+	{
+		Body *body = &solsys->body[solsys->order[i]];
+		int primary = solsys->order_primary[i];
+		const TimelineClass *cls;
+		const double *w;
+		int k0, k1;
+
+		if (primary < 0)
+		{
+			body->position = (Vec3) {0, 0, 0};
+			continue;
+		}
+
+		cls = &tl->classes[tl->class_of[i]];
+		w = cls->weight;
+		k0 = cls->slot0 * cls->num_bodies + tl->index_in_class[i];
+		k1 = cls->slot1 * cls->num_bodies + tl->index_in_class[i];
+		body->position.x = solsys->body[primary].position.x +
+				w[0] * cls->position[k0].x + w[1] * cls->velocity[k0].x +
+				w[2] * cls->position[k1].x + w[3] * cls->velocity[k1].x;
+		body->position.y = solsys->body[primary].position.y +
+				w[0] * cls->position[k0].y + w[1] * cls->velocity[k0].y +
+				w[2] * cls->position[k1].y + w[3] * cls->velocity[k1].y;
+		body->position.z = solsys->body[primary].position.z +
+				w[0] * cls->position[k0].z + w[1] * cls->velocity[k0].z +
+				w[2] * cls->position[k1].z + w[3] * cls->velocity[k1].z;
+	}
+
+	tl->lookups++;
+}
@@ -0,0 +1,53 @@
+#ifndef KOSMOS_TIMELINE_H
+#define KOSMOS_TIMELINE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "mathlib.h"
+#include "solarsystem.h"
+
+/* A cache of keyframes for scrubbing through time. Each body gets keyframes
+ * of its position and velocity relative to its primary, spaced so that
+ * cubic Hermite interpolation between them stays within the tolerance.
+ * Bodies with the same spacing, rounded down to a power of two seconds,
+ * share a class. Keyframe j of a class is at time j times the spacing and
+ * is computed when it is first needed, into slot j modulo the capacity.
+ * The memory budget gives every class room for the same span of time, so
+ * scrubbing back and forth within that span only ever looks up; beyond
+ * it, keyframes are replaced as it goes. Only for Kepler
+ * orbits; N-body mode has to be integrated. */
+
+typedef struct TimelineClass {
+	double spacing; /* Seconds between keyframes, a power of two */
+	int num_bodies;
+	int *member; /* Update order indices, see SolarSystem.order */
+	int capacity; /* Slots for keyframes */
+
+	long *keyframe; /* The keyframe in each slot, LONG_MIN for none */
+	Vec3 *position, *velocity; /* Slot s of member k at s*num_bodies + k */
+
+	/* Interpolation between the slots around the current time */
+	int slot0, slot1;
+	double weight[4];
+} TimelineClass;
+
+typedef struct Timeline {
+	SolarSystem *solsys;
+	double tolerance; /* Largest error in metres of any body's position */
+	double span; /* Seconds of keyframes every class has room for */
+
+	int num_classes;
+	TimelineClass *classes;
+	int *class_of; /* By update order index, -1 for roots */
+	int *index_in_class;
+
+	unsigned long keyframes; /* Keyframes computed so far */
+	unsigned long lookups; /* Calls to timeline_update() */
+} Timeline;
+
+Timeline *timeline_create(void *ctx, SolarSystem *solsys, double tolerance,
+		size_t max_bytes);
+size_t timeline_memory(const Timeline *timeline);
+void timeline_update(Timeline *timeline, double t);
+
+#endif
@@ -0,0 +1,340 @@
+#define _POSIX_C_SOURCE 200112L
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <ralloc.h>
+
+#include "log.h"
+#include "trajectory.h"
+
+#define TRAJ_MAGIC "KOSTRJ1"
+#define TRAJ_BYTE_ORDER 0x01020304u
+#define TRAJ_ALIGN 64
+
+static uint64_t align(uint64_t offset)
+{
+	return (offset + TRAJ_ALIGN - 1) / TRAJ_ALIGN * TRAJ_ALIGN;
+}
+
+/* Bytes of the first num_steps rows, including the key rows of the blocks
+ * they are in */
+static uint64_t rows_size(TrajFormat format, uint64_t num_bodies,
+		uint64_t num_steps)
+{
+	uint64_t doubles = 3 * num_bodies * sizeof(double);
+	uint64_t floats = 3 * num_bodies * sizeof(float);
+
+	switch (format)
+	{
+	case TRAJ_DOUBLE:
+		return num_steps * doubles;
+	case TRAJ_FLOAT:
+		return num_steps * floats;
+	case TRAJ_DELTA:
+		return (num_steps + TRAJ_BLOCK - 1) / TRAJ_BLOCK * doubles +
+				num_steps * floats;
+	}
+
+	return 0;
+}
+
+/* Would rows_size() overflow? Every format takes at most a double and a
+ * float per coordinate per step. */
+static bool rows_size_overflows(uint64_t num_bodies, uint64_t num_steps)
+{
+	uint64_t step_bytes = 3 * num_bodies * (sizeof(double) + sizeof(float));
+
+	return step_bytes > 0 && num_steps > UINT64_MAX / step_bytes;
+}
+
+static void traj_writer_close(void *ptr)
+{
+	TrajWriter *writer = ptr;
+
+	if (writer->fd != NULL)
+		fclose(writer->fd);
+}
+
+/* Start a file of num_steps rows for the bodies with the given paths. No
+ * more than TRAJ_MAX_STEPS, or it couldn't be read back. */
+TrajWriter *traj_create(void *ctx, const char *filename, TrajFormat format,
+		const char **path, int num_bodies, double start, double step,
+		long num_steps)
+{
+	TrajWriter *writer;
+	TrajHeader header;
+	uint64_t offset;
+	int i;
+
+	if (num_bodies < 0 || num_steps < 0 || num_steps > TRAJ_MAX_STEPS)
+	{
+		log_err("Can't write a trajectory of %ld steps\n", num_steps);
+		return NULL;
+	}
+
+	writer = rzalloc(ctx, TrajWriter);
+	if (writer == NULL)
+		goto errorout;
+	writer->format = format;
+	writer->num_bodies = num_bodies;
+	writer->num_steps = num_steps;
+	writer->key = ralloc_array(writer, double, 3 * num_bodies);
+	writer->buffer = ralloc_array(writer, float, 3 * num_bodies);
+	if (writer->key == NULL || writer->buffer == NULL)
+		goto errorout;
+	ralloc_set_destructor(writer, traj_writer_close);
+
+	if ((writer->fd = fopen(filename, "wb")) == NULL)
+	{
+		log_err("Couldn't open file: %s\n", filename);
+		ralloc_free(writer);
+		return NULL;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRAJ_MAGIC, sizeof(header.magic));
+	header.byte_order = TRAJ_BYTE_ORDER;
+	header.format = format;
+	header.num_bodies = num_bodies;
+	header.num_steps = num_steps;
+	header.start = start;
+	header.step = step;
+	header.paths = offset = sizeof(header);
+	for (i = 0; i < num_bodies; i++)
+		offset += strlen(path[i]) + 1;
+	header.rows = align(offset);
+
+	if (fwrite(&header, sizeof(header), 1, writer->fd) != 1)
+		goto writeerror;
+	for (i = 0; i < num_bodies; i++)
+		if (fwrite(path[i], strlen(path[i]) + 1, 1, writer->fd) != 1)
+			goto writeerror;
+	for (; offset < header.rows; offset++)
+		if (fputc(0, writer->fd) == EOF)
+			goto writeerror;
+
+	return writer;
+
+writeerror:
+	log_err("Error writing trajectory file %s\n", filename);
+	ralloc_free(writer);
+	return NULL;
+
+errorout:
+	log_err("Out of memory\n");
+	ralloc_free(writer);
+	return NULL;
+}
+
+/* Append rows of 3*num_bodies doubles each */
+bool traj_write(TrajWriter *writer, const double *rows, int num_rows)
+{
+	size_t n = 3 * writer->num_bodies;
+	FILE *fd = writer->fd;
+	int r;
+	size_t k;
+
+	if (num_rows > writer->num_steps - writer->written)
+	{
+		log_err("More rows than the trajectory has steps\n");
+		return false;
+	}
+
+	if (writer->format == TRAJ_DOUBLE)
+	{
+		writer->written += num_rows;
+		return fwrite(rows, sizeof(double) * n, num_rows, fd) ==
+				(size_t) num_rows;
+	}
+
+	for (r = 0; r < num_rows; r++, rows += n)
+	{
+		if (writer->format == TRAJ_FLOAT)
+		{
+			for (k = 0; k < n; k++)
+				writer->buffer[k] = rows[k];
+		} else
+		{
+			if (writer->written % TRAJ_BLOCK == 0)
+			{
+				memcpy(writer->key, rows, n * sizeof(double));
+				if (fwrite(writer->key, sizeof(double), n, fd) != n)
+					return false;
+			}
+			for (k = 0; k < n; k++)
+				writer->buffer[k] = rows[k] - writer->key[k];
+		}
+
+		if (fwrite(writer->buffer, sizeof(float), n, fd) != n)
+			return false;
+		writer->written++;
+	}
+
+	return true;
+}
+
+/* Finish the file and free the writer. Fails if not all steps were
+ * written. */
+bool traj_close(TrajWriter *writer)
+{
+	bool ok = writer->written == writer->num_steps;
+
+	if (!ok)
+		log_err("Trajectory has %ld of its %ld steps\n", writer->written,
+				writer->num_steps);
+	ok = (fclose(writer->fd) == 0) && ok;
+	writer->fd = NULL;
+	ralloc_free(writer);
+
+	return ok;
+}
+
+static void traj_unmap(void *ptr)
+{
+	Trajectory *traj = ptr;
+
+	munmap((void *) traj->header, traj->size);
+}
+
+static bool traj_attach(Trajectory *traj)
+{
+	const TrajHeader *header = traj->header;
+	const char *data = (const char *) header, *p, *end;
+	uint32_t i;
+
+	if (traj->size < sizeof(*header) ||
+			memcmp(header->magic, TRAJ_MAGIC, sizeof(header->magic)) != 0)
+	{
+		log_err("Not a trajectory file\n");
+		return false;
+	}
+	if (header->byte_order != TRAJ_BYTE_ORDER)
+	{
+		log_err("Trajectory was written with a different byte order\n");
+		return false;
+	}
+	if (header->format > TRAJ_DELTA || header->num_bodies > INT32_MAX ||
+			header->num_steps > TRAJ_MAX_STEPS ||
+			header->paths < sizeof(*header) ||
+			header->rows % TRAJ_ALIGN != 0 ||
+			header->paths > header->rows || header->rows > traj->size ||
+			rows_size_overflows(header->num_bodies, header->num_steps) ||
+			traj->size - header->rows < rows_size(header->format,
+					header->num_bodies, header->num_steps))
+	{
+		log_err("Trajectory is truncated or corrupt\n");
+		return false;
+	}
+
+	traj->path = ralloc_array(traj, const char *, header->num_bodies);
+	if (traj->path == NULL)
+	{
+		log_err("Out of memory\n");
+		return false;
+	}
+	p = data + header->paths;
+	end = data + header->rows;
+	for (i = 0; i < header->num_bodies; i++)
+	{
+		traj->path[i] = p;
+		while (p < end && *p != '\0')
+			p++;
+		if (p++ == end)
+		{
+			log_err("Trajectory body paths are corrupt\n");
+			return false;
+		}
+	}
+
+	traj->num_bodies = header->num_bodies;
+	traj->num_steps = header->num_steps;
+	traj->start = header->start;
+	traj->step = header->step;
+	traj->format = header->format;
+
+	return true;
+}
+
+Trajectory *traj_load(const char *filename)
+{
+	Trajectory *traj;
+	struct stat st;
+	void *data;
+	int fd;
+
+	if ((fd = open(filename, O_RDONLY)) < 0)
+	{
+		log_err("Couldn't open file: %s\n", filename);
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size <= 0)
+	{
+		log_err("Couldn't determine size of file: %s\n", filename);
+		close(fd);
+		return NULL;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+	{
+		log_err("Couldn't map file: %s\n", filename);
+		return NULL;
+	}
+
+	traj = rzalloc(NULL, Trajectory);
+	if (traj == NULL)
+	{
+		log_err("Out of memory\n");
+		munmap(data, st.st_size);
+		return NULL;
+	}
+	traj->header = data;
+	traj->size = st.st_size;
+	ralloc_set_destructor(traj, traj_unmap);
+
+	if (!traj_attach(traj))
+	{
+		log_err("Couldn't load trajectory from file: %s\n", filename);
+		ralloc_free(traj);
+		return NULL;
+	}
+
+	return traj;
+}
+
+/* Position of a body at a step, which had better be in range */
+Vec3 traj_position(const Trajectory *traj, int body, long step)
+{
+	const char *rows = (const char *) traj->header + traj->header->rows;
+	const double *key;
+	const float *f;
+	long block;
+
+	switch (traj->format)
+	{
+	case TRAJ_DOUBLE:
+		key = (const double *) rows + 3 * ((size_t) step *
+				traj->num_bodies + body);
+		return (Vec3) {key[0], key[1], key[2]};
+	case TRAJ_FLOAT:
+		f = (const float *) rows + 3 * ((size_t) step *
+				traj->num_bodies + body);
+		return (Vec3) {f[0], f[1], f[2]};
+	case TRAJ_DELTA:
+		block = step / TRAJ_BLOCK;
+		rows += rows_size(TRAJ_DELTA, traj->num_bodies, block * TRAJ_BLOCK);
+		key = (const double *) rows + 3 * body;
+		f = (const float *) ((const double *) rows + 3 * traj->num_bodies) +
+				3 * ((size_t) (step - block * TRAJ_BLOCK) *
+				traj->num_bodies + body);
+		return (Vec3) {key[0] + f[0], key[1] + f[1], key[2] + f[2]};
+	}
+
+	return (Vec3) {0, 0, 0};
+}
@@ -0,0 +1,77 @@
+#ifndef KOSMOS_TRAJECTORY_H
+#define KOSMOS_TRAJECTORY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "mathlib.h"
+
+/* Positions of every body relative to the root at evenly spaced times, as
+ * written by ephemgen. Like the Chebyshev ephemeris, the file layout is
+ * the memory layout: a header, the body paths and then the rows, so a
+ * reader can map it and index straight into it. Row s holds the x, y and
+ * z of every body in turn at time start + s*step.
+ *
+ * TRAJ_DOUBLE rows are doubles and TRAJ_FLOAT rows floats. TRAJ_DELTA
+ * groups the rows in blocks of TRAJ_BLOCK; a block is one row of doubles
+ * for its first step, followed by TRAJ_BLOCK rows of floats that are the
+ * offsets from it. That keeps any step two lookups away while the error
+ * only grows with how far a body moves within a block. The last block is
+ * cut short after the last row. Files are only readable on machines with
+ * the same byte order. */
+
+#define TRAJ_BLOCK 64
+#define TRAJ_MAX_STEPS INT32_MAX /* Longest file traj_load() reads */
+
+typedef enum TrajFormat {
+	TRAJ_DOUBLE,
+	TRAJ_FLOAT,
+	TRAJ_DELTA
+} TrajFormat;
+
+typedef struct TrajHeader {
+	char magic[8];
+	uint32_t byte_order; /* TRAJ_BYTE_ORDER as written by the creator */
+	uint32_t format; /* A TrajFormat */
+	uint32_t num_bodies;
+	uint32_t reserved;
+	uint64_t num_steps;
+	double start, step; /* In seconds */
+	/* Byte offsets from the start of the file. The paths, like
+	 * "Sol/Earth/Moon", are NUL terminated one after the other in body
+	 * order. The rows start on a 64 byte boundary. */
+	uint64_t paths, rows;
+} TrajHeader;
+
+typedef struct Trajectory {
+	int num_bodies;
+	long num_steps;
+	double start, step;
+	TrajFormat format;
+	const char **path; /* Into the mapping */
+
+	const TrajHeader *header;
+	size_t size;
+} Trajectory;
+
+/* Writing goes a block of rows at a time */
+typedef struct TrajWriter {
+	FILE *fd;
+	TrajFormat format;
+	int num_bodies;
+	long num_steps, written;
+	double *key; /* The first row of the current block, for TRAJ_DELTA */
+	float *buffer;
+} TrajWriter;
+
+TrajWriter *traj_create(void *ctx, const char *filename, TrajFormat format,
+		const char **path, int num_bodies, double start, double step,
+		long num_steps);
+bool traj_write(TrajWriter *writer, const double *rows, int num_rows);
+bool traj_close(TrajWriter *writer);
+
+Trajectory *traj_load(const char *filename);
+Vec3 traj_position(const Trajectory *traj, int body, long step);
+
+#endif
@@ -1,4 +1,6 @@
+#define _POSIX_C_SOURCE 199309L
 #include <stdio.h>
+#include <time.h>
 
 #include "util.h"
 
@@ -39,3 +41,13 @@ long fsize(FILE *stream)
 
 	return size;
 }
+
+/* Seconds on a monotonic clock, for timing code without a display */
+double wall_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec*1e-9;
+}
@@ -8,5 +8,6 @@
 
 const char *path_filename(const char *name);
 long fsize(FILE *stream);
+double wall_time(void);
 
 #endif
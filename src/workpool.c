@@ -0,0 +1,159 @@
+#include <stdbool.h>
+#include <pthread.h>
+#include <ralloc.h>
+
+#include "log.h"
+#include "workpool.h"
+
+struct WorkPool {
+	int num_threads; /* Including the thread calling workpool_run() */
+	int num_workers; /* Threads actually started */
+
+	pthread_mutex_t lock;
+	pthread_cond_t start; /* A new job has been posted */
+	pthread_cond_t done; /* The last worker has left the job */
+
+	/* The current job, protected by the lock */
+	WorkFunc func;
+	void *data;
+	int count, chunk;
+	int next; /* First item that hasn't been handed out yet */
+	int busy; /* Workers still inside the job */
+	unsigned long generation; /* Bumped for every job */
+	bool quit;
+
+	/* Not a child allocation, which ralloc would free before the
+	 * destructor has joined the threads */
+	pthread_t worker[];
+};
+
+/* Hand out chunks until the job runs dry. Called with the lock held. */
+static void work(WorkPool *pool)
+{
+	while (pool->next < pool->count)
+	{
+		int begin = pool->next;
+		int end = begin + pool->chunk;
+
+		if (end > pool->count)
+			end = pool->count;
+		pool->next = end;
+
+		pthread_mutex_unlock(&pool->lock);
+		pool->func(pool->data, begin, end);
+		pthread_mutex_lock(&pool->lock);
+	}
+}
+
+static void *worker_main(void *arg)
+{
+	WorkPool *pool = arg;
+	unsigned long seen = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;)
+	{
+		while (!pool->quit && pool->generation == seen)
+			pthread_cond_wait(&pool->start, &pool->lock);
+		if (pool->quit)
+			break;
+		seen = pool->generation;
+
+		pool->busy++;
+		work(pool);
+		if (--pool->busy == 0)
+			pthread_cond_signal(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+static void workpool_destroy(void *ptr)
+{
+	WorkPool *pool = ptr;
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = true;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->num_workers; i++)
+		pthread_join(pool->worker[i], NULL);
+
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->start);
+	pthread_mutex_destroy(&pool->lock);
+}
+
+/* A pool of num_threads - 1 worker threads, which help out the thread that
+ * calls workpool_run(). They are stopped when the pool is freed. */
+WorkPool *workpool_create(void *ctx, int num_threads)
+{
+	WorkPool *pool;
+	int i;
+
+	if (num_threads < 1)
+		num_threads = 1;
+
+	pool = rzalloc_size(ctx, sizeof(WorkPool) + num_threads *
+			sizeof(pthread_t));
+	if (pool == NULL)
+		return NULL;
+	pool->num_threads = num_threads;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	ralloc_set_destructor(pool, workpool_destroy);
+
+	for (i = 0; i < num_threads - 1; i++)
+	{
+		if (pthread_create(&pool->worker[i], NULL, worker_main, pool) != 0)
+		{
+			log_err("Couldn't start worker thread %d\n", i);
+			break;
+		}
+		pool->num_workers++;
+	}
+
+	return pool;
+}
+
+int workpool_num_threads(const WorkPool *pool)
+{
+	return (pool != NULL ? pool->num_workers + 1 : 1);
+}
+
+/* Call func on chunks of [0, count) from all threads of the pool, and wait
+ * until every chunk is done. Without a pool the caller does it all in one
+ * go. */
+void workpool_run(WorkPool *pool, WorkFunc func, void *data, int count,
+		int chunk)
+{
+	if (chunk < 1)
+		chunk = 1;
+
+	/* Not worth waking anybody up for */
+	if (pool == NULL || pool->num_workers == 0 || count <= chunk)
+	{
+		if (count > 0)
+			func(data, 0, count);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->func = func;
+	pool->data = data;
+	pool->count = count;
+	pool->chunk = chunk;
+	pool->next = 0;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->start);
+
+	work(pool);
+	while (pool->busy > 0)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
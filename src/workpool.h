@@ -0,0 +1,14 @@
+#ifndef KOSMOS_WORKPOOL_H
+#define KOSMOS_WORKPOOL_H
+
+/* Does the part [begin, end) of a job */
+typedef void (*WorkFunc)(void *data, int begin, int end);
+
+typedef struct WorkPool WorkPool;
+
+WorkPool *workpool_create(void *ctx, int num_threads);
+int workpool_num_threads(const WorkPool *pool);
+void workpool_run(WorkPool *pool, WorkFunc func, void *data, int count,
+		int chunk);
+
+#endif